@@ -0,0 +1,196 @@
+/************************
+
+   I2C/SPI Backend Benchmark
+
+   Compares the register level
+   backend (/dev/mem, root) with
+   the kernel driver backend
+   (/dev/i2c-N, /dev/spidevB.C)
+
+************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "rpi.h"
+
+/**
+ * Circuit Setup
+ *
+ * Any I2C device at address 0x18 (e.g. MCP9808) on I2C bus 1,
+ * and MOSI connected to MISO for the SPI loopback test.
+ * The software SPI test uses GPIO 5 (SCLK) and 6 (MOSI), with
+ * GPIO 6 connected to GPIO 13 (MISO).
+ *
+ * Usage:
+ *
+ * $ sudo ./bench mem		register level backend
+ * $ ./bench dev		kernel driver backend, /dev/i2c-1 and /dev/spidev0.0
+ * $ ./bench dev <bus>		kernel driver backend on /dev/i2c-<bus>
+ *
+ * The kernel bcm2835 I2C driver takes a read only as the last message of a
+ * call, so on the Pi each write+read transaction of the batch still needs its
+ * own I2C_RDWR call. Adapters without that limit get the whole batch per call.
+ *
+ * Off-target test of the kernel I2C path, without SPI if there is no spidev:
+ *
+ * $ sudo modprobe i2c-stub chip_addr=0x18
+ * $ ./bench dev $(i2cdetect -l | awk '/SMBus stub/ {sub("i2c-", "", $1); print $1}')
+ */
+
+#define I2C_ADDR	0x18
+#define I2C_COUNT	2048	/* a multiple of the batch size */
+#define SPI_LEN		4096
+#define SPI_COUNT	200
+
+/* software SPI pins, MOSI connected to MISO */
+#define SOFT_SCLK	5
+#define SOFT_MOSI	6
+#define SOFT_MISO	13
+
+static char spi_wbuf[SPI_LEN];
+static char spi_rbuf[SPI_LEN];
+
+/* elapsed time in seconds */
+static double elapsed(struct timespec *t0)
+{
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+/* register pointer write + 2 byte read, one transaction at a time and batched */
+void i2c_bench(void){
+
+	struct i2c_xfer x[32];
+	struct timespec t0;
+	char reg = 0x05;
+	char rbuf[32][2];
+	unsigned i, j, errors = 0;
+	double t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(i = 0; i < I2C_COUNT; i++){
+		errors += i2c_transfer(I2C_ADDR, &reg, 1, rbuf[0], 2) != 0;
+	}
+	t = elapsed(&t0);
+	printf("i2c single:  %8.0f transactions/s  (%u errors)\n", I2C_COUNT / t, errors);
+
+	for(j = 0; j < 32; j++){
+		x[j] = (struct i2c_xfer){ I2C_ADDR, &reg, 1, rbuf[j], 2, 0 };
+	}
+
+	errors = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(i = 0; i < I2C_COUNT; i += 32){
+		errors += i2c_batch(x, 32);
+	}
+	t = elapsed(&t0);
+	printf("i2c batch32: %8.0f transactions/s  (%u errors)\n", I2C_COUNT / t, errors);
+}
+
+/* full-duplex loopback transfers */
+void spi_bench(void){
+
+	struct timespec t0;
+	unsigned i, errors = 0;
+	double t;
+
+	for(i = 0; i < SPI_LEN; i++){
+		spi_wbuf[i] = (char)i;
+	}
+
+	spi_set_speed_hz(8000000);
+	spi_set_data_mode(0);
+	spi_chip_select(0);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(i = 0; i < SPI_COUNT; i++){
+		spi_data_transfer(spi_wbuf, spi_rbuf, SPI_LEN);
+		errors += memcmp(spi_wbuf, spi_rbuf, SPI_LEN) != 0;
+	}
+	t = elapsed(&t0);
+	printf("spi:         %8.0f kB/s  (%u loopback mismatches)\n", SPI_COUNT * SPI_LEN / t / 1000, errors);
+}
+
+/* GPIO toggle limit compared with the software SPI bit rate */
+void soft_spi_bench(void){
+
+	struct soft_spi bus;
+	struct timespec t0;
+	uint32_t wbuf[256], rbuf[256];
+	unsigned i, errors = 0;
+	double t;
+
+	gpio_output(SOFT_SCLK);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(i = 0; i < 1000000; i++){
+		gpio_write_mask(1UL << SOFT_SCLK, (i & 1) ? 1UL << SOFT_SCLK : 0);
+	}
+	t = elapsed(&t0);
+	printf("gpio toggle: %8.0f kHz\n", 1000000 / t / 2 / 1000);
+
+	soft_spi_init(&bus, SOFT_SCLK, SOFT_MOSI, SOFT_MISO, SOFT_SPI_NONE, 0, 8, 0, 0);
+	for(i = 0; i < 256; i++){
+		wbuf[i] = i;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(i = 0; i < 1000; i++){
+		soft_spi_transfer(&bus, wbuf, rbuf, 256);
+		errors += memcmp(wbuf, rbuf, sizeof(wbuf)) != 0;
+	}
+	t = elapsed(&t0);
+	printf("soft spi:    %8.0f kbit/s  (%u loopback mismatches)\n", 1000.0 * 256 * 8 / t / 1000, errors);
+
+	gpio_input(SOFT_SCLK);
+	gpio_input(SOFT_MOSI);
+}
+
+/************
+
+    main
+
+*************/
+int main(int argc, char *argv[]){
+
+	int kernel = argc > 1 && strcmp(argv[1], "dev") == 0;
+	int spi = 1;
+	uint8_t bus = argc > 2 ? (uint8_t)atoi(argv[2]) : 1;
+
+	if(kernel){
+		puts("kernel driver backend");
+		if(!i2c_open_dev(bus)){
+			exit(1);
+		}
+		spi = spi_open_dev(0, 0);
+	}
+	else{
+		puts("register level backend");
+		rpi_init();
+	}
+
+	i2c_start();
+	i2c_data_transfer_speed(400000);
+	i2c_bench();
+	i2c_stop();
+
+	if(spi){
+		spi_start();
+		spi_bench();
+		spi_stop();
+	}
+
+	if(kernel){
+		i2c_close_dev();
+		if(spi){
+			spi_close_dev();
+		}
+	}
+	else{
+		soft_spi_bench();
+		rpi_close();
+	}
+	return 0;
+}
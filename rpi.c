@@ -17,18 +17,29 @@
  *
  */
 
-#define  _DEFAULT_SOURCE	// for nanosleep() and usleep()
+#define  _GNU_SOURCE	// for nanosleep(), usleep() and pthread_setaffinity_np()
+#define  _FILE_OFFSET_BITS 64	// 64-bit off_t for mmap() and ftruncate() on 32-bit Pi OS
 
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <errno.h>
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <linux/futex.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <linux/spi/spidev.h>
 
 #include "rpi.h"
 
@@ -40,12 +51,20 @@
 #define SPI0_BASE		(peri_base + 0x204000)
 #define BSC0_BASE 		(peri_base + 0x205000)
 #define BSC1_BASE	      	(peri_base + 0x804000)
+#define BSC_SL_BASE		(peri_base + 0x214000)
+#define AUX_BASE		(peri_base + 0x215000)
+#define UART0_BASE		(peri_base + 0x201000)
+#define PCM_BASE		(peri_base + 0x203000)
+#define DMA_BASE		(peri_base + 0x007000)
 
 /* Minimum amount of memory that will be fetched by the Arm Processor's MMU (memory management unit) during memory access */
 #define BLOCK_SIZE 		(4*1024) 
 
 /* No. of memory address pointers for mmap() */ 
-#define BASE_INDEX 		7
+#define BASE_INDEX 		12
+
+/* No. of peripherals reset to 0 at start-up, the others are set up by their own start functions */
+#define CLEAN_INDEX 		7
 
 /* System timer register addresses */
 #define CS	(base_pointer[0] + 0x0) 
@@ -56,6 +75,8 @@
 /* Clk register addresses */
 #define GPCTL	(base_pointer[1] + 0x28) 
 #define GPDIV	(base_pointer[1] + 0x29) 
+#define CM_PCMCTL	(base_pointer[1] + 0x26)
+#define CM_PCMDIV	(base_pointer[1] + 0x27)
 
 /*
  * GPIO register addresses
@@ -85,6 +106,7 @@
 #define FIF1	(CTL + 0x18/4)
 #define RNG2    (CTL + 0x20/4)
 #define DAT2	(CTL + 0x24/4)
+#define PWM_DMAC	(CTL + 0x8/4)
 
 /* SPI register addresses */
 #define SPI_CS 		(base_pointer[4] + 0x0)  
@@ -105,6 +127,52 @@
 #define DEL	(C + 0x18/4) 
 #define CLKT	(C + 0x1C/4) 
 
+/* BSC/SPI slave register addresses */
+#define SL_DR	(base_pointer[7] + 0x0)
+#define SL_RSR	(SL_DR + 0x4/4)
+#define SL_SLV	(SL_DR + 0x8/4)
+#define SL_CR	(SL_DR + 0xC/4)
+#define SL_FR	(SL_DR + 0x10/4)
+#define SL_IFLS	(SL_DR + 0x14/4)
+#define SL_IMSC	(SL_DR + 0x18/4)
+#define SL_RIS	(SL_DR + 0x1C/4)
+#define SL_ICR	(SL_DR + 0x24/4)
+
+/* Auxiliary peripherals register addresses, SPI1 and SPI2 register offsets */
+#define AUX_ENABLES	(base_pointer[8] + 0x4/4)
+#define AUX_SPI1	(base_pointer[8] + 0x80/4)
+#define AUX_SPI2	(base_pointer[8] + 0xC0/4)
+#define AUX_SPI_CNTL0	(0x0/4)
+#define AUX_SPI_CNTL1	(0x4/4)
+#define AUX_SPI_STAT	(0x8/4)
+#define AUX_SPI_IO	(0x20/4)
+#define AUX_SPI_TXHOLD	(0x30/4)
+
+/* PL011 UART0 register addresses */
+#define UART_DR		(base_pointer[9] + 0x0)
+#define UART_RSR	(UART_DR + 0x4/4)
+#define UART_FR		(UART_DR + 0x18/4)
+#define UART_IBRD	(UART_DR + 0x24/4)
+#define UART_FBRD	(UART_DR + 0x28/4)
+#define UART_LCRH	(UART_DR + 0x2C/4)
+#define UART_CR		(UART_DR + 0x30/4)
+#define UART_IFLS	(UART_DR + 0x34/4)
+#define UART_IMSC	(UART_DR + 0x38/4)
+#define UART_RIS	(UART_DR + 0x3C/4)
+#define UART_ICR	(UART_DR + 0x44/4)
+
+/* PCM/I2S register addresses */
+#define PCM_CS_A	(base_pointer[10] + 0x0)
+#define PCM_FIFO_A	(PCM_CS_A + 0x4/4)
+#define PCM_MODE_A	(PCM_CS_A + 0x8/4)
+#define PCM_RXC_A	(PCM_CS_A + 0xC/4)
+#define PCM_TXC_A	(PCM_CS_A + 0x10/4)
+#define PCM_DREQ_A	(PCM_CS_A + 0x14/4)
+#define PCM_INTEN_A	(PCM_CS_A + 0x18/4)
+
+/* DMA global enable register, channel registers are at base_pointer[11] + ch * 0x100 */
+#define DMA_ENABLE	(base_pointer[11] + 0xFF0/4)
+
 /* Peripheral base address variable. The value of which will be determined depending whether the board is RPi 1, 2 or 3 at compile time */
 static uint32_t peri_base = 0;
 
@@ -203,6 +271,11 @@ void rpi_init() {
         base_add[4] = SPI0_BASE;
 	base_add[5] = BSC0_BASE;
 	base_add[6] = BSC1_BASE;
+	base_add[7] = BSC_SL_BASE;
+	base_add[8] = AUX_BASE;
+	base_add[9] = UART0_BASE;
+	base_add[10] = PCM_BASE;
+	base_add[11] = DMA_BASE;
 
         /* Using mmap, iterate through each base address to get each peripheral base register address */   
         for(i = 0; i < BASE_INDEX; i++){
@@ -217,7 +290,9 @@ void rpi_init() {
         	}
 	
 		/* Initialize all peripheral base registers to 0 for a clean start-up */
-        	*base_pointer[i] = 0x0;
+		if(i < CLEAN_INDEX){
+        		*base_pointer[i] = 0x0;
+		}
 
     		/* Reset each array base address to 0 */
                 base_add[i] = 0;
@@ -227,6 +302,105 @@ void rpi_init() {
 	close(fd);
 }
 
+/*
+ * VideoCore mailbox property interface (/dev/vcio), used to query the firmware
+ * for the real clock rates. Does not need root access.
+ */
+#define MBOX_PROPERTY 	_IOWR(100, 0, char *)
+#define MBOX_CLK_UART	2
+#define MBOX_CLK_CORE	4
+
+/* Send a property message to the firmware, returns 0 on success */
+static int mbox_property(uint32_t *msg)
+{
+	int fd = open("/dev/vcio", 0);
+	int ret;
+
+	if(fd < 0){
+		return -1;
+	}
+	ret = ioctl(fd, MBOX_PROPERTY, msg);
+	close(fd);
+
+	/* response code 0x80000000 = request successful */
+	return (ret < 0 || msg[1] != 0x80000000) ? -1 : 0;
+}
+
+/* Get the current rate in Hz of a firmware clock, 0 if it cannot be read */
+static uint32_t mbox_clock_rate(uint32_t clk_id)
+{
+	uint32_t msg[8] __attribute__((aligned(16)));
+
+	msg[0] = sizeof(msg);	// buffer size
+	msg[1] = 0;		// process request
+	msg[2] = 0x00030002;	// tag: get clock rate
+	msg[3] = 8;		// value buffer size
+	msg[4] = 0;		// request
+	msg[5] = clk_id;
+	msg[6] = 0;
+	msg[7] = 0;		// end tag
+
+	if(mbox_property(msg) < 0){
+		return 0;
+	}
+	return msg[6];
+}
+
+/* Last core clock frequency read from the firmware, and a counter of its changes */
+static uint32_t core_clock = 0;
+static uint32_t core_clock_gen = 0;
+
+/*
+ * Query the firmware for the core clock frequency again, e.g. after a frequency
+ * change from throttling. Returns the current core clock frequency in Hz.
+ * Speeds set in Hz (i2c_set_speed(), spi_set_speed_hz(), spi_device_set_speed()) are
+ * recomputed on next use. The transfer functions also poll the clock every 100 ms.
+ */
+uint32_t rpi_core_clock_refresh(void)
+{
+	uint32_t clk = mbox_clock_rate(MBOX_CLK_CORE);
+
+	if(clk == 0){
+		clk = system_clock;
+	}
+	if(clk != core_clock){
+		core_clock = clk;
+		core_clock_gen++;
+	}
+	return core_clock;
+}
+
+/*
+ * Get the core (VPU) clock frequency in Hz which clocks the I2C and SPI peripherals.
+ * Falls back to the board default if the firmware cannot be queried.
+ */
+uint32_t rpi_core_clock(void)
+{
+	return core_clock ? core_clock : rpi_core_clock_refresh();
+}
+
+#define CORE_CLOCK_POLL_MS	100
+
+/*
+ * Query the firmware at most every CORE_CLOCK_POLL_MS from the transfer paths,
+ * so speeds set in Hz follow a core clock change without the application calling
+ * rpi_core_clock_refresh(). Returns the core clock generation, internal use only.
+ */
+static uint32_t core_clock_poll(void)
+{
+	static _Atomic uint64_t due = 0;
+	struct timespec t;
+	uint64_t now, next;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &t);
+	now = (uint64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+	next = atomic_load_explicit(&due, memory_order_relaxed);
+	if(now >= next && atomic_compare_exchange_strong(&due, &next, now + CORE_CLOCK_POLL_MS)){
+		rpi_core_clock_refresh();
+	}
+	return core_clock_gen;
+}
+
 /* Close the library and reset all memory pointers to 0 or NULL */
 uint8_t rpi_close()
 {
@@ -287,6 +461,150 @@ void mswait(uint32_t ms) {
             req.tv_nsec = rem.tv_nsec;
 }
 
+/*
+ * Read the free running 64-bit system timer (1 MHz), internal use only.
+ * CHI is read before and after CLO in case CLO rolls over in between.
+ * Falls back to the monotonic clock if the system timer is not mapped.
+ */
+static uint64_t st_read(void)
+{
+	uint32_t hi, lo;
+
+	/* not mapped, e.g. using the kernel driver backends without root */
+	if(base_pointer[0] == NULL){
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	}
+
+	do {
+		__sync_synchronize();
+		hi = *CHI;
+		lo = *CLO;
+		__sync_synchronize();
+	} while (hi != *CHI);
+
+	return ((uint64_t)hi << 32) | lo;
+}
+
+/******************************************
+
+    Lock-free Ring Buffer Functions
+
+*******************************************/
+/*
+ * Single producer, single consumer ring of fixed size elements, internal use only.
+ * The producer only writes head and the consumer only writes tail, so the two
+ * sides never block each other (e.g. an engine thread and the application).
+ * The number of elements is rounded up to a power of 2.
+ */
+struct ring {
+	uint8_t *buf;
+	uint32_t size;		/* no. of elements, power of 2 */
+	uint32_t esize;		/* element size in bytes */
+	_Atomic uint32_t head;	/* next element to write */
+	_Atomic uint32_t tail;	/* next element to read */
+	_Atomic uint32_t users;	/* application calls inside ring_enter()/ring_leave(), rings are static so it starts at 0 */
+};
+
+/* Allocate a ring of at least count elements, returns 0 on failure */
+static int ring_init(struct ring *r, uint32_t count, uint32_t esize)
+{
+	uint32_t size = 1;
+
+	while(size < count){
+		size <<= 1;
+	}
+	r->buf = calloc(size, esize);
+	if(r->buf == NULL){
+		return 0;
+	}
+	r->size = size;
+	r->esize = esize;
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	/* users is left alone, a ring_enter() that is about to fail may still hold it */
+	return 1;
+}
+
+static void ring_free(struct ring *r)
+{
+	free(r->buf);
+	r->buf = NULL;
+}
+
+/*
+ * Application side access to a ring owned by an engine, returns 0 unless
+ * *running is 1 (engine running, or channel open). The user count is raised before running is checked, so a stop
+ * function that clears running and then calls ring_retire() either sees the user
+ * or is seen by it, and never frees the ring under a ring_read()/ring_write().
+ */
+static int ring_enter(struct ring *r, atomic_int *running)
+{
+	atomic_fetch_add(&r->users, 1);
+	if(atomic_load(running) != 1){
+		atomic_fetch_sub(&r->users, 1);
+		return 0;
+	}
+	return 1;
+}
+
+static void ring_leave(struct ring *r)
+{
+	atomic_fetch_sub(&r->users, 1);
+}
+
+/* Wait for the application calls still inside the ring to leave, then free it */
+static void ring_retire(struct ring *r)
+{
+	while(atomic_load(&r->users) > 0){
+		uswait(10);
+	}
+	ring_free(r);
+}
+
+/* Producer: write up to n elements, returns the no. of elements written */
+static uint32_t ring_write(struct ring *r, const void *data, uint32_t n)
+{
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	uint32_t space = r->size - (head - tail);
+	uint32_t i, first;
+
+	if(n > space){
+		n = space;
+	}
+
+	/* copy in up to two parts, before and after the wrap around */
+	i = head & (r->size - 1);
+	first = r->size - i < n ? r->size - i : n;
+	memcpy(r->buf + i * r->esize, data, first * r->esize);
+	memcpy(r->buf, (const uint8_t *)data + first * r->esize, (n - first) * r->esize);
+
+	atomic_store_explicit(&r->head, head + n, memory_order_release);
+	return n;
+}
+
+/* Consumer: read up to n elements, returns the no. of elements read */
+static uint32_t ring_read(struct ring *r, void *data, uint32_t n)
+{
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+	uint32_t i, first;
+
+	if(n > head - tail){
+		n = head - tail;
+	}
+
+	i = tail & (r->size - 1);
+	first = r->size - i < n ? r->size - i : n;
+	memcpy(data, r->buf + i * r->esize, first * r->esize);
+	memcpy((uint8_t *)data + first * r->esize, r->buf, (n - first) * r->esize);
+
+	atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+	return n;
+}
+
 /******************************************
 
     Register Bit Manipulation Functions
@@ -405,6 +723,12 @@ void gpio_config(uint8_t pin, uint8_t mode) {
     	}
 }
 
+/* Returns the current function select value of a GPIO pin, same encoding as gpio_config() */
+uint8_t gpio_get_config(uint8_t pin) {
+	__sync_synchronize();
+	return (*(GPSEL + (pin/10)) >> ((pin % 10)*3)) & 7;
+}
+
 /*
  * Writes a bit value to change the state of a GPIO output pin
  * bit = 0 OFF state
@@ -434,6 +758,31 @@ uint8_t gpio_write(uint8_t pin, uint8_t bit) {
     	}
 }
 
+/*
+ * Writes several GPIO output pins (0 to 31) at once
+ * mask = pins to change, value = new states of the pins in mask
+ * Takes at most one GPSET and one GPCLR store, pins not in mask are left unchanged
+ */
+void gpio_write_mask(uint32_t mask, uint32_t value) {
+
+	uint32_t set = mask & value;
+	uint32_t clr = mask & ~value;
+
+	__sync_synchronize();
+	if(set){
+		*GPSET = set;
+	}
+	if(clr){
+		*GPCLR = clr;
+	}
+}
+
+/* Reads the states of all GPIO pins 0 to 31 with a single GPLEV read */
+uint32_t gpio_read_all(void) {
+	__sync_synchronize();
+	return *GPLEV;
+}
+
 /*
  * Reads the current state of a GPIO pin (input/output)
  * return value = 0 OFF state
@@ -916,6 +1265,338 @@ void pwm_set_data(uint8_t pin, uint32_t data){
 }
 
 
+/***********************************************
+
+	Kernel Driver Backends (no root required)
+
+************************************************/
+/*
+ * Instead of the BSC1 and SPI0 registers, the i2c_* and spi_* functions can use
+ * the kernel /dev/i2c-N and /dev/spidevB.C drivers. This does not need /dev/mem
+ * access, so rpi_init() is not required for I2C and SPI in this mode, and it
+ * coexists with kernel drivers that own the bus.
+ *
+ * Adapters without plain I2C transfers, e.g. the i2c-stub test module
+ * (modprobe i2c-stub chip_addr=0x18), are driven with SMBus commands instead.
+ */
+static int i2c_dev_fd = -1;
+static uint16_t i2c_dev_addr = 0;
+static int i2c_dev_smbus = 0;		/* SMBus only adapter */
+static int i2c_dev_read_last = 0;	/* adapter takes a read only as the last message of a call */
+static int i2c_dev_slave = -1;		/* address set with I2C_SLAVE for SMBus commands */
+
+static int spi_dev_fd = -1;
+static uint8_t spi_dev_bus = 0;
+static uint8_t spi_dev_cs = 0;
+static uint8_t spi_dev_mode = 0;
+static uint32_t spi_dev_speed = 500000;
+static uint32_t spi_dev_bufsiz = 4096;
+
+/* Device handle the current settings belong to, NULL once a spi_set_*() call changed them */
+static const struct spi_device *spi_selected = NULL;
+
+/* rx bytes of the last spi_write(), returned by spi_read() */
+static char spi_dev_rx[256];
+static uint8_t spi_dev_rx_len = 0;
+
+/* Use /dev/i2c-<bus> for all i2c_* functions, returns 1 on success */
+int i2c_open_dev(uint8_t bus)
+{
+	char path[32];
+	unsigned long funcs;
+
+	if(i2c_dev_fd >= 0){
+		close(i2c_dev_fd);
+	}
+
+	snprintf(path, sizeof(path), "/dev/i2c-%u", bus);
+	i2c_dev_fd = open(path, O_RDWR);
+	if(i2c_dev_fd < 0){
+		perror(path);
+		printf("%s() error: ", __func__);
+		puts("Cannot open I2C device, is the i2c-dev module loaded?");
+		return 0;
+	}
+	if(ioctl(i2c_dev_fd, I2C_FUNCS, &funcs) < 0){
+		perror("i2c_open_dev() error");
+		close(i2c_dev_fd);
+		i2c_dev_fd = -1;
+		return 0;
+	}
+	i2c_dev_smbus = !(funcs & I2C_FUNC_I2C);
+	i2c_dev_read_last = 0;	// found out on the first call with a read before its end
+	i2c_dev_slave = -1;
+	return 1;
+}
+
+/* Go back to the BSC1 register level backend */
+void i2c_close_dev(void)
+{
+	if(i2c_dev_fd >= 0){
+		close(i2c_dev_fd);
+		i2c_dev_fd = -1;
+	}
+}
+
+/* Map an I2C_RDWR errno to the i2c_* status codes, internal use only */
+static uint8_t i2c_dev_status(int err)
+{
+	if(err == ENXIO || err == EREMOTEIO){
+		return 1;	// NACK
+	}
+	if(err == ETIMEDOUT){
+		return 2;	// clock stretch timeout
+	}
+	return 4;
+}
+
+/* Run a number of messages with I2C_RDWR, as few ioctl() calls as possible */
+static uint8_t i2c_dev_rdwr(struct i2c_msg *msgs, unsigned n)
+{
+	struct i2c_rdwr_ioctl_data data;
+	unsigned count;
+
+	while(n > 0){
+		count = n > I2C_RDWR_IOCTL_MAX_MSGS ? I2C_RDWR_IOCTL_MAX_MSGS : n;
+
+		/* keep a write and its repeated start read in the same call */
+		if(count < n && !(msgs[count - 1].flags & I2C_M_RD) && (msgs[count].flags & I2C_M_RD)){
+			count--;
+		}
+
+		data.msgs = msgs;
+		data.nmsgs = count;
+		if(ioctl(i2c_dev_fd, I2C_RDWR, &data) < 0){
+			return i2c_dev_status(errno);
+		}
+		msgs += count;
+		n -= count;
+	}
+	return 0;
+}
+
+/* One SMBus command, internal use only */
+static int i2c_dev_smbus_cmd(uint8_t addr, char rw, uint8_t cmd, int size, union i2c_smbus_data *data)
+{
+	struct i2c_smbus_ioctl_data args = { rw, cmd, size, data };
+
+	if(addr != i2c_dev_slave){
+		if(ioctl(i2c_dev_fd, I2C_SLAVE, addr) < 0){
+			return -1;
+		}
+		i2c_dev_slave = addr;
+	}
+	return ioctl(i2c_dev_fd, I2C_SMBUS, &args);
+}
+
+/*
+ * A transaction as SMBus commands, internal use only:
+ * register write = I2C block write, register read = I2C block read (1 byte pointer,
+ * up to 32 bytes), plain reads and single byte writes = receive/send byte.
+ */
+static uint8_t i2c_dev_smbus_xfer(const struct i2c_xfer * x)
+{
+	union i2c_smbus_data data;
+	uint16_t i;
+
+	if(x->wlen > 1 + I2C_SMBUS_BLOCK_MAX || (x->rlen && (x->wlen > 1 || x->rlen > I2C_SMBUS_BLOCK_MAX))){
+		return 4;	// not expressible as SMBus commands
+	}
+	if(x->wlen && x->rlen){
+		data.block[0] = (uint8_t)x->rlen;
+		if(i2c_dev_smbus_cmd(x->addr, I2C_SMBUS_READ, (uint8_t)x->wbuf[0], I2C_SMBUS_I2C_BLOCK_DATA, &data) < 0){
+			return i2c_dev_status(errno);
+		}
+		memcpy(x->rbuf, data.block + 1, x->rlen);
+		return 0;
+	}
+	if(x->wlen > 1){
+		data.block[0] = (uint8_t)(x->wlen - 1);
+		memcpy(data.block + 1, x->wbuf + 1, x->wlen - 1);
+		if(i2c_dev_smbus_cmd(x->addr, I2C_SMBUS_WRITE, (uint8_t)x->wbuf[0], I2C_SMBUS_I2C_BLOCK_DATA, &data) < 0){
+			return i2c_dev_status(errno);
+		}
+		return 0;
+	}
+	if(x->wlen == 1 && i2c_dev_smbus_cmd(x->addr, I2C_SMBUS_WRITE, (uint8_t)x->wbuf[0], I2C_SMBUS_BYTE, NULL) < 0){
+		return i2c_dev_status(errno);
+	}
+	for(i = 0; i < x->rlen; i++){
+		if(i2c_dev_smbus_cmd(x->addr, I2C_SMBUS_READ, 0, I2C_SMBUS_BYTE, &data) < 0){
+			return i2c_dev_status(errno);
+		}
+		x->rbuf[i] = (char)data.byte;
+	}
+	return 0;
+}
+
+/* Single message transfer to the selected slave, internal use only */
+static uint8_t i2c_dev_msg(char * buf, uint16_t len, uint16_t flags)
+{
+	struct i2c_msg msg = { i2c_dev_addr, flags, len, (uint8_t *)buf };
+
+	if(i2c_dev_smbus){
+		struct i2c_xfer x = { (uint8_t)i2c_dev_addr, buf, (flags & I2C_M_RD) ? 0 : len,
+				      buf, (flags & I2C_M_RD) ? len : 0, 0 };
+		return i2c_dev_smbus_xfer(&x);
+	}
+	return i2c_dev_rdwr(&msg, 1);
+}
+
+/*
+ * Run n transactions, packed into as few I2C_RDWR calls as possible with the kernel
+ * backend. Each status is stored in x[i].status, returns the number of failed ones.
+ *
+ * Write+read transactions (register reads) are packed together when the adapter
+ * allows it. The bcm2835 I2C driver only accepts a read as the last message of a
+ * call and rejects other calls with EOPNOTSUPP before sending anything, so on the
+ * first such refusal the call is rebuilt with a read only at its end, and all later
+ * calls follow that rule. The kernel does not report which message of a failed call
+ * failed, and the ones before it have already been sent, so a failed call is not
+ * retried (writes such as FIFO pushes must not run twice) and every transaction of
+ * that call gets the error status. The batch goes on with the next call.
+ *
+ * SMBus only adapters (i2c-stub) run one transaction at a time as SMBus commands.
+ */
+unsigned i2c_batch(struct i2c_xfer * x, unsigned n)
+{
+	struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+	unsigned i, j, k, m, failed = 0;
+	int inner_read;
+	uint8_t status;
+
+	if(i2c_dev_fd < 0){
+		for(i = 0; i < n; i++){
+			x[i].status = i2c_transfer(x[i].addr, x[i].wbuf, x[i].wlen, x[i].rbuf, x[i].rlen);
+			failed += x[i].status != 0;
+		}
+		return failed;
+	}
+
+	if(i2c_dev_smbus){
+		for(i = 0; i < n; i++){
+			x[i].status = i2c_dev_smbus_xfer(&x[i]);
+			failed += x[i].status != 0;
+		}
+		return failed;
+	}
+
+	for(i = 0; i < n; i = j){
+		k = 0;
+		for(j = i; j < n && k + 2 <= I2C_RDWR_IOCTL_MAX_MSGS; j++){
+			if(x[j].wlen){
+				msgs[k++] = (struct i2c_msg){ x[j].addr, 0, x[j].wlen, (uint8_t *)x[j].wbuf };
+			}
+			if(x[j].rlen){
+				msgs[k++] = (struct i2c_msg){ x[j].addr, I2C_M_RD, x[j].rlen, (uint8_t *)x[j].rbuf };
+				if(i2c_dev_read_last){
+					j++;
+					break;
+				}
+			}
+		}
+		/* a read before the last message, which some adapters refuse */
+		for(m = 0, inner_read = 0; m + 1 < k; m++){
+			inner_read |= (msgs[m].flags & I2C_M_RD) != 0;
+		}
+
+		status = k ? i2c_dev_rdwr(msgs, k) : 0;
+		if(status && inner_read && errno == EOPNOTSUPP){
+			i2c_dev_read_last = 1;	// refused as a whole, nothing was sent
+			j = i;
+			continue;
+		}
+		for(k = i; k < j; k++){
+			x[k].status = status;
+			failed += status != 0;
+		}
+	}
+	return failed;
+}
+
+/* Use /dev/spidev<bus>.<cs> for all spi_* functions, returns 1 on success */
+int spi_open_dev(uint8_t bus, uint8_t cs)
+{
+	char path[32];
+	FILE *fp;
+
+	if(spi_dev_fd >= 0){
+		close(spi_dev_fd);
+	}
+
+	snprintf(path, sizeof(path), "/dev/spidev%u.%u", bus, cs);
+	spi_dev_fd = open(path, O_RDWR);
+	if(spi_dev_fd < 0){
+		perror(path);
+		printf("%s() error: ", __func__);
+		puts("Cannot open SPI device, is the spidev driver bound?");
+		return 0;
+	}
+	spi_dev_bus = bus;
+	spi_dev_cs = cs;
+	spi_selected = NULL;
+
+	/* max. bytes per message accepted by the driver */
+	fp = fopen("/sys/module/spidev/parameters/bufsiz", "r");
+	if(fp != NULL){
+		unsigned v;
+		if(fscanf(fp, "%u", &v) == 1 && v > 0){
+			spi_dev_bufsiz = v;
+		}
+		fclose(fp);
+	}
+
+	if(ioctl(spi_dev_fd, SPI_IOC_WR_MODE, &spi_dev_mode) < 0
+	   || ioctl(spi_dev_fd, SPI_IOC_WR_MAX_SPEED_HZ, &spi_dev_speed) < 0){
+		perror(path);
+		printf("%s() error: ", __func__);
+		puts("Cannot set the SPI mode and speed.");
+		close(spi_dev_fd);
+		spi_dev_fd = -1;
+		return 0;
+	}
+	return 1;
+}
+
+/* Go back to the SPI0 register level backend */
+void spi_close_dev(void)
+{
+	if(spi_dev_fd >= 0){
+		close(spi_dev_fd);
+		spi_dev_fd = -1;
+	}
+}
+
+/* Full-duplex transfer with SPI_IOC_MESSAGE, split in bufsiz sized messages */
+static void spi_dev_transfer(const char * wbuf, char * rbuf, size_t len)
+{
+	struct spi_ioc_transfer tr;
+	size_t n;
+
+	while(len > 0){
+		n = len > spi_dev_bufsiz ? spi_dev_bufsiz : len;
+
+		memset(&tr, 0, sizeof(tr));
+		tr.tx_buf = (uintptr_t)wbuf;
+		tr.rx_buf = (uintptr_t)rbuf;
+		tr.len = n;
+		tr.speed_hz = spi_dev_speed;
+		tr.bits_per_word = 8;
+
+		if(ioctl(spi_dev_fd, SPI_IOC_MESSAGE(1), &tr) < 0){
+			perror("spi_data_transfer() error");
+			return;
+		}
+		if(wbuf){
+			wbuf += n;
+		}
+		if(rbuf){
+			rbuf += n;
+		}
+		len -= n;
+	}
+}
+
 /****************************
 
 	I2C Functons
@@ -936,6 +1617,10 @@ CLKT	(C + 0x1C/4) //sretch clk
  */
 int i2c_start()
 {
+	if(i2c_dev_fd >= 0){
+		return 1;		// the kernel driver owns the pins
+	}
+
 	__sync_synchronize(); 
     	if ( C == 0 ){
 		printf("%s() error: ", __func__);
@@ -965,17 +1650,20 @@ int i2c_start()
    cause the BSC master to malfunction by setting values of CDIV/2 or greater. Therefore
    the delay values should always be set to less than CDIV/2.
 */
-static uint32_t set_clock_delay(uint8_t FEDL, uint8_t REDL){
+static uint32_t set_clock_delay(uint16_t FEDL, uint16_t REDL){
 
-	volatile uint16_t *div = (uint16_t *)DIV;
+	volatile uint32_t *div = (uint32_t *)DIV;
 
     	volatile uint32_t *del = (uint32_t *)DEL;
 
-    	uint32_t fedl = 65535 + FEDL;
-    	uint8_t redl = REDL;
+	uint32_t cdiv = *div & 0xFFFF;
+
+	if(cdiv == 0){
+		cdiv = 32768;	// 0 is read as 32768
+	}
 
-    	if(FEDL < (*div/2) && REDL < (*div/2)){
- 		*del = fedl + redl;
+    	if(FEDL < (cdiv/2) && REDL < (cdiv/2)){
+ 		*del = ((uint32_t)FEDL << 16) | REDL;
     	}
     	else{
 		puts("i2c_set_clock_freq() error: Clock delay is higher than cdiv/2.");
@@ -984,26 +1672,105 @@ static uint32_t set_clock_delay(uint8_t FEDL, uint8_t REDL){
     	return *del;
 }
 
+/*
+ * Set FEDL and REDL in proportion to the clock divider, internal use only.
+ * Sampling a quarter SCL period after the rising edge and changing data 1/16
+ * period after the falling edge keeps the timing valid at every bus speed.
+ */
+static uint32_t set_clock_delays(uint16_t cdiv){
+
+	uint16_t fedl = cdiv / 16;
+	uint16_t redl = cdiv / 4;
+
+	return set_clock_delay(fedl ? fedl : 1, redl ? redl : 1);
+}
+
+/* SCL frequency last set in Hz with i2c_set_speed(), reapplied when the core clock changes */
+static uint32_t i2c_speed_hz = 0;
+static uint16_t i2c_speed_clkt = 0;
+static uint32_t i2c_speed_gen = 0;
+
 /* Set clock frequency for data transfer using a divisor value */
 void i2c_set_clock_freq(uint16_t divider)
 {
+	i2c_speed_hz = 0;	// a fixed divider does not follow the core clock
+
 	volatile uint32_t* div = (uint32_t *)DIV;
     	*div = divider;
 
-   	/* set 1 falling and 1 rising clock cycle delays for SCL */
-    	if(set_clock_delay(1, 1) < 2){
+   	/* set falling and rising clock cycle delays for SCL */
+    	if(set_clock_delays(divider) < 2){
 		printf("internal %s() error: ", __func__);
 		puts("Clock delays should be below cdiv/2.");
         }
 }
 
+/*
+ * Set the SCL frequency in Hz (e.g. 100000, 400000 or 1000000 for Fast-mode Plus)
+ * computed from the real core clock, and the clock stretch timeout.
+ *
+ * clkt = clock stretch timeout in SCL cycles (0 disables the timeout)
+ *
+ * Returns the achieved SCL frequency in Hz, which is the closest one not above hz.
+ */
+uint32_t i2c_set_speed(uint32_t hz, uint16_t clkt)
+{
+	if(i2c_dev_fd >= 0){
+		return 0;		// bus speed is set by the kernel driver (device tree)
+	}
+
+	uint32_t core = rpi_core_clock();
+	uint32_t cdiv;
+
+	if(hz == 0){
+		printf("%s() error: ", __func__);
+		puts("Invalid hz parameter.");
+		return 0;
+	}
+
+	/* CDIV is always rounded down to an even number by the hardware, round up instead */
+	cdiv = (core + hz - 1) / hz;
+	cdiv += cdiv & 1;
+
+	/* delays need cdiv >= 4, the 16-bit field takes even values up to 65534 */
+	if(cdiv < 4){
+		cdiv = 4;
+	}
+	else if(cdiv > 65534){
+		cdiv = 65534;
+	}
+
+	*DIV = cdiv & 0xFFFF;
+	set_clock_delays((uint16_t)cdiv);
+	*CLKT = clkt;
+
+	i2c_speed_hz = hz;
+	i2c_speed_clkt = clkt;
+	i2c_speed_gen = core_clock_gen;
+	return core / cdiv;
+}
+
+/* Recompute the divider of a speed set in Hz if the core clock has changed, internal use only */
+static void i2c_speed_poll(void)
+{
+	if(i2c_speed_hz && core_clock_poll() != i2c_speed_gen){
+		i2c_set_speed(i2c_speed_hz, i2c_speed_clkt);
+	}
+}
+
+/* Get the current SCL frequency in Hz */
+uint32_t i2c_get_speed(void)
+{
+	uint32_t cdiv = *DIV & 0xFFFF;
+
+	return rpi_core_clock() / (cdiv ? cdiv : 32768);
+}
+
 /* Set data transfer speed using directly a clock freq value or baud rate value(bits per second) */
 void i2c_data_transfer_speed(uint32_t baud)
 {
-	/* get the divisor value using the 250 MHz system clock source */
-        uint32_t divider = (system_clock / baud); 
-
-	i2c_set_clock_freq((uint16_t)divider);
+	/* keep the reset value of the clock stretch timeout, 64 SCL cycles */
+	i2c_set_speed(baud, 0x40);
 }
 
 /* Clear FIFO buffer */
@@ -1074,6 +1841,11 @@ static uint8_t i2c_slave_write_test(const char * buf, uint8_t len)
 /* Get slave device address */
 void i2c_select_slave(uint8_t addr)
 {
+	if(i2c_dev_fd >= 0){
+		i2c_dev_addr = addr;
+		return;
+	}
+
     	volatile uint32_t *a = (uint32_t *)A; 
     	*a = addr;
    
@@ -1088,6 +1860,11 @@ void i2c_select_slave(uint8_t addr)
 /* Write a number of bytes to slave device */
 uint8_t i2c_write(const char * wbuf, uint8_t len)
 {
+	if(i2c_dev_fd >= 0){
+		return i2c_dev_msg((char *)wbuf, len, 0);
+	}
+	i2c_speed_poll();
+
     	volatile uint32_t * dlen   	= (uint32_t *)DLEN;
     	volatile uint32_t * fifo   	= (uint32_t *)FIFO;
 
@@ -1162,6 +1939,11 @@ uint8_t i2c_write(const char * wbuf, uint8_t len)
 /* Read a number of bytes from a slave device */
 uint8_t i2c_read(char* rbuf, uint8_t len)
 {
+	if(i2c_dev_fd >= 0){
+		return i2c_dev_msg(rbuf, len, I2C_M_RD);
+	}
+	i2c_speed_poll();
+
     	volatile uint32_t * dlen 	= (uint32_t *)DLEN; 
     	volatile uint32_t * fifo    = (uint32_t *)FIFO;
 
@@ -1229,6 +2011,12 @@ uint8_t i2c_read(char* rbuf, uint8_t len)
 
 /* Read one byte of data from the slave device */
 uint8_t i2c_byte_read(void){
+	if(i2c_dev_fd >= 0){
+		char data = 0;
+		uint8_t result = i2c_dev_msg(&data, 1, I2C_M_RD);
+		return result ? result : (uint8_t)data;
+	}
+
 
     	volatile uint32_t * dlen 	= (uint32_t *)DLEN;
     	volatile uint32_t * fifo    = (uint32_t *)FIFO;
@@ -1301,6 +2089,10 @@ uint8_t i2c_byte_read(void){
  * Stop I2C operation
  */
 void i2c_stop() {
+	if(i2c_dev_fd >= 0){
+		return;
+	}
+
 
         /* Empty fifo buffer from previous write cycle transaction */ 
     	clear_fifo(C);
@@ -1315,34 +2107,662 @@ void i2c_stop() {
 	__sync_synchronize(); 
 }
 
-
-/****************************
-
-	SPI Functons
-
-*****************************/
-/* SPI register addresses 
-SPI_CS 		(base_pointer[6] + 0x0)  
-SPI_FIFO	(SPI_CS + 0x4/4)
-SPI_CLK		(SPI_CS + 0x8/4)
-SPI_DLEN	(SPI_CS + 0xC/4)
-SPI_LTOH	(SPI_CS + 0x10/4)
-SPI_DC		(SPI_CS + 0x14/4)
-*/
-
 /*
- * Start SPI operation
+ * Write then read a number of bytes to/from a slave device in one transaction.
+ * If both wlen and rlen are non-zero, the read is issued as a repeated start
+ * right after the write phase. The write phase is pre-loaded into the FIFO,
+ * so wlen must not exceed 16 bytes when a read follows (returns 4 otherwise).
+ *
+ * No messages are printed, the status is returned instead
+ * 0 = success, 1 = NACK, 2 = clock stretch timeout, 4 = incomplete transfer
  */
-int spi_start()
+uint8_t i2c_transfer(uint8_t addr, const char * wbuf, uint16_t wlen, char * rbuf, uint16_t rlen)
 {
-	__sync_synchronize(); 
-    	if ( SPI_CS == 0 ){
-		printf("%s() error: ", __func__);
-      		puts("Invalid SPI registers addresses.");
-      		return 0; 
-    	}
+	if(i2c_dev_fd >= 0){
+		struct i2c_xfer x = { addr, wbuf, wlen, rbuf, rlen, 0 };
+		i2c_batch(&x, 1);
+		return x.status;
+	}
 
-    	set_gpio(8,  4);  // PHY 24, GPIO 8,  using value 100 , set to alt 0    CE0
+    	volatile uint32_t * dlen = (uint32_t *)DLEN;
+    	volatile uint32_t * fifo = (uint32_t *)FIFO;
+
+    	uint16_t w = 0, r = 0;
+	uint32_t status;
+
+	if(rlen > 0 && wlen > 16){
+		return 4;
+	}
+	i2c_speed_poll();
+
+	*A = addr;
+
+    	clear_fifo(C);
+    	reset_error_status();
+
+	if(wlen > 0){
+    		*dlen = wlen;
+
+		/* pre-load the fifo, so a repeated start can follow right away */
+		while(w < wlen && w < 16){
+			*fifo = wbuf[w++];
+		}
+
+    		*C = (1 << 15) | (1 << 7);	// I2CEN | ST, write transfer
+
+		if(rlen > 0){
+			/* wait for the write to start before queueing the repeated start */
+			do {
+				__sync_synchronize();
+				status = *S;
+			} while(!(status & ((1 << 0) | (1 << 1))));	// TA or DONE
+		}
+		else{
+			do {
+				__sync_synchronize();
+				status = *S;
+				while(w < wlen && (status & (1 << 4))){	// TXD
+					*fifo = wbuf[w++];
+					status = *S;
+				}
+			} while(!(status & (1 << 1)));	// DONE
+		}
+	}
+
+	if(rlen > 0){
+    		*dlen = rlen;
+    		*C = (1 << 15) | (1 << 7) | (1 << 0);	// I2CEN | ST | READ
+
+		do {
+			__sync_synchronize();
+			status = *S;
+			while(r < rlen && (status & (1 << 5))){	// RXD
+				rbuf[r++] = *fifo;
+				status = *S;
+			}
+		} while(!(status & (1 << 1)));	// DONE
+
+		/* drain the bytes that arrived together with DONE */
+		while(r < rlen && isBitSet(S, 5)){
+			rbuf[r++] = *fifo;
+		}
+	}
+
+	__sync_synchronize();
+	status = *S;
+	*S = (1 << 9) | (1 << 8) | (1 << 1);	// clear CLKT, ERR and DONE
+
+	if(status & (1 << 8)){
+		return 1;
+	}
+	if(status & (1 << 9)){
+		return 2;
+	}
+	if(w < wlen || r < rlen){
+		return 4;
+	}
+	return 0;
+}
+
+
+/*************************************
+
+	I2C Transaction Scheduler
+
+**************************************/
+/*
+ * Multi-rate polling of several slave devices sharing one bus.
+ *
+ * Each task is a periodic transaction (write wlen bytes, then read rlen bytes).
+ * The bus time of a transaction is computed from its shape and the SCL frequency:
+ *
+ *	start + addr (9 bits) + wlen * 9 bits + [restart + addr (9 bits) + rlen * 9 bits] + stop
+ *
+ * plus a fixed software overhead per transaction. A task is accepted only if the
+ * total bus occupancy stays below the configured load limit and every task can
+ * still meet its period while being blocked by the longest other transaction
+ * (transactions are never preempted).
+ *
+ * Release times of newly added tasks are offset by the bus time of the tasks
+ * already registered, so transactions are packed back-to-back instead of
+ * colliding at the same instant. Due tasks are dispatched earliest deadline first.
+ */
+#define I2C_SCHED_MAX		32
+#define I2C_SCHED_OVERHEAD_US	10	/* register setup and fifo handling per transaction */
+
+struct i2c_task {
+	uint8_t  addr;
+	uint8_t  wlen;
+	uint8_t  rlen;
+	char     wbuf[16];
+	char     rbuf[16];
+	uint32_t period;	/* us */
+	uint32_t cost;		/* us of bus time */
+	uint64_t release;	/* next release time, system timer us */
+	uint32_t runs;
+	uint32_t misses;
+	uint32_t errors;
+	uint32_t max_jitter;	/* us */
+	void (*cb)(int id, const char *rbuf, uint8_t len, uint8_t status, void *arg);
+	void *arg;
+};
+
+static struct i2c_task i2c_tasks[I2C_SCHED_MAX];
+static int i2c_ntasks = 0;
+static uint32_t i2c_sched_hz = 100000;
+static uint32_t i2c_sched_limit = 90;	/* max. bus load in percent */
+static uint32_t i2c_sched_offset = 0;	/* us, release offset of the next task */
+static volatile int i2c_sched_running = 0;
+
+/* Bus time of a transaction in us, internal use only */
+static uint32_t i2c_task_cost(uint8_t wlen, uint8_t rlen)
+{
+	uint32_t bits = 1;		// stop
+
+	if(wlen > 0){
+		bits += 1 + 9 + 9 * wlen;
+	}
+	if(rlen > 0){
+		bits += 1 + 9 + 9 * rlen;
+	}
+	return (uint32_t)(((uint64_t)bits * 1000000 + i2c_sched_hz - 1) / i2c_sched_hz) + I2C_SCHED_OVERHEAD_US;
+}
+
+/*
+ * Initialize the scheduler
+ * scl_hz = SCL clock frequency the bus is running at
+ * max_load = max. bus occupancy in percent (1 to 100) accepted at registration
+ */
+int i2c_sched_init(uint32_t scl_hz, uint8_t max_load)
+{
+	if(scl_hz == 0 || max_load == 0 || max_load > 100){
+		printf("%s() error: ", __func__);
+		puts("Invalid scl_hz or max_load parameter.");
+		return 0;
+	}
+
+	memset(i2c_tasks, 0, sizeof(i2c_tasks));
+	i2c_ntasks = 0;
+	i2c_sched_hz = scl_hz;
+	i2c_sched_limit = max_load;
+	i2c_sched_offset = 0;
+
+	return 1;
+}
+
+/* Total bus occupancy of the registered tasks in 1/10 percent */
+uint32_t i2c_sched_load(void)
+{
+	uint64_t load = 0;
+	int i;
+
+	for(i = 0; i < i2c_ntasks; i++){
+		load += (uint64_t)i2c_tasks[i].cost * 1000000 / i2c_tasks[i].period;
+	}
+	return (uint32_t)(load / 1000);
+}
+
+/*
+ * Register a periodic transaction
+ * Returns the task id, or -1 if the bus cannot fit the task
+ */
+int i2c_sched_add(uint8_t addr, uint32_t period_us, const char * wbuf, uint8_t wlen, uint8_t rlen,
+		  void (*cb)(int id, const char *rbuf, uint8_t len, uint8_t status, void *arg), void *arg)
+{
+	struct i2c_task *t;
+	uint32_t cost, max_cost;
+	uint64_t load;
+	int i;
+
+	if(i2c_ntasks >= I2C_SCHED_MAX || wlen > 16 || rlen > 16 || (wlen == 0 && rlen == 0) || period_us == 0){
+		printf("%s() error: ", __func__);
+		puts("Invalid task parameter or too many tasks.");
+		return -1;
+	}
+
+	cost = i2c_task_cost(wlen, rlen);
+
+	/* bus occupancy including the new task */
+	load = (uint64_t)cost * 1000000 / period_us;
+	max_cost = cost;
+	for(i = 0; i < i2c_ntasks; i++){
+		load += (uint64_t)i2c_tasks[i].cost * 1000000 / i2c_tasks[i].period;
+		if(i2c_tasks[i].cost > max_cost){
+			max_cost = i2c_tasks[i].cost;
+		}
+	}
+	if(load > (uint64_t)i2c_sched_limit * 10000){
+		printf("%s() error: ", __func__);
+		printf("Bus load would be %u.%u%%, limit is %u%%.\n", (unsigned)(load / 10000), (unsigned)(load / 1000 % 10), (unsigned)i2c_sched_limit);
+		return -1;
+	}
+
+	/* a task may be blocked by the longest other transaction before it runs */
+	if(cost + max_cost > period_us){
+		printf("%s() error: ", __func__);
+		puts("Transaction does not fit in its period.");
+		return -1;
+	}
+	for(i = 0; i < i2c_ntasks; i++){
+		if(i2c_tasks[i].cost + cost > i2c_tasks[i].period){
+			printf("%s() error: ", __func__);
+			puts("Transaction would cause another task to miss its period.");
+			return -1;
+		}
+	}
+
+	t = &i2c_tasks[i2c_ntasks];
+	memset(t, 0, sizeof(*t));
+	t->addr = addr;
+	t->wlen = wlen;
+	t->rlen = rlen;
+	if(wlen > 0){
+		memcpy(t->wbuf, wbuf, wlen);
+	}
+	t->period = period_us;
+	t->cost = cost;
+	t->release = i2c_sched_offset % period_us;	// relative until i2c_sched_run()
+	t->cb = cb;
+	t->arg = arg;
+
+	i2c_sched_offset += cost;
+
+	return i2c_ntasks++;
+}
+
+/* Number of periods a task has missed */
+uint32_t i2c_sched_misses(int id)
+{
+	return (id >= 0 && id < i2c_ntasks) ? i2c_tasks[id].misses : 0;
+}
+
+/* Number of failed transactions of a task */
+uint32_t i2c_sched_errors(int id)
+{
+	return (id >= 0 && id < i2c_ntasks) ? i2c_tasks[id].errors : 0;
+}
+
+/* Largest observed delay between release and start of a task transaction in us */
+uint32_t i2c_sched_jitter(int id)
+{
+	return (id >= 0 && id < i2c_ntasks) ? i2c_tasks[id].max_jitter : 0;
+}
+
+/* Stop a running i2c_sched_run() loop, e.g. from a signal handler */
+void i2c_sched_stop(void)
+{
+	i2c_sched_running = 0;
+}
+
+/*
+ * Run the registered tasks for duration_ms milliseconds (0 = until i2c_sched_stop())
+ * The bus must have been started with i2c_start() at the scl_hz rate given to i2c_sched_init().
+ */
+void i2c_sched_run(uint32_t duration_ms)
+{
+	uint64_t now, start, next, gap;
+	struct i2c_task *t;
+	uint8_t status;
+	int i;
+
+	if(i2c_ntasks == 0){
+		return;
+	}
+
+	start = st_read();
+	for(i = 0; i < i2c_ntasks; i++){
+		i2c_tasks[i].release += start;
+	}
+
+	i2c_sched_running = 1;
+	while(i2c_sched_running){
+
+		now = st_read();
+		if(duration_ms && now - start >= (uint64_t)duration_ms * 1000){
+			break;
+		}
+
+		/* earliest deadline first among the released tasks */
+		t = NULL;
+		next = UINT64_MAX;
+		for(i = 0; i < i2c_ntasks; i++){
+			if(i2c_tasks[i].release <= now){
+				if(t == NULL || i2c_tasks[i].release + i2c_tasks[i].period < t->release + t->period){
+					t = &i2c_tasks[i];
+				}
+			}
+			else if(i2c_tasks[i].release < next){
+				next = i2c_tasks[i].release;
+			}
+		}
+
+		if(t == NULL){
+			/* sleep through long idle gaps, spin on the system timer for short ones */
+			if(next - now > 200){
+				gap = next - now - 100;
+				if(gap >= 1000){
+					mswait((uint32_t)(gap / 1000));
+				}
+				uswait((uint32_t)(gap % 1000));
+			}
+			continue;
+		}
+
+		if(now - t->release > t->max_jitter){
+			t->max_jitter = (uint32_t)(now - t->release);
+		}
+
+		status = i2c_transfer(t->addr, t->wbuf, t->wlen, t->rbuf, t->rlen);
+		t->runs++;
+		if(status){
+			t->errors++;
+		}
+
+		/* deadline is the next release, skip the periods that were overrun */
+		now = st_read();
+		t->release += t->period;
+		while(t->release < now){
+			t->misses++;
+			t->release += t->period;
+		}
+
+		if(t->cb){
+			t->cb((int)(t - i2c_tasks), t->rbuf, t->rlen, status, t->arg);
+		}
+	}
+
+	/* keep the schedule relative for the next run */
+	now = st_read();
+	for(i = 0; i < i2c_ntasks; i++){
+		i2c_tasks[i].release = i2c_tasks[i].release > now ? i2c_tasks[i].release - now : 0;
+	}
+	i2c_sched_running = 0;
+}
+
+/*************************************
+
+	I2C Slave Functions
+
+**************************************/
+/*
+ * The BSC/SPI slave peripheral answers as an I2C target at a 7-bit address,
+ * SDA on GPIO 18 (PHY 12) and SCL on GPIO 19 (PHY 35), both alt-func 3.
+ *
+ * The slave behaves like a common register based device with a 256 byte
+ * register file. The first byte of a write sets the register pointer, the
+ * following bytes are passed to the on_write callback. A read returns the
+ * registers from the pointer on, auto-incrementing.
+ *
+ * The hardware clocks out whatever is queued in its TX FIFO, so a service thread
+ * drains the RX FIFO and keeps the TX FIFO filled from the current pointer.
+ *
+ * The register contents are published by the application with i2c_slave_update().
+ * The snapshot is triple buffered: the application writes to its own buffer and
+ * swaps it with the shared one, the service thread takes the shared one at the
+ * start of each transaction, so a master read always sees a consistent snapshot
+ * and neither side ever waits for the other.
+ */
+#define SL_FR_TXBUSY	(1 << 0)
+#define SL_FR_RXFE	(1 << 1)
+#define SL_FR_TXFF	(1 << 2)
+#define SL_FR_RXBUSY	(1 << 5)
+#define SL_FR_TXFLEVEL(fr)	(((fr) >> 6) & 0x1F)
+#define SL_FR_RXFLEVEL(fr)	(((fr) >> 11) & 0x1F)
+
+#define SL_CR_EN	(1 << 0)
+#define SL_CR_SPI	(1 << 1)
+#define SL_CR_I2C	(1 << 2)
+#define SL_CR_CPHA	(1 << 3)
+#define SL_CR_CPOL	(1 << 4)
+#define SL_CR_BRK	(1 << 7)
+#define SL_CR_TXE	(1 << 8)
+#define SL_CR_RXE	(1 << 9)
+
+#define SL_FIFO_SIZE	16
+#define SL_SNAP_DIRTY	4
+
+static uint8_t sl_regs[3][256];		/* triple buffered register file snapshot */
+static uint8_t sl_shadow[256];		/* application side copy */
+static _Atomic int sl_middle = 1;	/* shared buffer index, | SL_SNAP_DIRTY if new */
+static int sl_back = 0;			/* application buffer index */
+static int sl_front = 2;		/* service thread buffer index */
+
+static pthread_t sl_thread;
+static atomic_int sl_running = 0;
+static void (*sl_on_write)(uint8_t reg, const uint8_t *data, uint8_t len) = NULL;
+
+/* Take the latest published snapshot, service thread only */
+static const uint8_t *sl_snapshot(void)
+{
+	if(atomic_load_explicit(&sl_middle, memory_order_relaxed) & SL_SNAP_DIRTY){
+		sl_front = atomic_exchange_explicit(&sl_middle, sl_front, memory_order_acq_rel) & ~SL_SNAP_DIRTY;
+	}
+	return sl_regs[sl_front];
+}
+
+/* Empty the TX FIFO and queue the registers from reg on, returns the no. of bytes queued */
+static uint8_t sl_queue_regs(const uint8_t *regs, uint8_t reg)
+{
+	uint8_t n;
+
+	/* BRK clears the FIFOs */
+	*SL_CR |= SL_CR_BRK;
+	*SL_CR &= ~SL_CR_BRK;
+
+	for(n = 0; n < SL_FIFO_SIZE; n++){
+		*SL_DR = regs[(uint8_t)(reg + n)];
+	}
+	return n;
+}
+
+/* Slave service thread */
+static void *sl_service(void *arg)
+{
+	const uint8_t *regs = sl_snapshot();
+	uint8_t data[256];
+	uint8_t ptr = 0;	/* register pointer */
+	uint8_t wlen = 0;	/* bytes received in the current write, pointer included */
+	uint32_t queued = 0;	/* bytes queued from ptr on */
+	uint8_t reading = 0;
+	uint32_t fr, idle = 0;
+
+	(void)arg;
+
+	queued = sl_queue_regs(regs, ptr);
+
+	while(atomic_load_explicit(&sl_running, memory_order_relaxed)){
+
+		__sync_synchronize();
+		fr = *SL_FR;
+
+		/* master write, the first byte of each transaction is the register pointer */
+		if(!(fr & SL_FR_RXFE)){
+			uint8_t newptr = wlen == 0;
+
+			while(!(fr & SL_FR_RXFE)){
+				uint8_t byte = *SL_DR & 0xFF;
+
+				if(wlen == 0){
+					ptr = byte;
+				}
+				else if(wlen < 255){
+					data[wlen - 1] = byte;
+				}
+				if(wlen < 255){
+					wlen++;		// further bytes are dropped, wlen must not wrap
+				}
+				fr = *SL_FR;
+			}
+			/* the TX FIFO holds the old registers, a repeated start read must see the new ones */
+			if(newptr){
+				regs = sl_snapshot();
+				queued = sl_queue_regs(regs, ptr);
+			}
+			idle = 0;
+			continue;
+		}
+
+		/* master read in progress, keep the TX FIFO filled */
+		if(fr & SL_FR_TXBUSY){
+			reading = 1;
+			while(!(fr & SL_FR_TXFF) && queued < 256){
+				*SL_DR = regs[(uint8_t)(ptr + queued++)];
+				fr = *SL_FR;
+			}
+			idle = 0;
+			continue;
+		}
+
+		/* end of a read, advance the pointer by the bytes the master clocked out */
+		if(reading){
+			ptr += queued - SL_FR_TXFLEVEL(fr);
+			reading = 0;
+			regs = sl_snapshot();
+			queued = sl_queue_regs(regs, ptr);
+			continue;
+		}
+
+		/* end of a write, new pointer (and data) received */
+		if(wlen > 0 && !(fr & SL_FR_RXBUSY)){
+			if(wlen > 1 && sl_on_write){
+				sl_on_write(ptr, data, wlen - 1);
+			}
+			wlen = 0;
+			regs = sl_snapshot();
+			queued = sl_queue_regs(regs, ptr);
+			continue;
+		}
+
+		/* bus idle, back off after a while to save cpu time */
+		if(++idle > 1000){
+			uswait(50);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Publish len register values starting at register reg.
+ * Lock-free, the service thread picks the new contents at the next transaction.
+ */
+void i2c_slave_update(uint8_t reg, const uint8_t *values, uint16_t len)
+{
+	uint16_t i;
+
+	for(i = 0; i < len && reg + i < 256; i++){
+		sl_shadow[reg + i] = values[i];
+	}
+
+	memcpy(sl_regs[sl_back], sl_shadow, sizeof(sl_shadow));
+	sl_back = atomic_exchange_explicit(&sl_middle, sl_back | SL_SNAP_DIRTY, memory_order_acq_rel) & ~SL_SNAP_DIRTY;
+}
+
+/* The SPI slave receiver uses the same peripheral, see spi_slave_start() */
+static int slave_spi_busy(void);
+
+/*
+ * Start I2C slave operation at a 7-bit address
+ * on_write = called from the service thread with the data written by the master, can be NULL
+ * Returns 1 on success
+ */
+int i2c_slave_start(uint8_t addr, void (*on_write)(uint8_t reg, const uint8_t *data, uint8_t len))
+{
+	if(SL_DR == 0){
+		printf("%s() error: ", __func__);
+		puts("Invalid I2C slave registers addresses.");
+		return 0;
+	}
+	if(atomic_load(&sl_running) || slave_spi_busy()){
+		printf("%s() error: ", __func__);
+		puts("The BSC/SPI slave peripheral is already in use.");
+		return 0;
+	}
+
+	set_gpio(18, 7);	// alt 111b, PHY 12, GPIO 18, alt 3	SDA
+	set_gpio(19, 7);	// alt 111b, PHY 35, GPIO 19, alt 3	SCL
+
+	*SL_CR = 0;
+	*SL_RSR = 0;		// clear overrun/underrun errors
+	*SL_IMSC = 0;		// polled, no interrupts
+	*SL_SLV = addr & 0x7F;
+	*SL_CR = SL_CR_EN | SL_CR_I2C | SL_CR_TXE | SL_CR_RXE;
+
+	sl_on_write = on_write;
+	atomic_store(&sl_running, 1);
+
+	if(pthread_create(&sl_thread, NULL, sl_service, NULL) != 0){
+		perror("pthread_create() error");
+		atomic_store(&sl_running, 0);
+		*SL_CR = 0;
+		return 0;
+	}
+	return 1;
+}
+
+/* Stop I2C slave operation */
+void i2c_slave_stop(void)
+{
+	if(!atomic_load(&sl_running)){
+		return;
+	}
+	atomic_store(&sl_running, 0);
+	pthread_join(sl_thread, NULL);
+
+	*SL_CR = SL_CR_BRK;
+	*SL_CR = 0;
+
+	set_gpio(18, 0);
+	set_gpio(19, 0);
+	__sync_synchronize();
+}
+
+
+/****************************
+
+	SPI Functons
+
+*****************************/
+/* SPI register addresses 
+SPI_CS 		(base_pointer[6] + 0x0)  
+SPI_FIFO	(SPI_CS + 0x4/4)
+SPI_CLK		(SPI_CS + 0x8/4)
+SPI_DLEN	(SPI_CS + 0xC/4)
+SPI_LTOH	(SPI_CS + 0x10/4)
+SPI_DC		(SPI_CS + 0x14/4)
+*/
+
+/* Last SPI_CS configuration and SPI_CLK values written by spi_device_select() */
+static uint32_t spi_cs_shadow = 0;
+static uint32_t spi_clk_shadow = 0;
+static uint8_t spi_shadow_valid = 0;
+
+/* SPI0 clock last set in Hz with spi_set_speed_hz(), reapplied when the core clock changes */
+static uint32_t spi_speed_hz = 0;
+static uint32_t spi_speed_gen = 0;
+
+/* One lock per bus (SPI0, SPI1, SPI2) for the device handle functions */
+static pthread_mutex_t spi_bus_lock[3] = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * Start SPI operation
+ */
+int spi_start()
+{
+	spi_shadow_valid = 0;	// settings changed behind the device handles
+	spi_selected = NULL;
+
+	if(spi_dev_fd >= 0){
+		return 1;		// the kernel driver owns the pins
+	}
+
+	__sync_synchronize(); 
+    	if ( SPI_CS == 0 ){
+		printf("%s() error: ", __func__);
+      		puts("Invalid SPI registers addresses.");
+      		return 0; 
+    	}
+
+    	set_gpio(8,  4);  // PHY 24, GPIO 8,  using value 100 , set to alt 0    CE0
     	set_gpio(7,  4);  // PHY 26, GPIO 7,  using value 100 , set to alt 0	CE1
 	set_gpio(10, 4);  // PHY 19, GPIO 10, using value 100 , set to alt 0    MOSI
     	set_gpio(9,  4);  // PHY 21, GPIO 9,  using value 100 , set to alt 0 	MISO
@@ -1360,6 +2780,10 @@ int spi_start()
  * Stop SPI operation
  */
 void spi_stop() {
+	if(spi_dev_fd >= 0){
+		return;
+	}
+
 
         clear_fifo(C);	// Clear SPI TX and RX FIFO 
 
@@ -1376,10 +2800,63 @@ void spi_stop() {
  * Set SPI clock frequency
  */
 void spi_set_clock_freq(uint16_t divider){
+	spi_shadow_valid = 0;	// settings changed behind the device handles
+	spi_selected = NULL;
+	spi_speed_hz = 0;	// a fixed divider does not follow the core clock
+
+	if(spi_dev_fd >= 0){
+		spi_dev_speed = rpi_core_clock() / (divider ? divider : 65536);
+		return;
+	}
+
 	volatile uint32_t* div = (uint32_t *)SPI_CLK;
     	*div = divider;
 }
 
+/* Smallest valid SPI clock divider (even, 2 to 65536) not exceeding hz, internal use only */
+static uint32_t spi_clock_divider(uint32_t core, uint32_t hz)
+{
+	uint32_t div = hz ? (core + hz - 1) / hz : 65536;
+
+	div += div & 1;
+	if(div < 2){
+		div = 2;
+	}
+	else if(div > 65536){
+		div = 65536;
+	}
+	return div;
+}
+
+/*
+ * Set SPI clock frequency in Hz using the real core clock
+ * Returns the achieved frequency, the highest one not above hz
+ */
+uint32_t spi_set_speed_hz(uint32_t hz)
+{
+	uint32_t core = rpi_core_clock();
+	uint32_t div = spi_clock_divider(core, hz);
+
+	if(spi_dev_fd >= 0){
+		spi_selected = NULL;
+		spi_dev_speed = hz;	// the kernel driver picks the divider
+		return hz;
+	}
+
+	spi_set_clock_freq((uint16_t)div);	// 65536 is written as 0
+	spi_speed_hz = hz;
+	spi_speed_gen = core_clock_gen;
+	return core / div;
+}
+
+/* Recompute the divider of a speed set in Hz if the core clock has changed, internal use only */
+static void spi_speed_poll(void)
+{
+	if(spi_speed_hz && core_clock_poll() != spi_speed_gen){
+		spi_set_speed_hz(spi_speed_hz);
+	}
+}
+
 
 /*
  * Set SPI data mode
@@ -1391,6 +2868,15 @@ void spi_set_clock_freq(uint16_t divider){
  *
  */
 void spi_set_data_mode(uint8_t mode){
+	spi_shadow_valid = 0;	// settings changed behind the device handles
+	spi_selected = NULL;
+
+	if(spi_dev_fd >= 0){
+		spi_dev_mode = (spi_dev_mode & ~SPI_MODE_3) | (mode & SPI_MODE_3);
+		ioctl(spi_dev_fd, SPI_IOC_WR_MODE, &spi_dev_mode);
+		return;
+	}
+
            
         // alternative code
         /*
@@ -1432,6 +2918,16 @@ void spi_set_data_mode(uint8_t mode){
  */
 void spi_chip_select(uint8_t cs)
 {
+	spi_shadow_valid = 0;	// settings changed behind the device handles
+	spi_selected = NULL;
+
+	if(spi_dev_fd >= 0){
+		if(cs != spi_dev_cs){
+			spi_open_dev(spi_dev_bus, cs);
+		}
+		return;
+	}
+
     	volatile uint32_t* cs_addr = (uint32_t *)SPI_CS;
 
     	uint32_t mask = ~ (3 <<  0);	// clear bit 0 and 1 first
@@ -1445,6 +2941,17 @@ void spi_chip_select(uint8_t cs)
  */
 void spi_set_chip_select_polarity(uint8_t cs, uint8_t active)
 {
+	spi_shadow_valid = 0;	// settings changed behind the device handles
+	spi_selected = NULL;
+
+	if(spi_dev_fd >= 0){
+		if(cs == spi_dev_cs){
+			spi_dev_mode = active ? (spi_dev_mode | SPI_CS_HIGH) : (spi_dev_mode & ~SPI_CS_HIGH);
+			ioctl(spi_dev_fd, SPI_IOC_WR_MODE, &spi_dev_mode);
+		}
+		return;
+	}
+
 	/* Mask the appropriate CSPOLn bit */
     	clearBit(SPI_CS, 21);
     	clearBit(SPI_CS, 22);
@@ -1471,68 +2978,687 @@ void spi_set_chip_select_polarity(uint8_t cs, uint8_t active)
 }
 
 
-/* Writes and reads a number of bytes to/from a slave device */
-void spi_data_transfer(char* wbuf, char* rbuf, uint8_t len)
+/* SPI_CS status bits used by the transfer engine */
+#define SPI_CS_TA	(1 << 7)
+#define SPI_CS_DONE	(1 << 16)
+#define SPI_CS_RXD	(1 << 17)
+#define SPI_CS_TXD	(1 << 18)
+#define SPI_CS_RXR	(1 << 19)
+
+/* TX and RX FIFO depth, and the RX level flagged by RXR (3/4 full) */
+#define SPI_FIFO_SIZE	64
+#define SPI_FIFO_RXR	48
+
+/*
+ * Full-duplex transfer engine, internal use only. TA must already be set.
+ *
+ * TX fill and RX drain are interleaved, and each iteration reads SPI_CS only once.
+ * The number of bytes in flight (written but not read back yet) never exceeds the
+ * FIFO depth, so the TX FIFO always has room for them and the RX FIFO never fills
+ * up and stalls the clock. RXR tells that 48 bytes can be read without checking.
+ *
+ * wbuf = NULL sends zeros, rbuf = NULL discards the received bytes
+ */
+static void spi_pump(const char * wbuf, char * rbuf, size_t len)
 {
-	volatile uint32_t* fifo = (uint32_t *)SPI_FIFO;
+	volatile uint32_t * cs = (uint32_t *)SPI_CS;
+	volatile uint32_t * fifo = (uint32_t *)SPI_FIFO;
+
+	size_t tx = 0, rx = 0, n;
+	uint32_t status;
+	char byte;
+
+	while(rx < len){
+
+		__sync_synchronize();
+		status = *cs;
+
+		if(status & SPI_CS_RXR){
+			n = len - rx < SPI_FIFO_RXR ? len - rx : SPI_FIFO_RXR;
+		}
+		else{
+			n = (status & SPI_CS_RXD) ? 1 : 0;
+		}
+		for(; n > 0; n--){
+			byte = *fifo;
+			if(rbuf){
+				rbuf[rx] = byte;
+			}
+			rx++;
+		}
+
+		while(tx < len && tx - rx < SPI_FIFO_SIZE){
+			*fifo = wbuf ? (uint8_t)wbuf[tx] : 0;
+			tx++;
+		}
+	}
+
+	/* all bytes are back, wait for the last clock cycles */
+	while(!(*cs & SPI_CS_DONE)){
+		__sync_synchronize();
+	}
+}
 
-    	uint32_t w = 0; // write count index 
-    	uint32_t r = 0; // read count index
+/* Large transfers go through DMA when set up, see spi_dma_init() */
+static int spi_dma_pump(const struct spi_device * dev, const char * wbuf, char * rbuf, size_t len);
+
+/*
+ * Writes and reads a number of bytes to/from a slave device
+ * Any length is supported, wbuf = NULL sends zeros and rbuf = NULL discards the received bytes
+ */
+void spi_data_transfer(const char* wbuf, char* rbuf, size_t len)
+{
+	if(spi_dev_fd >= 0){
+		spi_dev_transfer(wbuf, rbuf, len);
+		return;
+	}
+	spi_speed_poll();
+	if(spi_dma_pump(NULL, wbuf, rbuf, len)){
+		return;
+	}
 
     	/* Clear TX and RX fifo's */
     	clear_fifo(SPI_CS);
 
     	/* Set TA = 1 to start data transfer */
-    	setBit(SPI_CS, 7);   // done = 1
-    
-    	/* Write data to FIFO */
-    	while (w < len) 
-    	{
-        	// TX fifo is not full, add/write more bytes
-        	while(isBitSet(SPI_CS, 18) && (w < len))
-        	{
-           		*fifo = wbuf[w];
-           		w++;
-         	}
-    	}
+    	setBit(SPI_CS, 7);
 
-    	/* read data from FIFO */
-    	while (r < len)
-    	{ 
-        	// RX fifo is not empty, read more received bytes 
-    		while(isBitSet(SPI_CS, 17) && (r < len ))
-        	{
-           		rbuf[r] = *fifo;
-           		r++;
-        	}
-    	}
+	spi_pump(wbuf, rbuf, len);
 
     	/* Set TA = 0, transfer is done */
-    	clearBit(SPI_CS, 7);  // Done = 0
-  
-    	/* DONE should be zero for complete data transfer */
-    	if(isBitSet(SPI_CS, 16)){
-                printf("%s() error: ", __func__);
-        	puts("data transfer error");
-    	}
+    	clearBit(SPI_CS, 7);
 }
 
-/* Writes a number of bytes to SPI device */
-void spi_write(char* wbuf, uint8_t len)
+/***************************************
+
+	Auxiliary SPI1/SPI2 Functions
+
+****************************************/
+/*
+ * The auxiliary block has two more SPI masters with their own 4 entry FIFOs:
+ *
+ * SPI1 on GPIO 16 (CE2), 17 (CE1), 18 (CE0), 19 (MISO), 20 (MOSI), 21 (SCLK), alt-func 4
+ * SPI2 on GPIO 40 (MISO), 41 (MOSI), 42 (SCLK), 43 (CE0), 44 (CE1), 45 (CE2), alt-func 4
+ *
+ * They are used through device handles on bus 1 and 2 (spi_device_set_bus()).
+ * The shift register is used in variable width mode, each FIFO entry carries up
+ * to 3 bytes and its bit count. Entries are written to TXHOLD to keep the chip
+ * select asserted, the last one to IO.
+ */
+#define AUX_CNTL0_SPEED(s)	((uint32_t)(s) << 20)
+#define AUX_CNTL0_CS		(7 << 17)
+#define AUX_CNTL0_VAR_WIDTH	(1 << 14)
+#define AUX_CNTL0_ENABLE	(1 << 11)
+#define AUX_CNTL0_IN_RISING	(1 << 10)
+#define AUX_CNTL0_CLEARFIFO	(1 << 9)
+#define AUX_CNTL0_OUT_RISING	(1 << 8)
+#define AUX_CNTL0_CPOL		(1 << 7)
+#define AUX_CNTL0_MSBF_OUT	(1 << 6)
+#define AUX_CNTL1_MSBF_IN	(1 << 1)
+
+#define AUX_STAT_TX_FULL	(1 << 10)
+#define AUX_STAT_RX_EMPTY	(1 << 7)
+
+#define AUX_FIFO_SIZE		4
+
+/* SPI1 and SPI2 register blocks, bus 1 and 2 */
+static volatile uint32_t *aux_spi_regs(uint8_t bus)
 {
-    	volatile uint32_t* fifo = (uint32_t *)SPI_FIFO;
-   
-    	/* Clear TX and RX fifo's */
-    	clear_fifo(SPI_CS);
+	return bus == 1 ? AUX_SPI1 : AUX_SPI2;
+}
 
-    	/* start data transfer, set TA = 1 */
-    	setBit(SPI_CS, 7); 
+/* AUX_ENABLES is shared by SPI1, SPI2 and the mini UART */
+static pthread_mutex_t aux_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    	uint8_t i = 0;
+/* Last CNTL0 value written for SPI1 and SPI2 */
+static uint32_t aux_cntl0_shadow[3] = {0};
 
-    	while (i < len) 
-    	{
-        	// TX fifo is not full, add/write more bytes
+/*
+ * Full-duplex transfer on SPI1/SPI2, internal use only
+ * At most AUX_FIFO_SIZE entries are in flight, so neither FIFO can overflow.
+ */
+static void aux_pump(volatile uint32_t * regs, const char * wbuf, char * rbuf, size_t len)
+{
+	volatile uint32_t * stat = regs + AUX_SPI_STAT;
+	size_t tx = 0, rx = 0;
+	uint32_t status, data, count, i;
+	uint32_t inflight = 0;
+
+	while(rx < len){
+
+		__sync_synchronize();
+		status = *stat;
+
+		if(!(status & AUX_STAT_RX_EMPTY)){
+			data = regs[AUX_SPI_IO];
+			count = len - rx < 3 ? (uint32_t)(len - rx) : 3;
+			for(i = 0; i < count; i++){
+				if(rbuf){
+					rbuf[rx] = (char)(data >> (8 * (count - 1 - i)));
+				}
+				rx++;
+			}
+			inflight--;
+		}
+
+		if(tx < len && inflight < AUX_FIFO_SIZE && !(status & AUX_STAT_TX_FULL)){
+			count = len - tx < 3 ? (uint32_t)(len - tx) : 3;
+			data = (count * 8) << 24;
+			for(i = 0; i < count; i++){
+				data |= (uint32_t)(wbuf ? (uint8_t)wbuf[tx + i] : 0) << (8 * (2 - i));
+			}
+			tx += count;
+			inflight++;
+
+			/* TXHOLD keeps the chip select asserted after the entry */
+			if(tx < len){
+				regs[AUX_SPI_TXHOLD] = data;
+			}
+			else{
+				regs[AUX_SPI_IO] = data;
+			}
+		}
+	}
+}
+
+/*
+ * Start an SPI bus, 0 = SPI0, 1 = SPI1, 2 = SPI2
+ * Returns 1 on success
+ */
+int spi_bus_start(uint8_t bus)
+{
+	static const uint8_t pins[3][6] = { {0}, {16, 17, 18, 19, 20, 21}, {40, 41, 42, 43, 44, 45} };
+	volatile uint32_t *regs;
+	int i;
+
+	if(bus == 0){
+		return spi_start();
+	}
+	if(bus > 2 || base_pointer[8] == NULL){
+		printf("%s() error: ", __func__);
+		puts("Invalid SPI bus or registers addresses.");
+		return 0;
+	}
+
+	pthread_mutex_lock(&aux_lock);
+	setBit(AUX_ENABLES, bus);		// bit 1 = SPI1, bit 2 = SPI2
+	pthread_mutex_unlock(&aux_lock);
+
+	for(i = 0; i < 6; i++){
+		set_gpio(pins[bus][i], 3);	// alt 011b, alt-func 4
+	}
+
+	regs = aux_spi_regs(bus);
+	regs[AUX_SPI_CNTL1] = AUX_CNTL1_MSBF_IN;
+	regs[AUX_SPI_CNTL0] = AUX_CNTL0_CLEARFIFO;
+	regs[AUX_SPI_CNTL0] = 0;
+	aux_cntl0_shadow[bus] = 0;
+	return 1;
+}
+
+/* Stop an SPI bus, 0 = SPI0, 1 = SPI1, 2 = SPI2 */
+void spi_bus_stop(uint8_t bus)
+{
+	static const uint8_t pins[3][6] = { {0}, {16, 17, 18, 19, 20, 21}, {40, 41, 42, 43, 44, 45} };
+	int i;
+
+	if(bus == 0){
+		spi_stop();
+		return;
+	}
+	if(bus > 2){
+		return;
+	}
+
+	aux_spi_regs(bus)[AUX_SPI_CNTL0] = 0;
+	aux_cntl0_shadow[bus] = 0;
+
+	pthread_mutex_lock(&aux_lock);
+	clearBit(AUX_ENABLES, bus);
+	pthread_mutex_unlock(&aux_lock);
+
+	for(i = 0; i < 6; i++){
+		set_gpio(pins[bus][i], 0);
+	}
+	__sync_synchronize();
+}
+
+
+/***************************************
+
+	SPI Device Handles
+
+****************************************/
+/*
+ * A device handle holds the bus, chip select, data mode, chip select polarity and
+ * clock of one slave device. The final register values (SPI_CS and SPI_CLK, or
+ * CNTL0 on SPI1/SPI2) are computed once, and switching between devices writes
+ * only the registers whose value changes, in one store each. Transfers start and
+ * end with a single SPI_CS store too, instead of the read-modify-write sequences
+ * of the individual spi_set_* functions.
+ *
+ * Each bus has its own lock, so devices on different buses can be used from
+ * separate threads at the same time.
+ *
+ * Any GPIO pin can be used as chip select (spi_device_set_gpio_cs()), the
+ * hardware chip select is then parked on CE2 (SPI0) or left unused (SPI1/SPI2).
+ */
+
+/* Compute the register values of a device for its bus, internal use only */
+static void spi_device_regs(struct spi_device * dev)
+{
+	uint32_t speed;
+
+	/* the handle's settings change, the spidev path must apply them again */
+	if(dev == spi_selected){
+		spi_selected = NULL;
+	}
+
+	if(dev->bus == 0){
+		/* CS (bits 0-1), CPHA (bit 2), CPOL (bit 3), CSPOLn (bits 21-23) */
+		if(dev->cs_gpio != SPI_CS_HW){
+			dev->cs_reg = 2 | ((uint32_t)dev->mode << 2);	// CE2 is not on the header
+		}
+		else{
+			dev->cs_reg = dev->cs | ((uint32_t)dev->mode << 2) | ((uint32_t)dev->cspol << (21 + dev->cs));
+		}
+		dev->clk_reg = dev->divider;
+		return;
+	}
+
+	/* SCLK = core / (2 * (speed + 1)), the same rate as core / divider on SPI0 */
+	speed = dev->divider ? dev->divider : 65536;
+	speed = speed / 2 > 0 ? speed / 2 - 1 : 0;
+	if(speed > 0xFFF){
+		speed = 0xFFF;
+	}
+
+	/* all chip selects high except the selected one, no active high chip selects */
+	dev->cs_reg = AUX_CNTL0_SPEED(speed) | AUX_CNTL0_VAR_WIDTH | AUX_CNTL0_ENABLE | AUX_CNTL0_MSBF_OUT;
+	if(dev->cs_gpio != SPI_CS_HW){
+		dev->cs_reg |= AUX_CNTL0_CS;	// GPIO chip select, keep all hardware ones high
+	}
+	else{
+		dev->cs_reg |= AUX_CNTL0_CS & ~(1UL << (17 + dev->cs));
+	}
+	if(dev->mode & 2){
+		dev->cs_reg |= AUX_CNTL0_CPOL;
+	}
+	/* data changes on the rising edge when CPOL ^ CPHA, otherwise it is sampled there */
+	dev->cs_reg |= ((dev->mode >> 1) ^ dev->mode) & 1 ? AUX_CNTL0_OUT_RISING : AUX_CNTL0_IN_RISING;
+	dev->clk_reg = 0;
+}
+
+/*
+ * Initialize a device handle on SPI0
+ * cs = chip select 0 to 2, mode = SPI data mode 0 to 3
+ * cspol = chip select active level 0 (low) or 1 (high), divider = SPI clock divider
+ */
+void spi_device_init(struct spi_device * dev, uint8_t cs, uint8_t mode, uint8_t cspol, uint16_t divider)
+{
+	if(cs > 2 || mode > 3){
+		printf("%s() error: ", __func__);
+		puts("Invalid cs or mode parameter.");
+		cs &= 3;
+		mode &= 3;
+	}
+
+	memset(dev, 0, sizeof(*dev));	// no GPIO chip select, no setup/hold delays
+	dev->bus = 0;
+	dev->cs_gpio = SPI_CS_HW;
+	dev->cs = cs;
+	dev->mode = mode;
+	dev->cspol = cspol ? 1 : 0;
+	dev->divider = divider;
+
+	spi_device_regs(dev);
+}
+
+/* Move a device handle to another bus, 0 = SPI0, 1 = SPI1, 2 = SPI2 */
+void spi_device_set_bus(struct spi_device * dev, uint8_t bus)
+{
+	if(bus > 2){
+		printf("%s() error: ", __func__);
+		puts("Invalid bus parameter.");
+		return;
+	}
+	if(bus != 0 && dev->cspol && dev->cs_gpio == SPI_CS_HW){
+		printf("%s() warning: ", __func__);
+		puts("SPI1/SPI2 chip selects are active low only.");
+	}
+	dev->bus = bus;
+	spi_device_regs(dev);
+}
+
+/* Busy wait for a few ns, for chip select setup/hold times, internal use only */
+static void spin_ns(uint32_t ns)
+{
+	struct timespec t0, t;
+
+	if(ns == 0){
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &t);
+	} while((uint64_t)(t.tv_sec - t0.tv_sec) * 1000000000 + t.tv_nsec - t0.tv_nsec < ns);
+}
+
+/*
+ * Use any GPIO pin (0 to 31) as the chip select of a device instead of CE0-CE2,
+ * so more devices can share a bus. The pin is asserted and released with a single
+ * GPCLR/GPSET store around each transfer, at the active level set by cspol.
+ * setup_ns = delay from assertion to the first clock edge
+ * hold_ns = delay from the last clock edge to release
+ * pin = SPI_CS_HW goes back to the hardware chip select
+ */
+void spi_device_set_gpio_cs(struct spi_device * dev, uint8_t pin, uint16_t setup_ns, uint16_t hold_ns)
+{
+	if(pin != SPI_CS_HW && pin > 31){
+		printf("%s() error: ", __func__);
+		puts("Invalid pin, choose GPIO 0 to 31.");
+		return;
+	}
+
+	dev->cs_gpio = pin;
+	dev->cs_setup_ns = setup_ns;
+	dev->cs_hold_ns = hold_ns;
+
+	if(pin != SPI_CS_HW){
+		dev->cs_mask = 1UL << pin;
+		gpio_write_mask(dev->cs_mask, dev->cspol ? 0 : dev->cs_mask);	// released
+		gpio_output(pin);
+	}
+	else{
+		dev->cs_mask = 0;
+	}
+	spi_device_regs(dev);
+}
+
+/* Assert a GPIO chip select, internal use only */
+static void spi_gpio_cs_assert(const struct spi_device * dev)
+{
+	if(dev->cs_mask){
+		__sync_synchronize();
+		if(dev->cspol){
+			*GPSET = dev->cs_mask;
+		}
+		else{
+			*GPCLR = dev->cs_mask;
+		}
+		spin_ns(dev->cs_setup_ns);
+	}
+}
+
+/* Release a GPIO chip select, internal use only */
+static void spi_gpio_cs_release(const struct spi_device * dev)
+{
+	if(dev->cs_mask){
+		spin_ns(dev->cs_hold_ns);
+		__sync_synchronize();
+		if(dev->cspol){
+			*GPCLR = dev->cs_mask;
+		}
+		else{
+			*GPSET = dev->cs_mask;
+		}
+	}
+}
+
+/*
+ * Set the clock of a device in Hz instead of a divider, e.g. its max. rated speed.
+ * The divider is recomputed on the next transfer after the core clock changed.
+ * Returns the achieved frequency, the highest one not above hz
+ */
+uint32_t spi_device_set_speed(struct spi_device * dev, uint32_t hz)
+{
+	uint32_t core = rpi_core_clock();
+	uint32_t div = spi_clock_divider(core, hz);
+
+	dev->speed_hz = hz;
+	dev->clk_gen = core_clock_gen;
+	dev->divider = (uint16_t)div;
+	spi_device_regs(dev);
+
+	if(dev->bus != 0 && div > 8192){
+		div = 8192;	// max. SPI1/SPI2 divider, 2 * 4096
+	}
+	return core / div;
+}
+
+/* Select a device with its bus lock held, internal use only */
+static void spi_device_select_locked(struct spi_device * dev)
+{
+	/* core clock has changed since the speed was set */
+	if(dev->speed_hz && dev->clk_gen != core_clock_poll()){
+		spi_device_set_speed(dev, dev->speed_hz);
+	}
+
+	if(dev->bus != 0){
+		if(dev->cs_reg != aux_cntl0_shadow[dev->bus]){
+			__sync_synchronize();
+			aux_spi_regs(dev->bus)[AUX_SPI_CNTL0] = dev->cs_reg;
+			aux_cntl0_shadow[dev->bus] = dev->cs_reg;
+		}
+		return;
+	}
+
+	if(spi_dev_fd >= 0){
+		if(dev != spi_selected){
+			spi_chip_select(dev->cs);
+			spi_set_data_mode(dev->mode);
+			spi_set_chip_select_polarity(dev->cs, dev->cspol);
+			spi_set_clock_freq(dev->divider);
+			spi_selected = dev;
+		}
+		return;
+	}
+
+	if(!spi_shadow_valid || dev->cs_reg != spi_cs_shadow){
+		__sync_synchronize();
+		*SPI_CS = dev->cs_reg;
+		spi_cs_shadow = dev->cs_reg;
+	}
+	if(!spi_shadow_valid || dev->clk_reg != spi_clk_shadow){
+		*SPI_CLK = dev->clk_reg;
+		spi_clk_shadow = dev->clk_reg;
+	}
+	spi_shadow_valid = 1;
+	spi_selected = dev;
+}
+
+/* Select a device, only the register values that differ are written */
+void spi_device_select(struct spi_device * dev)
+{
+	pthread_mutex_lock(&spi_bus_lock[dev->bus]);
+	spi_device_select_locked(dev);
+	pthread_mutex_unlock(&spi_bus_lock[dev->bus]);
+}
+
+/*
+ * Select a device and run a full-duplex transfer with it
+ * wbuf = NULL sends zeros, rbuf = NULL discards the received bytes
+ */
+void spi_device_transfer(struct spi_device * dev, const char * wbuf, char * rbuf, size_t len)
+{
+	pthread_mutex_lock(&spi_bus_lock[dev->bus]);
+	spi_device_select_locked(dev);
+	spi_gpio_cs_assert(dev);
+
+	if(dev->bus != 0){
+		aux_pump(aux_spi_regs(dev->bus), wbuf, rbuf, len);
+	}
+	else if(spi_dev_fd >= 0){
+		spi_dev_transfer(wbuf, rbuf, len);
+	}
+	else if(!spi_dma_pump(dev, wbuf, rbuf, len)){
+		__sync_synchronize();
+		*SPI_CS = dev->cs_reg | (3 << 4) | SPI_CS_TA;	// clear both FIFOs and set TA in one store
+
+		spi_pump(wbuf, rbuf, len);
+
+		*SPI_CS = dev->cs_reg;				// TA = 0
+		__sync_synchronize();
+	}
+	spi_gpio_cs_release(dev);
+	pthread_mutex_unlock(&spi_bus_lock[dev->bus]);
+}
+
+/***************************************
+
+	SPI LoSSI / 9-bit Functions
+
+****************************************/
+/*
+ * Display controllers with a 9-bit serial interface send a D/C bit in front of
+ * each byte (0 = command, 1 = data) instead of using a D/C line.
+ *
+ * On SPI0 this is the LoSSI mode (LEN bit of SPI_CS): each FIFO entry is a 9-bit
+ * word with the D/C bit in bit 8. On SPI1/SPI2 the variable width shift register
+ * sends two 9-bit words per FIFO entry.
+ */
+#define SPI_CS_LEN	(1 << 13)
+#define LOSSI_DATA	0x100
+
+/* 9-bit word i of a command followed by data, internal use only */
+#define LOSSI_WORD(cmd, data, i)	((cmd) < 0 ? (LOSSI_DATA | (data)[i]) : \
+					 (i) == 0 ? (uint32_t)(cmd) : (LOSSI_DATA | (data)[(i) - 1]))
+
+/*
+ * LoSSI transmit engine on SPI0, internal use only. TA and LEN must already be set.
+ * The RX FIFO is drained and discarded so it can never stall the transfer.
+ */
+static void lossi_pump(int cmd, const uint8_t * data, size_t n)
+{
+	volatile uint32_t * cs = (uint32_t *)SPI_CS;
+	volatile uint32_t * fifo = (uint32_t *)SPI_FIFO;
+	uint32_t status;
+	size_t tx = 0;
+
+	while(tx < n){
+		__sync_synchronize();
+		status = *cs;
+
+		if(status & SPI_CS_RXR){
+			for(uint32_t i = 0; i < SPI_FIFO_RXR; i++){
+				(void)*fifo;
+			}
+		}
+		else if(status & SPI_CS_RXD){
+			(void)*fifo;
+		}
+
+		while((status & SPI_CS_TXD) && tx < n){
+			*fifo = LOSSI_WORD(cmd, data, tx);
+			tx++;
+			status = *cs;
+		}
+	}
+
+	while(!(*cs & SPI_CS_DONE)){
+		__sync_synchronize();
+		if(*cs & SPI_CS_RXD){
+			(void)*fifo;
+		}
+	}
+}
+
+/* 9-bit transmit engine on SPI1/SPI2, two words per FIFO entry, internal use only */
+static void aux_pump9(volatile uint32_t * regs, int cmd, const uint8_t * data, size_t n)
+{
+	volatile uint32_t * stat = regs + AUX_SPI_STAT;
+	uint32_t status, entry, count;
+	uint32_t inflight = 0;
+	size_t tx = 0;
+
+	while(tx < n || inflight > 0){
+
+		__sync_synchronize();
+		status = *stat;
+
+		if(!(status & AUX_STAT_RX_EMPTY)){
+			(void)regs[AUX_SPI_IO];
+			inflight--;
+		}
+
+		if(tx < n && inflight < AUX_FIFO_SIZE && !(status & AUX_STAT_TX_FULL)){
+			count = n - tx < 2 ? 1 : 2;
+			entry = LOSSI_WORD(cmd, data, tx) << 15;	// MSB first from bit 23
+			if(count == 2){
+				entry |= LOSSI_WORD(cmd, data, tx + 1) << 6;
+			}
+			entry |= (count * 9) << 24;
+			tx += count;
+			inflight++;
+
+			if(tx < n){
+				regs[AUX_SPI_TXHOLD] = entry;
+			}
+			else{
+				regs[AUX_SPI_IO] = entry;
+			}
+		}
+	}
+}
+
+/*
+ * Send a 9-bit command byte followed by len data bytes in one chip select assertion
+ * cmd = command byte (D/C = 0), or -1 to send data bytes (D/C = 1) only
+ */
+void spi_lossi_write(struct spi_device * dev, int cmd, const uint8_t * data, size_t len)
+{
+	size_t n = len + (cmd >= 0 ? 1 : 0);
+
+	if(spi_dev_fd >= 0 && dev->bus == 0){
+		printf("%s() error: ", __func__);
+		puts("LoSSI is not supported by the kernel backend.");
+		return;
+	}
+
+	pthread_mutex_lock(&spi_bus_lock[dev->bus]);
+	spi_device_select_locked(dev);
+	spi_gpio_cs_assert(dev);
+
+	if(dev->bus != 0){
+		aux_pump9(aux_spi_regs(dev->bus), cmd, data, n);
+	}
+	else{
+		__sync_synchronize();
+		*SPI_CS = dev->cs_reg | SPI_CS_LEN | (3 << 4) | SPI_CS_TA;
+
+		lossi_pump(cmd, data, n);
+
+		*SPI_CS = dev->cs_reg;
+		spi_cs_shadow = dev->cs_reg;
+		__sync_synchronize();
+	}
+	spi_gpio_cs_release(dev);
+	pthread_mutex_unlock(&spi_bus_lock[dev->bus]);
+}
+
+/* Writes a number of bytes to SPI device */
+void spi_write(const char* wbuf, uint8_t len)
+{
+	if(spi_dev_fd >= 0){
+		spi_dev_transfer(wbuf, spi_dev_rx, len);
+		spi_dev_rx_len = len;
+		return;
+	}
+	spi_speed_poll();
+
+    	volatile uint32_t* fifo = (uint32_t *)SPI_FIFO;
+   
+    	/* Clear TX and RX fifo's */
+    	clear_fifo(SPI_CS);
+
+    	/* start data transfer, set TA = 1 */
+    	setBit(SPI_CS, 7); 
+
+    	uint8_t i = 0;
+
+    	while (i < len) 
+    	{
+        	// TX fifo is not full, add/write more bytes
         	while(isBitSet(SPI_CS, 18) && (i < len))
         	{
            		*fifo = wbuf[i];
@@ -1545,6 +3671,12 @@ void spi_write(char* wbuf, uint8_t len)
 /* read a number of bytes from SPI device */
 void spi_read(char* rbuf, uint8_t len)
 {
+	if(spi_dev_fd >= 0){
+		memcpy(rbuf, spi_dev_rx, len < spi_dev_rx_len ? len : spi_dev_rx_len);
+		spi_dev_rx_len = 0;
+		return;
+	}
+
     	volatile uint32_t* fifo = (uint32_t *)SPI_FIFO;
    
     	if(!isBitSet(SPI_CS, 7)){
@@ -1573,3 +3705,4264 @@ void spi_read(char* rbuf, uint8_t len)
 }
 
 
+/*************************************
+
+	SPI ADC Acquisition Functions
+
+**************************************/
+/*
+ * Continuous sampling of an MCP3008 class ADC (10-bit, 3 byte command frames).
+ *
+ * An engine thread sends the command frames of the configured channels round-robin.
+ * Up to 21 frames (63 bytes) are packed back-to-back in the FIFO per chip select
+ * assertion, for ADCs that convert while CS stays asserted. Use burst = 1 for
+ * ADCs like the MCP3008 that need CS toggled for each conversion, each frame is
+ * then a separate transfer.
+ *
+ * Each frame is timestamped with the system timer, interpolated between the start
+ * and end of its burst. Samples of each channel are aggregated over decimation
+ * frames into min/max/mean records, which are pushed into a lock-free ring read
+ * by the application with spi_adc_read(). Records that do not fit in the ring
+ * are dropped and counted as overruns.
+ */
+#define ADC_FRAME_LEN	3
+#define ADC_MAX_BURST	(SPI_FIFO_SIZE / ADC_FRAME_LEN)
+
+struct adc_acc {
+	uint16_t min;
+	uint16_t max;
+	uint32_t sum;
+	uint16_t count;
+};
+
+static struct adc_config adc_cfg;
+static struct ring adc_ring;
+static struct adc_acc adc_acc[8];
+static pthread_t adc_thread;
+static atomic_int adc_running = 0;
+static _Atomic uint64_t adc_frames = 0;
+static _Atomic uint32_t adc_overruns = 0;
+
+/* Add one conversion result to its channel aggregate, internal use only */
+static void adc_add(uint8_t idx, uint16_t value, uint64_t ts)
+{
+	struct adc_acc *a = &adc_acc[idx];
+	struct adc_sample rec;
+
+	if(a->count == 0 || value < a->min){
+		a->min = value;
+	}
+	if(a->count == 0 || value > a->max){
+		a->max = value;
+	}
+	a->sum += value;
+	a->count++;
+
+	if(a->count >= adc_cfg.decimation){
+		rec.timestamp = ts;
+		rec.channel = adc_cfg.channels[idx];
+		rec.min = a->min;
+		rec.max = a->max;
+		rec.mean = (uint16_t)((a->sum + a->count / 2) / a->count);
+		rec.count = a->count;
+
+		if(ring_write(&adc_ring, &rec, 1) == 0){
+			atomic_fetch_add_explicit(&adc_overruns, 1, memory_order_relaxed);
+		}
+		a->count = 0;
+		a->sum = 0;
+	}
+}
+
+/* Acquisition engine thread */
+static void *adc_engine(void *arg)
+{
+	char wbuf[ADC_MAX_BURST * ADC_FRAME_LEN];
+	char rbuf[ADC_MAX_BURST * ADC_FRAME_LEN];
+	uint8_t idx[ADC_MAX_BURST];
+	uint8_t next = 0;	/* next channel index */
+	uint64_t t0, t1, due = 0;
+	uint32_t period = 0;
+	uint8_t i, n = adc_cfg.burst;
+
+	(void)arg;
+
+	if(adc_cfg.rate_hz){
+		period = (uint32_t)(1000000ULL * n / adc_cfg.rate_hz);	/* us per burst */
+	}
+
+	while(atomic_load_explicit(&adc_running, memory_order_relaxed)){
+
+		/* command frames: start bit, single-ended + channel, 8 clocks for the result */
+		for(i = 0; i < n; i++){
+			idx[i] = next;
+			wbuf[i * ADC_FRAME_LEN + 0] = 0x01;
+			wbuf[i * ADC_FRAME_LEN + 1] = (char)(0x80 | (adc_cfg.channels[next] << 4));
+			wbuf[i * ADC_FRAME_LEN + 2] = 0x00;
+			if(++next >= adc_cfg.nch){
+				next = 0;
+			}
+		}
+
+		if(period){
+			while(st_read() < due){
+				;	/* spin, the wait is shorter than a scheduler tick */
+			}
+			due = due ? due + period : st_read() + period;
+		}
+
+		t0 = st_read();
+		spi_device_transfer(adc_cfg.dev, wbuf, rbuf, n * ADC_FRAME_LEN);
+		t1 = st_read();
+
+		for(i = 0; i < n; i++){
+			uint16_t value = ((rbuf[i * ADC_FRAME_LEN + 1] & 0x03) << 8) | (uint8_t)rbuf[i * ADC_FRAME_LEN + 2];
+			adc_add(idx[i], value, t0 + (t1 - t0) * (i + 1) / n);
+		}
+		atomic_fetch_add_explicit(&adc_frames, n, memory_order_relaxed);
+	}
+	return NULL;
+}
+
+/*
+ * Start continuous acquisition, the SPI bus must be started with spi_start().
+ * The engine thread owns the SPI bus until spi_adc_stop().
+ * Returns 1 on success
+ */
+int spi_adc_start(const struct adc_config * cfg)
+{
+	uint8_t i;
+
+	if(atomic_load(&adc_running)){
+		printf("%s() error: ", __func__);
+		puts("ADC acquisition is already running.");
+		return 0;
+	}
+	if(cfg->dev == NULL || cfg->nch == 0 || cfg->nch > 8 || cfg->burst == 0 || cfg->burst > ADC_MAX_BURST){
+		printf("%s() error: ", __func__);
+		puts("Invalid device, channel count (1 to 8) or burst (1 to 21) parameter.");
+		return 0;
+	}
+	for(i = 0; i < cfg->nch; i++){
+		if(cfg->channels[i] > 7){
+			printf("%s() error: ", __func__);
+			puts("Invalid channel, choose 0 to 7.");
+			return 0;
+		}
+	}
+
+	adc_cfg = *cfg;
+	if(adc_cfg.decimation == 0){
+		adc_cfg.decimation = 1;
+	}
+	if(!ring_init(&adc_ring, cfg->ring_size ? cfg->ring_size : 4096, sizeof(struct adc_sample))){
+		perror("spi_adc_start() error");
+		return 0;
+	}
+	memset(adc_acc, 0, sizeof(adc_acc));
+	atomic_store(&adc_frames, 0);
+	atomic_store(&adc_overruns, 0);
+
+	atomic_store(&adc_running, 1);
+	if(pthread_create(&adc_thread, NULL, adc_engine, NULL) != 0){
+		perror("pthread_create() error");
+		atomic_store(&adc_running, 0);
+		ring_free(&adc_ring);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Stop acquisition, records still in the ring are discarded
+ * May be called while another thread is in spi_adc_read(), which then returns 0
+ */
+void spi_adc_stop(void)
+{
+	if(!atomic_load(&adc_running)){
+		return;
+	}
+	atomic_store(&adc_running, 0);
+	pthread_join(adc_thread, NULL);
+	ring_retire(&adc_ring);
+}
+
+/* Read up to max aggregated sample records, returns the no. of records read */
+uint32_t spi_adc_read(struct adc_sample * samples, uint32_t max)
+{
+	uint32_t n;
+
+	if(!ring_enter(&adc_ring, &adc_running)){
+		return 0;
+	}
+	n = ring_read(&adc_ring, samples, max);
+	ring_leave(&adc_ring);
+	return n;
+}
+
+/* Get the no. of frames converted and records dropped because the ring was full */
+void spi_adc_stats(uint64_t * frames, uint32_t * overruns)
+{
+	if(frames){
+		*frames = atomic_load(&adc_frames);
+	}
+	if(overruns){
+		*overruns = atomic_load(&adc_overruns);
+	}
+}
+
+
+/*************************************
+
+	SPI Streaming Functions
+
+**************************************/
+/*
+ * Capture a long stream from an SPI device straight into a memory-mapped file.
+ *
+ * The file is mapped in windows of a few MB. The SPI transfer engine writes
+ * directly into the pages of the current window, so there are no copies and
+ * no allocation in the transfer loop. Each window is one continuous transfer
+ * (chip select stays asserted).
+ *
+ * A helper thread keeps the file work out of the transfer loop: while a window
+ * is being filled it reserves and maps the next one (MAP_POPULATE, so it is
+ * prefaulted), and afterwards it flushes and unmaps the finished window
+ * according to the policy flags:
+ * SPI_STREAM_ASYNC	start writeback of the window (msync MS_ASYNC)
+ * SPI_STREAM_SYNC	wait until the window is on disk (msync MS_SYNC)
+ * SPI_STREAM_DROP	release the pages of written windows from memory
+ */
+static volatile int spi_stream_running = 0;
+
+/* Work handed to the helper thread, guarded by lock */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int fd;
+	size_t window;
+	uint8_t policy;
+	int grow;			/* reserve each window before mapping it (total = 0) */
+	int quit;
+	int map_pending;		/* map the window at map_offset into mapped */
+	uint64_t map_offset;
+	char *mapped;
+	int retire_pending;		/* flush and unmap retire, retire_len bytes at retire_offset */
+	char *retire;
+	size_t retire_len;
+	uint64_t retire_offset;
+} ss = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, -1, 0, 0, 0, 0, 0, 0, NULL, 0, NULL, 0, 0 };
+
+/* Map one window of the output file, internal use only */
+static char *spi_stream_map(int fd, uint64_t offset, size_t len)
+{
+	char *p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, (off_t)offset);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+/* Flush and unmap a finished window, internal use only */
+static void spi_stream_retire(char *p, size_t len, uint64_t offset)
+{
+	if(ss.policy & SPI_STREAM_ASYNC){
+		msync(p, len, MS_ASYNC);
+	}
+	if(ss.policy & SPI_STREAM_SYNC){
+		msync(p, len, MS_SYNC);
+	}
+	if(ss.policy & SPI_STREAM_DROP){
+		madvise(p, len, MADV_DONTNEED);
+		/* the window before has had time to be written back, drop it from the page cache */
+		if(offset >= ss.window){
+			posix_fadvise(ss.fd, (off_t)(offset - ss.window), (off_t)ss.window, POSIX_FADV_DONTNEED);
+		}
+	}
+	munmap(p, ss.window);
+}
+
+/* Helper thread, maps windows ahead and retires finished ones, internal use only */
+static void *spi_stream_helper(void *arg)
+{
+	uint64_t offset;
+	size_t len;
+	char *p;
+
+	(void)arg;
+
+	pthread_mutex_lock(&ss.lock);
+	for(;;){
+		while(!ss.quit && !ss.map_pending && !ss.retire_pending){
+			pthread_cond_wait(&ss.cond, &ss.lock);
+		}
+
+		/* the transfer loop waits for the next window, so mapping goes first */
+		if(ss.map_pending){
+			offset = ss.map_offset;
+			pthread_mutex_unlock(&ss.lock);
+
+			p = NULL;
+			if(!ss.grow || posix_fallocate(ss.fd, (off_t)offset, (off_t)ss.window) == 0
+			   || ftruncate(ss.fd, (off_t)(offset + ss.window)) == 0){
+				p = spi_stream_map(ss.fd, offset, ss.window);
+			}
+			if(p == NULL){
+				perror("spi_stream_file() mmap error");
+			}
+
+			pthread_mutex_lock(&ss.lock);
+			ss.mapped = p;
+			ss.map_pending = 0;
+			pthread_cond_broadcast(&ss.cond);
+		}
+		else if(ss.retire_pending){
+			p = ss.retire;
+			len = ss.retire_len;
+			offset = ss.retire_offset;
+			pthread_mutex_unlock(&ss.lock);
+
+			spi_stream_retire(p, len, offset);
+
+			pthread_mutex_lock(&ss.lock);
+			ss.retire_pending = 0;
+			pthread_cond_broadcast(&ss.cond);
+		}
+		else{
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ss.lock);
+	return NULL;
+}
+
+/* Stop a running spi_stream_file(), e.g. from a signal handler */
+void spi_stream_stop(void)
+{
+	spi_stream_running = 0;
+}
+
+/*
+ * Stream total bytes (0 = until spi_stream_stop()) from a device into the file path
+ * window = bytes per mapped window, rounded to whole pages (0 = 4 MB)
+ * policy = SPI_STREAM_* flags
+ * Returns the no. of bytes captured, or -1 on error
+ */
+int64_t spi_stream_file(struct spi_device * dev, const char * path, uint64_t total, size_t window, uint8_t policy)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	uint64_t offset = 0, size;
+	pthread_t helper;
+	char *cur, *next;
+	size_t len;
+	int fd;
+
+	if(window == 0){
+		window = 4 * 1024 * 1024;
+	}
+	window = (window + page - 1) / page * page;
+
+	fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+	if(fd < 0){
+		perror(path);
+		printf("%s() error: ", __func__);
+		puts("Cannot create output file.");
+		return -1;
+	}
+
+	/* reserve the disk space up front, a full disk would raise SIGBUS in the mapping */
+	size = total ? total : (uint64_t)window;
+	if(posix_fallocate(fd, 0, (off_t)size) != 0 && ftruncate(fd, (off_t)size) < 0){
+		perror("spi_stream_file() error");
+		close(fd);
+		return -1;
+	}
+
+	cur = spi_stream_map(fd, 0, window);
+	if(cur == NULL){
+		perror("spi_stream_file() mmap error");
+		close(fd);
+		return -1;
+	}
+
+	ss.fd = fd;
+	ss.window = window;
+	ss.policy = policy;
+	ss.grow = total == 0;
+	ss.quit = 0;
+	ss.map_pending = 0;
+	ss.retire_pending = 0;
+	if(pthread_create(&helper, NULL, spi_stream_helper, NULL) != 0){
+		perror("pthread_create() error");
+		munmap(cur, window);
+		close(fd);
+		return -1;
+	}
+
+	spi_stream_running = 1;
+	while(spi_stream_running && (total == 0 || offset < total)){
+
+		len = (total && total - offset < window) ? (size_t)(total - offset) : window;
+
+		/* have the next window mapped while this one is filled */
+		pthread_mutex_lock(&ss.lock);
+		if(total == 0 || offset + window < total){
+			ss.map_offset = offset + window;
+			ss.map_pending = 1;
+			pthread_cond_broadcast(&ss.cond);
+		}
+		pthread_mutex_unlock(&ss.lock);
+
+		spi_device_transfer(dev, NULL, cur, len);
+
+		/* hand the window over for writeback, then pick up the next one */
+		pthread_mutex_lock(&ss.lock);
+		while(ss.map_pending || ss.retire_pending){
+			pthread_cond_wait(&ss.cond, &ss.lock);
+		}
+		next = ss.mapped;
+		ss.mapped = NULL;
+		ss.retire = cur;
+		ss.retire_len = len;
+		ss.retire_offset = offset;
+		ss.retire_pending = 1;
+		pthread_cond_broadcast(&ss.cond);
+		pthread_mutex_unlock(&ss.lock);
+
+		offset += len;
+		cur = next;
+
+		if(cur == NULL){
+			break;
+		}
+	}
+
+	/* let the helper finish the last window */
+	pthread_mutex_lock(&ss.lock);
+	ss.quit = 1;
+	pthread_cond_broadcast(&ss.cond);
+	pthread_mutex_unlock(&ss.lock);
+	pthread_join(helper, NULL);
+
+	if(cur != NULL){
+		munmap(cur, window);
+	}
+
+	/* cut off the unused space reserved ahead */
+	if(ftruncate(fd, (off_t)offset) < 0){
+		perror("spi_stream_file() error");
+	}
+	if(policy & (SPI_STREAM_ASYNC|SPI_STREAM_SYNC)){
+		fdatasync(fd);
+	}
+	close(fd);
+	spi_stream_running = 0;
+
+	return (int64_t)offset;
+}
+
+
+/*************************************
+
+	SPI Display Functions
+
+**************************************/
+/*
+ * Framebuffer pusher for ILI9341/ST7789 class SPI TFT panels (RGB565).
+ *
+ * Drawing functions update an in-memory framebuffer and record dirty rectangles.
+ * display_flush() sets the column/row address window (CASET/RASET) of each dirty
+ * rectangle only, then streams its pixels after RAMWR in one FIFO-fed burst.
+ * Full width rectangles are sent straight from the framebuffer, narrower ones are
+ * gathered into a staging buffer first. The D/C line is driven with masked GPIO
+ * writes (one GPSET or GPCLR store), or with dc_pin = DISPLAY_LOSSI the panel
+ * is driven in 9-bit mode and the D/C bit is sent by the hardware.
+ *
+ * Pixels are stored in the panel byte order (big endian), so no conversion is
+ * needed when they are sent.
+ */
+#define ILI_CASET	0x2A
+#define ILI_RASET	0x2B
+#define ILI_RAMWR	0x2C
+
+/* Byte swap of a RGB565 color into the panel byte order */
+#define DISPLAY_PIXEL(c)	((uint16_t)(((c) >> 8) | ((c) << 8)))
+
+/*
+ * Initialize a display handle, the framebuffer is cleared to black
+ * dev = SPI device of the panel, dc_pin = GPIO pin driving the D/C line or DISPLAY_LOSSI
+ * Returns 1 on success
+ */
+int display_init(struct display * d, struct spi_device * dev, uint8_t dc_pin, uint16_t width, uint16_t height)
+{
+	memset(d, 0, sizeof(*d));
+	d->dev = dev;
+	d->dc_mask = dc_pin == DISPLAY_LOSSI ? 0 : 1UL << dc_pin;
+	d->width = width;
+	d->height = height;
+
+	d->fb = calloc((size_t)width * height, sizeof(uint16_t));
+	d->stage = malloc((size_t)width * height * sizeof(uint16_t));
+	if(d->fb == NULL || d->stage == NULL){
+		printf("%s() error: ", __func__);
+		puts("Cannot allocate the framebuffer.");
+		display_free(d);
+		return 0;
+	}
+
+	if(d->dc_mask){
+		gpio_output(dc_pin);
+		gpio_write_mask(d->dc_mask, d->dc_mask);
+	}
+	return 1;
+}
+
+/* Release the framebuffer of a display handle */
+void display_free(struct display * d)
+{
+	free(d->fb);
+	free(d->stage);
+	d->fb = NULL;
+	d->stage = NULL;
+}
+
+/* Send a command byte (D/C low) followed by its parameter bytes (D/C high) */
+void display_command(struct display * d, uint8_t cmd, const uint8_t * params, size_t len)
+{
+	char c = (char)cmd;
+
+	if(d->dc_mask == 0){
+		spi_lossi_write(d->dev, cmd, params, len);
+		return;
+	}
+
+	gpio_write_mask(d->dc_mask, 0);
+	spi_device_transfer(d->dev, &c, NULL, 1);
+	gpio_write_mask(d->dc_mask, d->dc_mask);
+
+	if(len > 0){
+		spi_device_transfer(d->dev, (const char *)params, NULL, len);
+	}
+}
+
+/* Clip a rectangle to the panel, returns 0 if nothing is left */
+static int display_clip(const struct display * d, int * x, int * y, int * w, int * h)
+{
+	if(*x < 0){
+		*w += *x;
+		*x = 0;
+	}
+	if(*y < 0){
+		*h += *y;
+		*y = 0;
+	}
+	if(*x + *w > d->width){
+		*w = d->width - *x;
+	}
+	if(*y + *h > d->height){
+		*h = d->height - *y;
+	}
+	return *w > 0 && *h > 0;
+}
+
+/*
+ * Mark a region as changed, e.g. after writing to d->fb directly
+ * Overlapping or touching rectangles are merged. When the list is full the new
+ * rectangle is merged with the one whose area grows the least.
+ */
+void display_mark_dirty(struct display * d, int x, int y, int w, int h)
+{
+	struct display_rect r;
+	uint32_t best_growth = UINT32_MAX;
+	int i, best = 0;
+
+	if(!display_clip(d, &x, &y, &w, &h)){
+		return;
+	}
+	r = (struct display_rect){ x, y, x + w, y + h };
+
+	for(;;){
+		for(i = 0; i < d->ndirty; i++){
+			struct display_rect *o = &d->dirty[i];
+
+			if(r.x0 <= o->x1 && o->x0 <= r.x1 && r.y0 <= o->y1 && o->y0 <= r.y1){
+				break;
+			}
+		}
+		if(i == d->ndirty){
+			break;
+		}
+
+		/* merge with an overlapping rectangle and check again with the bigger one */
+		r.x0 = r.x0 < d->dirty[i].x0 ? r.x0 : d->dirty[i].x0;
+		r.y0 = r.y0 < d->dirty[i].y0 ? r.y0 : d->dirty[i].y0;
+		r.x1 = r.x1 > d->dirty[i].x1 ? r.x1 : d->dirty[i].x1;
+		r.y1 = r.y1 > d->dirty[i].y1 ? r.y1 : d->dirty[i].y1;
+		d->dirty[i] = d->dirty[--d->ndirty];
+	}
+
+	if(d->ndirty < DISPLAY_MAX_DIRTY){
+		d->dirty[d->ndirty++] = r;
+		return;
+	}
+
+	for(i = 0; i < d->ndirty; i++){
+		struct display_rect *o = &d->dirty[i];
+		uint32_t uw = (r.x1 > o->x1 ? r.x1 : o->x1) - (r.x0 < o->x0 ? r.x0 : o->x0);
+		uint32_t uh = (r.y1 > o->y1 ? r.y1 : o->y1) - (r.y0 < o->y0 ? r.y0 : o->y0);
+		uint32_t growth = uw * uh - (uint32_t)(o->x1 - o->x0) * (o->y1 - o->y0);
+
+		if(growth < best_growth){
+			best_growth = growth;
+			best = i;
+		}
+	}
+	d->ndirty--;
+	r.x0 = r.x0 < d->dirty[best].x0 ? r.x0 : d->dirty[best].x0;
+	r.y0 = r.y0 < d->dirty[best].y0 ? r.y0 : d->dirty[best].y0;
+	r.x1 = r.x1 > d->dirty[best].x1 ? r.x1 : d->dirty[best].x1;
+	r.y1 = r.y1 > d->dirty[best].y1 ? r.y1 : d->dirty[best].y1;
+	d->dirty[best] = d->dirty[d->ndirty];
+	display_mark_dirty(d, r.x0, r.y0, r.x1 - r.x0, r.y1 - r.y0);
+}
+
+/* Set one pixel to a RGB565 color */
+void display_pixel(struct display * d, int x, int y, uint16_t color)
+{
+	if(x < 0 || y < 0 || x >= d->width || y >= d->height){
+		return;
+	}
+	d->fb[(size_t)y * d->width + x] = DISPLAY_PIXEL(color);
+	display_mark_dirty(d, x, y, 1, 1);
+}
+
+/* Fill a rectangle with a RGB565 color */
+void display_fill_rect(struct display * d, int x, int y, int w, int h, uint16_t color)
+{
+	uint16_t pixel = DISPLAY_PIXEL(color);
+	int i, j;
+
+	if(!display_clip(d, &x, &y, &w, &h)){
+		return;
+	}
+	for(j = y; j < y + h; j++){
+		uint16_t *row = d->fb + (size_t)j * d->width;
+		for(i = x; i < x + w; i++){
+			row[i] = pixel;
+		}
+	}
+	display_mark_dirty(d, x, y, w, h);
+}
+
+/* Copy a w x h block of RGB565 pixels to x, y */
+void display_blit(struct display * d, int x, int y, int w, int h, const uint16_t * pixels)
+{
+	int i, j;
+
+	for(j = 0; j < h; j++){
+		if(y + j < 0 || y + j >= d->height){
+			continue;
+		}
+		for(i = 0; i < w; i++){
+			if(x + i >= 0 && x + i < d->width){
+				d->fb[(size_t)(y + j) * d->width + x + i] = DISPLAY_PIXEL(pixels[(size_t)j * w + i]);
+			}
+		}
+	}
+	display_mark_dirty(d, x, y, w, h);
+}
+
+/* Set the address window to a rectangle and start a memory write, internal use only */
+static void display_window(struct display * d, const struct display_rect * r)
+{
+	uint8_t col[4] = { r->x0 >> 8, r->x0 & 0xFF, (r->x1 - 1) >> 8, (r->x1 - 1) & 0xFF };
+	uint8_t row[4] = { r->y0 >> 8, r->y0 & 0xFF, (r->y1 - 1) >> 8, (r->y1 - 1) & 0xFF };
+
+	display_command(d, ILI_CASET, col, 4);
+	display_command(d, ILI_RASET, row, 4);
+	display_command(d, ILI_RAMWR, NULL, 0);
+}
+
+/*
+ * Send all dirty rectangles to the panel
+ * Returns the no. of bytes sent, d->frame_us and d->frame_bytes hold the stats of the last flush
+ */
+uint32_t display_flush(struct display * d)
+{
+	uint64_t t0 = st_read();
+	uint32_t bytes = 0;
+	int i, j;
+
+	for(i = 0; i < d->ndirty; i++){
+		struct display_rect *r = &d->dirty[i];
+		int w = r->x1 - r->x0;
+		int h = r->y1 - r->y0;
+		size_t len = (size_t)w * h * sizeof(uint16_t);
+		const uint16_t *src;
+
+		display_window(d, r);
+
+		if(w == d->width){
+			src = d->fb + (size_t)r->y0 * d->width;	// rows are contiguous
+		}
+		else{
+			for(j = 0; j < h; j++){
+				memcpy(d->stage + (size_t)j * w, d->fb + (size_t)(r->y0 + j) * d->width + r->x0, w * sizeof(uint16_t));
+			}
+			src = d->stage;
+		}
+		if(d->dc_mask){
+			spi_device_transfer(d->dev, (const char *)src, NULL, len);
+		}
+		else{
+			spi_lossi_write(d->dev, -1, (const uint8_t *)src, len);
+		}
+
+		bytes += len + 3 + 2 * 4;	// pixels, commands and window parameters
+	}
+	d->ndirty = 0;
+
+	d->frame_us = (uint32_t)(st_read() - t0);
+	d->frame_bytes = bytes;
+	d->frames++;
+	return bytes;
+}
+
+
+/*************************************
+
+	SPI Slave Functions
+
+**************************************/
+/*
+ * The BSC/SPI slave peripheral receives a stream from an external SPI master
+ * (FPGA, MCU) on GPIO 18 (MOSI), 19 (SCLK), 20 (MISO) and 21 (CE), alt-func 3.
+ *
+ * The 16 byte RX FIFO fills up in 16 bytes times at the master clock rate, so a
+ * thread pinned to one CPU drains it continuously: it reads the FIFO level once
+ * and then that many bytes without checking, and writes them in one go into a
+ * lock-free ring read by the application with spi_slave_read(). FIFO overruns
+ * (bytes lost in hardware) and ring overflows (bytes the application did not
+ * read in time) are counted separately.
+ *
+ * This shares the peripheral with the I2C slave, only one of them can run.
+ */
+static struct ring spi_sl_ring;
+static pthread_t spi_sl_thread;
+static atomic_int spi_sl_running = 0;
+static _Atomic uint64_t spi_sl_bytes = 0;
+static _Atomic uint64_t spi_sl_dropped = 0;
+static _Atomic uint32_t spi_sl_overruns = 0;
+static int spi_sl_cpu = -1;
+
+static int slave_spi_busy(void)
+{
+	return atomic_load(&spi_sl_running);
+}
+
+/* SPI slave receive thread */
+static void *spi_sl_service(void *arg)
+{
+	uint8_t buf[32];
+	uint32_t fr, dr, flags, n, i, idle = 0;
+
+	(void)arg;
+
+	if(spi_sl_cpu >= 0){
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(spi_sl_cpu, &set);
+		if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0){
+			puts("spi_slave_start() warning: cannot pin the receive thread.");
+		}
+	}
+
+	while(atomic_load_explicit(&spi_sl_running, memory_order_relaxed)){
+
+		__sync_synchronize();
+		fr = *SL_FR;
+		n = SL_FR_RXFLEVEL(fr);
+
+		if(n == 0){
+			/* keep spinning while data flows, back off when the master is idle */
+			if(++idle > 100000 && !(fr & SL_FR_RXBUSY)){
+				uswait(20);
+			}
+			continue;
+		}
+		idle = 0;
+
+		for(i = 0, flags = 0; i < n; i++){
+			dr = *SL_DR;
+			buf[i] = dr & 0xFF;
+			flags |= dr;
+		}
+
+		/* OE, the FIFO was full and bytes were lost */
+		if(flags & (1 << 8)){
+			*SL_RSR = 0;
+			atomic_fetch_add_explicit(&spi_sl_overruns, 1, memory_order_relaxed);
+		}
+
+		atomic_fetch_add_explicit(&spi_sl_bytes, n, memory_order_relaxed);
+		i = ring_write(&spi_sl_ring, buf, n);
+		if(i < n){
+			atomic_fetch_add_explicit(&spi_sl_dropped, n - i, memory_order_relaxed);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Start SPI slave reception
+ * mode = SPI data mode 0 to 3 of the master
+ * ring_size = bytes buffered for the application (0 = 1 MB)
+ * cpu = CPU to pin the receive thread to, -1 for no pinning
+ * Returns 1 on success
+ */
+int spi_slave_start(uint8_t mode, uint32_t ring_size, int cpu)
+{
+	if(SL_DR == 0){
+		printf("%s() error: ", __func__);
+		puts("Invalid SPI slave registers addresses.");
+		return 0;
+	}
+	if(atomic_load(&spi_sl_running) || atomic_load(&sl_running)){
+		printf("%s() error: ", __func__);
+		puts("The BSC/SPI slave peripheral is already in use.");
+		return 0;
+	}
+	if(!ring_init(&spi_sl_ring, ring_size ? ring_size : 1024 * 1024, 1)){
+		perror("spi_slave_start() error");
+		return 0;
+	}
+
+	set_gpio(18, 7);	// alt 111b, PHY 12, GPIO 18, alt 3	MOSI
+	set_gpio(19, 7);	// alt 111b, PHY 35, GPIO 19, alt 3	SCLK
+	set_gpio(20, 7);	// alt 111b, PHY 38, GPIO 20, alt 3	MISO
+	set_gpio(21, 7);	// alt 111b, PHY 40, GPIO 21, alt 3	CE
+
+	*SL_CR = SL_CR_BRK;
+	*SL_CR = 0;
+	*SL_RSR = 0;
+	*SL_IMSC = 0;
+	*SL_CR = SL_CR_EN | SL_CR_SPI | SL_CR_RXE
+	       | ((mode & 1) ? SL_CR_CPHA : 0) | ((mode & 2) ? SL_CR_CPOL : 0);
+
+	atomic_store(&spi_sl_bytes, 0);
+	atomic_store(&spi_sl_dropped, 0);
+	atomic_store(&spi_sl_overruns, 0);
+	spi_sl_cpu = cpu;
+
+	atomic_store(&spi_sl_running, 1);
+	if(pthread_create(&spi_sl_thread, NULL, spi_sl_service, NULL) != 0){
+		perror("pthread_create() error");
+		atomic_store(&spi_sl_running, 0);
+		*SL_CR = 0;
+		ring_free(&spi_sl_ring);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Stop SPI slave reception, bytes still in the ring are discarded
+ * May be called while another thread is in spi_slave_read(), which then returns 0
+ */
+void spi_slave_stop(void)
+{
+	int pin;
+
+	if(!atomic_load(&spi_sl_running)){
+		return;
+	}
+	atomic_store(&spi_sl_running, 0);
+	pthread_join(spi_sl_thread, NULL);
+
+	*SL_CR = SL_CR_BRK;
+	*SL_CR = 0;
+	ring_retire(&spi_sl_ring);
+
+	for(pin = 18; pin <= 21; pin++){
+		set_gpio(pin, 0);
+	}
+	__sync_synchronize();
+}
+
+/* Read up to len received bytes, returns the no. of bytes read */
+size_t spi_slave_read(uint8_t * buf, size_t len)
+{
+	size_t n;
+
+	if(!ring_enter(&spi_sl_ring, &spi_sl_running)){
+		return 0;
+	}
+	n = ring_read(&spi_sl_ring, buf, len > UINT32_MAX ? UINT32_MAX : (uint32_t)len);
+	ring_leave(&spi_sl_ring);
+	return n;
+}
+
+/*
+ * Get the reception counters
+ * bytes = received from the FIFO, dropped = lost because the ring was full,
+ * overruns = FIFO overrun events (bytes lost in hardware)
+ */
+void spi_slave_stats(uint64_t * bytes, uint64_t * dropped, uint32_t * overruns)
+{
+	if(bytes){
+		*bytes = atomic_load(&spi_sl_bytes);
+	}
+	if(dropped){
+		*dropped = atomic_load(&spi_sl_dropped);
+	}
+	if(overruns){
+		*overruns = atomic_load(&spi_sl_overruns);
+	}
+}
+
+
+/*************************************
+
+	UART Functions
+
+**************************************/
+/*
+ * Register level PL011 UART0 driver, TXD on GPIO 14 and RXD on GPIO 15 (alt-func 0),
+ * optional CTS/RTS flow control on GPIO 16/17 (alt-func 3).
+ *
+ * An engine thread moves bytes between the 16 byte FIFOs and two lock-free rings.
+ * It polls the raw interrupt status: when the RX FIFO reaches the half full
+ * threshold that many bytes are read without checking the flags, when the TX FIFO
+ * drops to the threshold it is refilled with a batch of the same size. The RX
+ * timeout status (data left below the threshold) drains the rest one by one.
+ *
+ * The baud rate divisor is computed from the real UART clock read from the
+ * firmware (48 MHz on recent firmware, so up to 3 Mbaud). On the RPi 3 the
+ * PL011 is used by Bluetooth unless dtoverlay=disable-bt is set.
+ */
+#define UART_FIFO_SIZE	16
+#define UART_FIFO_THR	8	// IFLS 1/2
+
+#define UART_FR_TXFE	(1 << 7)
+#define UART_FR_TXFF	(1 << 5)
+#define UART_FR_RXFE	(1 << 4)
+#define UART_FR_BUSY	(1 << 3)
+
+#define UART_RIS_RX	(1 << 4)
+#define UART_RIS_TX	(1 << 5)
+#define UART_RIS_RT	(1 << 6)
+
+#define UART_DR_FE	(1 << 8)
+#define UART_DR_OE	(1 << 11)
+
+static struct ring uart_txr;
+static struct ring uart_rxr;
+static pthread_t uart_thread;
+static atomic_int uart_running = 0;
+static int uart_cpu = -1;
+static int uart_rtscts = 0;
+static uint32_t uart_drain_us = 100000;	/* time to send a full TX FIFO at the current baud rate */
+static _Atomic uint64_t uart_tx_bytes = 0;
+static _Atomic uint64_t uart_rx_bytes = 0;
+static _Atomic uint64_t uart_dropped = 0;
+static _Atomic uint32_t uart_overruns = 0;
+static _Atomic uint32_t uart_framing = 0;
+
+/* Wait until the UART is not busy, at most us (CTS may hold it forever), internal use only */
+static void uart_wait_idle(uint32_t us)
+{
+	uint64_t t0 = st_read();
+
+	while((*UART_FR & UART_FR_BUSY) && st_read() - t0 < us);
+}
+
+/* Push received bytes to the ring and count errors, internal use only */
+static void uart_rx_batch(const uint8_t *buf, uint32_t n, uint32_t flags)
+{
+	uint32_t w;
+
+	if(flags & UART_DR_OE){
+		*UART_RSR = 0;
+		atomic_fetch_add_explicit(&uart_overruns, 1, memory_order_relaxed);
+	}
+	if(flags & UART_DR_FE){
+		atomic_fetch_add_explicit(&uart_framing, 1, memory_order_relaxed);
+	}
+	atomic_fetch_add_explicit(&uart_rx_bytes, n, memory_order_relaxed);
+	w = ring_write(&uart_rxr, buf, n);
+	if(w < n){
+		atomic_fetch_add_explicit(&uart_dropped, n - w, memory_order_relaxed);
+	}
+}
+
+/* UART engine thread */
+static void *uart_engine(void *arg)
+{
+	uint8_t buf[UART_FIFO_SIZE];
+	uint32_t ris, dr, flags, n, i, idle = 0;
+
+	(void)arg;
+
+	if(uart_cpu >= 0){
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(uart_cpu, &set);
+		if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0){
+			puts("uart_start() warning: cannot pin the engine thread.");
+		}
+	}
+
+	while(atomic_load_explicit(&uart_running, memory_order_relaxed)){
+
+		__sync_synchronize();
+		ris = *UART_RIS;
+		idle++;
+
+		/* RX at or above the threshold, read a batch without checking the flags */
+		if(ris & UART_RIS_RX){
+			for(i = 0, flags = 0; i < UART_FIFO_THR; i++){
+				dr = *UART_DR;
+				buf[i] = dr & 0xFF;
+				flags |= dr;
+			}
+			uart_rx_batch(buf, UART_FIFO_THR, flags);
+			idle = 0;
+		}
+		/* RX timeout, fewer bytes than the threshold are waiting */
+		else if(ris & UART_RIS_RT){
+			*UART_ICR = UART_RIS_RT;
+			for(n = 0, flags = 0; n < UART_FIFO_SIZE && !(*UART_FR & UART_FR_RXFE); n++){
+				dr = *UART_DR;
+				buf[n] = dr & 0xFF;
+				flags |= dr;
+			}
+			uart_rx_batch(buf, n, flags);
+			idle = 0;
+		}
+
+		/* TX empty or at the threshold, refill with one batch */
+		if((ris & UART_RIS_TX) || (*UART_FR & UART_FR_TXFE)){
+			n = (*UART_FR & UART_FR_TXFE) ? UART_FIFO_SIZE : UART_FIFO_SIZE - UART_FIFO_THR;
+			n = ring_read(&uart_txr, buf, n);
+			if(n > 0){
+				*UART_ICR = UART_RIS_TX;
+				for(i = 0; i < n; i++){
+					*UART_DR = buf[i];
+				}
+				atomic_fetch_add_explicit(&uart_tx_bytes, n, memory_order_relaxed);
+				idle = 0;
+			}
+		}
+
+		/* back off on an idle link, unless pinned to a CPU for the lowest latency */
+		if(uart_cpu < 0 && idle > 100000){
+			uswait(20);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Start the UART
+ * baud = baud rate, up to UART clock/16
+ * flags = UART_RTSCTS for hardware flow control, UART_2STOP for 2 stop bits,
+ *	   UART_PARITY_EVEN / UART_PARITY_ODD, 8 data bits always
+ * ring_size = bytes buffered in each direction (0 = 64 kB)
+ * cpu = CPU to pin the engine thread to (no idle back-off), -1 for no pinning
+ * Returns the achieved baud rate, 0 on failure
+ */
+uint32_t uart_start(uint32_t baud, uint32_t flags, uint32_t ring_size, int cpu)
+{
+	uint32_t clk, div64, lcrh;
+
+	if(base_pointer[9] == NULL){
+		printf("%s() error: ", __func__);
+		puts("Invalid UART registers addresses.");
+		return 0;
+	}
+	if(atomic_load(&uart_running)){
+		printf("%s() error: ", __func__);
+		puts("The UART is already running.");
+		return 0;
+	}
+
+	clk = mbox_clock_rate(MBOX_CLK_UART);
+	if(clk == 0){
+		clk = 48000000;
+		printf("%s() warning: ", __func__);
+		puts("Cannot read the UART clock from the firmware, assuming 48 MHz.");
+	}
+
+	/* divisor = clk/(16*baud) with a 6 bit fraction */
+	if(baud == 0 || baud > clk / 16){
+		printf("%s() error: ", __func__);
+		puts("Baud rate out of range.");
+		return 0;
+	}
+	div64 = (uint32_t)(((uint64_t)clk * 4 + baud / 2) / baud);
+	if((div64 >> 6) > 0xFFFF){
+		div64 = 0xFFFF << 6;
+	}
+
+	if(!ring_init(&uart_txr, ring_size ? ring_size : 64 * 1024, 1)){
+		perror("uart_start() error");
+		return 0;
+	}
+	if(!ring_init(&uart_rxr, ring_size ? ring_size : 64 * 1024, 1)){
+		ring_free(&uart_txr);
+		perror("uart_start() error");
+		return 0;
+	}
+
+	/* disable, wait for the end of the current character, flush the FIFOs */
+	*UART_CR = 0;
+	uart_wait_idle(uart_drain_us);
+	*UART_LCRH = 0;
+
+	set_gpio(14, 4);	// alt 100b, PHY 8, GPIO 14, alt 0	TXD
+	set_gpio(15, 4);	// alt 100b, PHY 10, GPIO 15, alt 0	RXD
+	if(flags & UART_RTSCTS){
+		set_gpio(16, 7);	// alt 111b, PHY 36, GPIO 16, alt 3	CTS
+		set_gpio(17, 7);	// alt 111b, PHY 11, GPIO 17, alt 3	RTS
+	}
+
+	*UART_IBRD = div64 >> 6;
+	*UART_FBRD = div64 & 0x3F;
+
+	lcrh = (3 << 5) | (1 << 4);	// WLEN 8 bits, FEN
+	if(flags & UART_2STOP){
+		lcrh |= 1 << 3;
+	}
+	if(flags & (UART_PARITY_EVEN | UART_PARITY_ODD)){
+		lcrh |= 1 << 1;
+		if(flags & UART_PARITY_EVEN){
+			lcrh |= 1 << 2;
+		}
+	}
+	*UART_LCRH = lcrh;
+	*UART_IFLS = (2 << 3) | 2;	// RX and TX thresholds 1/2
+	*UART_IMSC = 0;			// polled, raw status only
+	*UART_ICR = 0x7FF;
+	*UART_RSR = 0;
+	*UART_CR = (1 << 0) | (1 << 8) | (1 << 9)	// UARTEN, TXE, RXE
+		 | ((flags & UART_RTSCTS) ? (1 << 14) | (1 << 15) : 0);
+
+	atomic_store(&uart_tx_bytes, 0);
+	atomic_store(&uart_rx_bytes, 0);
+	atomic_store(&uart_dropped, 0);
+	atomic_store(&uart_overruns, 0);
+	atomic_store(&uart_framing, 0);
+	uart_cpu = cpu;
+	uart_rtscts = (flags & UART_RTSCTS) != 0;
+	/* 12 bit times per character at most (start, 8 data, parity, 2 stop), plus 1 ms */
+	uart_drain_us = (uint32_t)((uint64_t)(UART_FIFO_SIZE + 1) * 12 * 1000000 / baud) + 1000;
+
+	atomic_store(&uart_running, 1);
+	if(pthread_create(&uart_thread, NULL, uart_engine, NULL) != 0){
+		perror("pthread_create() error");
+		atomic_store(&uart_running, 0);
+		*UART_CR = 0;
+		ring_free(&uart_txr);
+		ring_free(&uart_rxr);
+		return 0;
+	}
+	return (uint32_t)(((uint64_t)clk * 4 + div64 / 2) / div64);
+}
+
+/*
+ * Stop the UART, bytes still in the rings are discarded
+ * May be called while another thread is in uart_read() or uart_write(), which then return 0
+ */
+void uart_stop(void)
+{
+	int pin;
+
+	if(!atomic_load(&uart_running)){
+		return;
+	}
+	atomic_store(&uart_running, 0);
+	pthread_join(uart_thread, NULL);
+
+	/* let the transmit FIFO drain, unless the peer holds CTS off */
+	uart_wait_idle(uart_drain_us);
+	*UART_CR = 0;
+	*UART_LCRH = 0;
+	ring_retire(&uart_txr);
+	ring_retire(&uart_rxr);
+
+	for(pin = 14; pin <= (uart_rtscts ? 17 : 15); pin++){
+		set_gpio(pin, 0);
+	}
+	__sync_synchronize();
+}
+
+/* Queue bytes for transmission, returns the no. of bytes queued */
+size_t uart_write(const uint8_t * buf, size_t len)
+{
+	size_t n;
+
+	if(!ring_enter(&uart_txr, &uart_running)){
+		return 0;
+	}
+	n = ring_write(&uart_txr, buf, len > UINT32_MAX ? UINT32_MAX : (uint32_t)len);
+	ring_leave(&uart_txr);
+	return n;
+}
+
+/* Read up to len received bytes, returns the no. of bytes read */
+size_t uart_read(uint8_t * buf, size_t len)
+{
+	size_t n;
+
+	if(!ring_enter(&uart_rxr, &uart_running)){
+		return 0;
+	}
+	n = ring_read(&uart_rxr, buf, len > UINT32_MAX ? UINT32_MAX : (uint32_t)len);
+	ring_leave(&uart_rxr);
+	return n;
+}
+
+/*
+ * Get the UART counters
+ * dropped = received bytes lost because the RX ring was full,
+ * overruns = RX FIFO overrun events (bytes lost in hardware),
+ * framing = batches with at least one framing error
+ */
+void uart_stats(uint64_t * tx_bytes, uint64_t * rx_bytes, uint64_t * dropped, uint32_t * overruns, uint32_t * framing)
+{
+	if(tx_bytes){
+		*tx_bytes = atomic_load(&uart_tx_bytes);
+	}
+	if(rx_bytes){
+		*rx_bytes = atomic_load(&uart_rx_bytes);
+	}
+	if(dropped){
+		*dropped = atomic_load(&uart_dropped);
+	}
+	if(overruns){
+		*overruns = atomic_load(&uart_overruns);
+	}
+	if(framing){
+		*framing = atomic_load(&uart_framing);
+	}
+}
+
+
+/*************************************
+
+	PCM/I2S Functions
+
+**************************************/
+/*
+ * PCM/I2S audio on GPIO 18 (PCM_CLK), 19 (PCM_FS), 20 (PCM_DIN) and 21 (PCM_DOUT), alt-func 0.
+ *
+ * As master, the bit clock comes from the PCM clock manager fed by PLLD (500 MHz)
+ * with a MASH 1 fractional divider, the frame sync is generated by the PCM block.
+ * Samples are exchanged as 32-bit words, one per channel, right aligned, through
+ * two lock-free rings. An engine thread tops up the 64 word TX FIFO in batches when
+ * it drops below 1/4 full and drains the RX FIFO in batches once it is 1/4 full.
+ *
+ * When the TX ring runs dry the engine pads the FIFO with silence and counts a
+ * ring underrun (the application was too slow), while the FIFO error flags count
+ * the samples lost in hardware (the engine was too slow). Both are meant to size
+ * the ring and the write chunk for glitch-free audio.
+ *
+ * The pins are shared with the BSC/SPI slave, only one of them can run.
+ */
+#define CM_PLLD_FREQ	500000000
+
+#define PCM_FIFO_SIZE	64
+#define PCM_TX_BATCH	32
+#define PCM_RX_BATCH	16
+
+#define PCM_CS_EN	(1 << 0)
+#define PCM_CS_RXON	(1 << 1)
+#define PCM_CS_TXON	(1 << 2)
+#define PCM_CS_TXCLR	(1 << 3)
+#define PCM_CS_RXCLR	(1 << 4)
+#define PCM_CS_TXERR	(1 << 15)
+#define PCM_CS_RXERR	(1 << 16)
+#define PCM_CS_TXW	(1 << 17)
+#define PCM_CS_RXR	(1 << 18)
+#define PCM_CS_SYNC	(1 << 24)
+#define PCM_CS_STBY	(1 << 25)
+
+static struct ring pcm_txr;
+static struct ring pcm_rxr;
+static pthread_t pcm_thread;
+static atomic_int pcm_running = 0;
+static atomic_int pcm_tx_active = 0;
+static atomic_int pcm_draining = 0;
+static struct pcm_config pcm_cfg;
+static _Atomic uint64_t pcm_tx_samples = 0;
+static _Atomic uint64_t pcm_rx_samples = 0;
+static _Atomic uint64_t pcm_rx_dropped = 0;
+static _Atomic uint32_t pcm_ring_underruns = 0;
+static _Atomic uint32_t pcm_fifo_underruns = 0;
+static _Atomic uint32_t pcm_fifo_overruns = 0;
+
+/* PCM engine thread */
+static void *pcm_engine(void *arg)
+{
+	int32_t buf[PCM_TX_BATCH];
+	uint32_t cs, n, i;
+	int busy;
+
+	(void)arg;
+
+	if(pcm_cfg.cpu >= 0){
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(pcm_cfg.cpu, &set);
+		if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0){
+			puts("pcm_start() warning: cannot pin the engine thread.");
+		}
+	}
+
+	while(atomic_load_explicit(&pcm_running, memory_order_relaxed)){
+
+		__sync_synchronize();
+		cs = *PCM_CS_A;
+		busy = 0;
+
+		/* TX FIFO below 1/4 full, write a batch without checking the flags */
+		if((pcm_cfg.flags & PCM_TX) && (cs & PCM_CS_TXW)){
+			n = ring_read(&pcm_txr, buf, PCM_TX_BATCH);
+			if(n < PCM_TX_BATCH){
+				if(atomic_load_explicit(&pcm_draining, memory_order_acquire)){
+					if(n == 0){
+						atomic_store(&pcm_tx_active, 0);
+					}
+				}
+				else if(atomic_load_explicit(&pcm_tx_active, memory_order_relaxed)){
+					atomic_fetch_add_explicit(&pcm_ring_underruns, 1, memory_order_relaxed);
+				}
+				memset(buf + n, 0, (PCM_TX_BATCH - n) * sizeof(buf[0]));
+			}
+			for(i = 0; i < PCM_TX_BATCH; i++){
+				*PCM_FIFO_A = (uint32_t)buf[i];
+			}
+			atomic_fetch_add_explicit(&pcm_tx_samples, n, memory_order_relaxed);
+			busy = 1;
+		}
+
+		/* RX FIFO at least 1/4 full, read a batch */
+		if((pcm_cfg.flags & PCM_RX) && (cs & PCM_CS_RXR)){
+			for(i = 0; i < PCM_RX_BATCH; i++){
+				buf[i] = (int32_t)*PCM_FIFO_A;
+			}
+			n = ring_write(&pcm_rxr, buf, PCM_RX_BATCH);
+			atomic_fetch_add_explicit(&pcm_rx_samples, PCM_RX_BATCH, memory_order_relaxed);
+			if(n < PCM_RX_BATCH){
+				atomic_fetch_add_explicit(&pcm_rx_dropped, PCM_RX_BATCH - n, memory_order_relaxed);
+			}
+			busy = 1;
+		}
+
+		/* FIFO errors, write 1 to clear */
+		if(cs & (PCM_CS_TXERR | PCM_CS_RXERR)){
+			if(cs & PCM_CS_TXERR){
+				atomic_fetch_add_explicit(&pcm_fifo_underruns, 1, memory_order_relaxed);
+			}
+			if(cs & PCM_CS_RXERR){
+				atomic_fetch_add_explicit(&pcm_fifo_overruns, 1, memory_order_relaxed);
+			}
+			*PCM_CS_A = cs & ~(PCM_CS_TXCLR | PCM_CS_RXCLR);
+		}
+
+		/* a FIFO batch lasts hundreds of us at audio rates */
+		if(!busy && pcm_cfg.cpu < 0){
+			uswait(20);
+		}
+	}
+	return NULL;
+}
+
+/* Channel width and position fields of the TXC/RXC registers, internal use only */
+static uint32_t pcm_channel_config(const struct pcm_config *cfg, uint32_t slot)
+{
+	uint32_t wex = cfg->bits > 23;
+	uint32_t wid = cfg->bits - (wex ? 24 : 8);
+	uint32_t pos = cfg->format == PCM_FMT_LEFT_J ? 0 : 1;
+	uint32_t reg;
+
+	reg = (wex << 31) | (1 << 30) | (pos << 20) | (wid << 16);		// CH1
+	if(cfg->channels == 2){
+		reg |= (wex << 15) | (1 << 14) | ((pos + slot) << 4) | wid;	// CH2
+	}
+	return reg;
+}
+
+/*
+ * Start PCM/I2S streaming
+ * cfg->rate = frames per second, cfg->channels = 1 or 2, cfg->bits = sample width 8 to 32
+ * cfg->slot_bits = bits per channel slot (0 = same as bits)
+ * cfg->format = PCM_FMT_I2S, PCM_FMT_LEFT_J or PCM_FMT_DSP
+ * cfg->flags = PCM_TX and/or PCM_RX, PCM_SLAVE to take the clocks from the codec
+ * cfg->ring_size = samples buffered in each direction (0 = 65536)
+ * cfg->cpu = CPU to pin the engine thread to, -1 for no pinning
+ * Returns 1 on success
+ */
+int pcm_start(const struct pcm_config * cfg)
+{
+	uint32_t slot, frame, bclk, div, mode, i;
+	uint64_t divq;
+
+	if(base_pointer[10] == NULL){
+		printf("%s() error: ", __func__);
+		puts("Invalid PCM registers addresses.");
+		return 0;
+	}
+	if(atomic_load(&pcm_running) || atomic_load(&sl_running) || slave_spi_busy()){
+		printf("%s() error: ", __func__);
+		puts("The PCM or BSC/SPI slave peripheral is already in use.");
+		return 0;
+	}
+
+	slot = cfg->slot_bits ? cfg->slot_bits : cfg->bits;
+	frame = cfg->format == PCM_FMT_DSP ? slot * cfg->channels : slot * 2;
+	if(cfg->channels < 1 || cfg->channels > 2 || cfg->bits < 8 || cfg->bits > 32 || slot < cfg->bits || slot > 32
+	   || cfg->rate == 0 || !(cfg->flags & (PCM_TX | PCM_RX))){
+		printf("%s() error: ", __func__);
+		puts("Invalid channel, sample width, rate or direction parameter.");
+		return 0;
+	}
+	bclk = cfg->rate * frame;
+	divq = ((uint64_t)CM_PLLD_FREQ * 4096 + bclk / 2) / bclk;
+	if(!(cfg->flags & PCM_SLAVE) && (divq >> 12) < 2){
+		printf("%s() error: ", __func__);
+		puts("Bit clock too fast.");
+		return 0;
+	}
+	/* DIVI is 12 bits, a larger divider would spill into the CM password field */
+	if(!(cfg->flags & PCM_SLAVE) && (divq >> 12) > 4095){
+		printf("%s() error: ", __func__);
+		puts("Bit clock too slow.");
+		return 0;
+	}
+	div = (uint32_t)divq;
+
+	if(!ring_init(&pcm_txr, cfg->ring_size ? cfg->ring_size : 65536, sizeof(int32_t))){
+		perror("pcm_start() error");
+		return 0;
+	}
+	if(!ring_init(&pcm_rxr, cfg->ring_size ? cfg->ring_size : 65536, sizeof(int32_t))){
+		ring_free(&pcm_txr);
+		perror("pcm_start() error");
+		return 0;
+	}
+	pcm_cfg = *cfg;
+
+	set_gpio(18, 4);	// alt 100b, PHY 12, GPIO 18, alt 0	PCM_CLK
+	set_gpio(19, 4);	// alt 100b, PHY 35, GPIO 19, alt 0	PCM_FS
+	set_gpio(20, 4);	// alt 100b, PHY 38, GPIO 20, alt 0	PCM_DIN
+	set_gpio(21, 4);	// alt 100b, PHY 40, GPIO 21, alt 0	PCM_DOUT
+
+	/* PCM clock: stop, set the fractional divisor, restart from PLLD with MASH 1 */
+	*CM_PCMCTL = 0x5A000006;
+	for(i = 0; i < 1000 && isBitSet(CM_PCMCTL, 7); i++){
+		uswait(10);
+	}
+	if(isBitSet(CM_PCMCTL, 7)){
+		*CM_PCMCTL = 0x5A000020;	// KILL the clock
+		uswait(100);
+	}
+	if(!(cfg->flags & PCM_SLAVE)){
+		*CM_PCMDIV = 0x5A000000 | div;
+		*CM_PCMCTL = 0x5A000206;		// MASH 1, PLLD
+		*CM_PCMCTL = 0x5A000216;		// ENAB
+	}
+
+	/* frame format */
+	mode = (frame - 1) << 10;				// FLEN
+	if(cfg->format == PCM_FMT_DSP){
+		mode |= 1;					// FSLEN, one clock pulse
+	}
+	else{
+		mode |= slot;					// FSLEN, half a frame
+	}
+	if(cfg->format == PCM_FMT_I2S){
+		mode |= 1 << 20;				// FSI, left channel while the frame sync is low
+	}
+	mode |= 1 << 22;					// CLKI, data out on the falling edge
+	if(cfg->flags & PCM_SLAVE){
+		mode |= (1 << 21) | (1 << 23);			// FSM, CLKM
+	}
+
+	*PCM_CS_A = PCM_CS_EN;
+	*PCM_MODE_A = mode;
+	*PCM_TXC_A = pcm_channel_config(cfg, slot);
+	*PCM_RXC_A = pcm_channel_config(cfg, slot);
+	*PCM_INTEN_A = 0;
+
+	/* TX threshold below 1/4 full, RX threshold at least 1/4 full, clear the FIFOs */
+	*PCM_CS_A = PCM_CS_EN | PCM_CS_STBY | (1 << 5) | (1 << 7) | PCM_CS_TXCLR | PCM_CS_RXCLR
+		  | PCM_CS_TXERR | PCM_CS_RXERR;
+
+	/* the FIFO clear takes 2 PCM clocks, SYNC echoes back after that time */
+	*PCM_CS_A = *PCM_CS_A | PCM_CS_SYNC;
+	for(i = 0; i < 1000 && !isBitSet(PCM_CS_A, 24); i++){
+		uswait(10);
+	}
+
+	/* start with a FIFO of silence */
+	for(i = 0; (cfg->flags & PCM_TX) && i < PCM_FIFO_SIZE; i++){
+		*PCM_FIFO_A = 0;
+	}
+
+	atomic_store(&pcm_tx_samples, 0);
+	atomic_store(&pcm_rx_samples, 0);
+	atomic_store(&pcm_rx_dropped, 0);
+	atomic_store(&pcm_ring_underruns, 0);
+	atomic_store(&pcm_fifo_underruns, 0);
+	atomic_store(&pcm_fifo_overruns, 0);
+	atomic_store(&pcm_tx_active, 0);
+	atomic_store(&pcm_draining, 0);
+
+	*PCM_CS_A = (*PCM_CS_A & ~PCM_CS_SYNC) | ((cfg->flags & PCM_TX) ? PCM_CS_TXON : 0) | ((cfg->flags & PCM_RX) ? PCM_CS_RXON : 0);
+
+	atomic_store(&pcm_running, 1);
+	if(pthread_create(&pcm_thread, NULL, pcm_engine, NULL) != 0){
+		perror("pthread_create() error");
+		atomic_store(&pcm_running, 0);
+		pcm_stop();
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Stop PCM/I2S streaming, samples still in the rings are discarded
+ * May be called while another thread is in pcm_read() or pcm_write(), which then return 0
+ */
+void pcm_stop(void)
+{
+	int pin;
+
+	if(atomic_exchange(&pcm_running, 0)){
+		pthread_join(pcm_thread, NULL);
+	}
+	if(pcm_txr.buf == NULL){
+		return;
+	}
+
+	*PCM_CS_A = 0;
+	*CM_PCMCTL = 0x5A000006;
+	ring_retire(&pcm_txr);
+	ring_retire(&pcm_rxr);
+
+	for(pin = 18; pin <= 21; pin++){
+		set_gpio(pin, 0);
+	}
+	__sync_synchronize();
+}
+
+/* Queue interleaved samples for playback, returns the no. of samples queued */
+size_t pcm_write(const int32_t * samples, size_t n)
+{
+	size_t w;
+
+	if(!ring_enter(&pcm_txr, &pcm_running)){
+		return 0;
+	}
+	atomic_store(&pcm_draining, 0);
+	atomic_store(&pcm_tx_active, 1);
+	w = ring_write(&pcm_txr, samples, n > UINT32_MAX ? UINT32_MAX : (uint32_t)n);
+	ring_leave(&pcm_txr);
+	return w;
+}
+
+/* Read up to n captured interleaved samples, returns the no. of samples read */
+size_t pcm_read(int32_t * samples, size_t n)
+{
+	size_t r;
+
+	if(!ring_enter(&pcm_rxr, &pcm_running)){
+		return 0;
+	}
+	r = ring_read(&pcm_rxr, samples, n > UINT32_MAX ? UINT32_MAX : (uint32_t)n);
+	ring_leave(&pcm_rxr);
+	return r;
+}
+
+/* Wait until all queued samples are played, the ring running dry now is not an underrun */
+void pcm_drain(void)
+{
+	if(!atomic_load(&pcm_running)){
+		return;
+	}
+	atomic_store(&pcm_draining, 1);
+	while(atomic_load(&pcm_tx_active) && atomic_load(&pcm_running)){
+		mswait(1);
+	}
+	/* the FIFO still holds up to 64 samples */
+	mswait((uint32_t)((uint64_t)PCM_FIFO_SIZE * 1000 / ((uint64_t)pcm_cfg.rate * pcm_cfg.channels)) + 1);
+}
+
+/*
+ * Play a PCM WAV file (8/16/24/32-bit, mono or stereo) mapped into memory.
+ * Uses the running PCM configuration, which must have PCM_TX and the file's rate and channels,
+ * or starts I2S at the file's format and stops after.
+ * Returns the no. of frames played, -1 on failure
+ */
+long pcm_play_wav(const char * path)
+{
+	const uint8_t *p, *end, *data = NULL;
+	uint32_t len, rate = 0, dlen = 0, i, n;
+	uint16_t fmt = 0, channels = 0, bits = 0;
+	int32_t buf[1024];
+	struct stat st;
+	size_t done = 0, bps, total;
+	void *map;
+	int fd, started = 0;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0 || fstat(fd, &st) < 0 || st.st_size < 44){
+		perror("pcm_play_wav() error");
+		if(fd >= 0){
+			close(fd);
+		}
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED){
+		perror("pcm_play_wav() error");
+		return -1;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	/* RIFF chunks: "fmt " and "data" */
+	p = map;
+	end = p + st.st_size;
+	if(memcmp(p, "RIFF", 4) == 0 && memcmp(p + 8, "WAVE", 4) == 0){
+		for(p += 12; p + 8 <= end; p += 8 + len + (len & 1)){
+			len = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+			if(len > (size_t)(end - p - 8)){
+				len = (uint32_t)(end - p - 8);
+			}
+			if(memcmp(p, "fmt ", 4) == 0 && len >= 16){
+				fmt = p[8] | p[9] << 8;
+				channels = p[10] | p[11] << 8;
+				rate = p[12] | p[13] << 8 | p[14] << 16 | (uint32_t)p[15] << 24;
+				bits = p[22] | p[23] << 8;
+			}
+			else if(memcmp(p, "data", 4) == 0){
+				data = p + 8;
+				dlen = len;
+				break;
+			}
+		}
+	}
+	if(data == NULL || (fmt != 1 && fmt != 0xFFFE) || channels < 1 || channels > 2 || bits < 8 || bits > 32 || bits % 8){
+		printf("%s() error: ", __func__);
+		puts("Not a mono or stereo PCM WAV file.");
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	if(!atomic_load(&pcm_running)){
+		struct pcm_config cfg = { rate, (uint8_t)channels, (uint8_t)bits, (uint8_t)(bits == 24 ? 32 : bits),
+					  PCM_FMT_I2S, PCM_TX, 0, -1 };
+		if(!pcm_start(&cfg)){
+			munmap(map, st.st_size);
+			return -1;
+		}
+		started = 1;
+	}
+	else if(pcm_cfg.rate != rate || pcm_cfg.channels != channels || !(pcm_cfg.flags & PCM_TX)){
+		/* without PCM_TX nothing drains the ring, a wrong rate plays at the wrong speed */
+		printf("%s() error: ", __func__);
+		puts("The file format does not match the running PCM configuration.");
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	/* convert to right aligned 32-bit words, shifted to the configured sample width */
+	bps = bits / 8;
+	total = dlen / bps;
+	while(done < total){
+		n = total - done > 1024 ? 1024 : (uint32_t)(total - done);
+		for(i = 0; i < n; i++){
+			const uint8_t *s = data + (done + i) * bps;
+			int32_t v;
+			switch(bps){
+			case 1:	v = (int32_t)s[0] - 128; break;
+			case 2:	v = (int16_t)(s[0] | s[1] << 8); break;
+			case 3:	v = (int32_t)((uint32_t)s[0] << 8 | (uint32_t)s[1] << 16 | (uint32_t)s[2] << 24) >> 8; break;
+			default: v = (int32_t)(s[0] | s[1] << 8 | s[2] << 16 | (uint32_t)s[3] << 24); break;
+			}
+			buf[i] = pcm_cfg.bits >= bits ? (int32_t)((uint32_t)v << (pcm_cfg.bits - bits)) : v >> (bits - pcm_cfg.bits);
+		}
+		for(i = 0; i < n && atomic_load(&pcm_running); ){
+			i += (uint32_t)pcm_write(buf + i, n - i);
+			if(i < n){
+				mswait(1);
+			}
+		}
+		if(i < n){
+			printf("%s() error: ", __func__);
+			puts("PCM was stopped during playback.");
+			munmap(map, st.st_size);
+			return -1;
+		}
+		done += n;
+	}
+
+	pcm_drain();
+	if(started){
+		pcm_stop();
+	}
+	munmap(map, st.st_size);
+	return (long)(total / channels);
+}
+
+/*
+ * Get the PCM counters
+ * ring_underruns = times the TX ring ran dry while playing (padded with silence),
+ * fifo_underruns/fifo_overruns = TX/RX FIFO errors (samples lost in hardware),
+ * rx_dropped = captured samples lost because the RX ring was full
+ */
+void pcm_stats(uint64_t * tx_samples, uint64_t * rx_samples, uint64_t * rx_dropped,
+	       uint32_t * ring_underruns, uint32_t * fifo_underruns, uint32_t * fifo_overruns)
+{
+	if(tx_samples){
+		*tx_samples = atomic_load(&pcm_tx_samples);
+	}
+	if(rx_samples){
+		*rx_samples = atomic_load(&pcm_rx_samples);
+	}
+	if(rx_dropped){
+		*rx_dropped = atomic_load(&pcm_rx_dropped);
+	}
+	if(ring_underruns){
+		*ring_underruns = atomic_load(&pcm_ring_underruns);
+	}
+	if(fifo_underruns){
+		*fifo_underruns = atomic_load(&pcm_fifo_underruns);
+	}
+	if(fifo_overruns){
+		*fifo_overruns = atomic_load(&pcm_fifo_overruns);
+	}
+}
+
+
+/*************************************
+
+	DMA Functions
+
+**************************************/
+/*
+ * DMA control blocks and buffers live in uncached VideoCore memory, allocated
+ * and locked through the mailbox and mapped with /dev/mem. The DMA engine sees
+ * bus addresses: peripherals at 0x7E000000, memory at the locked handle address.
+ *
+ * Timed chains are paced by the PWM FIFO DREQ (PERMAP 5): a control block that
+ * writes n words to the PWM FIFO takes n pacer periods. The pacer takes over the
+ * PWM clock (PLLD/5 = 100 MHz) and PWM channel 1, its pin is left untouched.
+ *
+ * With dma_sim_enable(1) (or without /dev/mem access) nothing touches the
+ * hardware: buffers come from the heap and a simulator walks the control block
+ * chains on dma_sim_run(), with a model of GPIO, the system timer, the PWM pacer
+ * and the SPI0 FIFO in loopback, so the chains can be checked off-target.
+ */
+#define BUS_BASE	0x7E000000
+#define BUS_ST_CLO	(BUS_BASE + 0x003004)
+#define BUS_GPSET0	(BUS_BASE + 0x20001C)
+#define BUS_GPCLR0	(BUS_BASE + 0x200028)
+#define BUS_GPLEV0	(BUS_BASE + 0x200034)
+#define BUS_SPI_FIFO	(BUS_BASE + 0x204004)
+#define BUS_PWM_FIF1	(BUS_BASE + 0x20C018)
+
+#define DMA_CS_ACTIVE	(1 << 0)
+#define DMA_CS_END	(1 << 1)
+#define DMA_CS_INT	(1 << 2)
+#define DMA_CS_ERROR	(1 << 8)
+#define DMA_CS_RESET	(1UL << 31)
+
+#define DMA_TI_WAIT_RESP	(1 << 3)
+#define DMA_TI_DEST_INC		(1 << 4)
+#define DMA_TI_DEST_DREQ	(1 << 6)
+#define DMA_TI_SRC_INC		(1 << 8)
+#define DMA_TI_SRC_DREQ		(1 << 10)
+#define DMA_TI_PERMAP(p)	((uint32_t)(p) << 16)
+#define DMA_TI_NO_WIDE_BURSTS	(1 << 26)
+
+#define DMA_PERMAP_PWM		5
+#define DMA_PERMAP_SPI_TX	6
+#define DMA_PERMAP_SPI_RX	7
+
+/* lite channels (7 to 14) take at most 65535 bytes per control block */
+#define DMA_MAX_LEN	65532
+
+struct dma_cb {
+	uint32_t ti;
+	uint32_t source_ad;
+	uint32_t dest_ad;
+	uint32_t txfr_len;
+	uint32_t stride;
+	uint32_t nextconbk;
+	uint32_t pad[2];	/* unused by the DMA engine, holds constant source words */
+};
+
+struct dma_mem {
+	uint32_t handle;
+	uint32_t bus;
+	uint32_t size;
+	void *virt;
+};
+
+static int dma_sim = 0;
+
+/* Simulator state */
+#define DMA_SIM_REGIONS	32
+
+static struct dma_mem *sim_region[DMA_SIM_REGIONS];
+static uint32_t sim_next_bus = 0xC0001000;
+static uint64_t sim_time_ns = 0;
+static uint32_t sim_gpio = 0;
+static uint32_t (*sim_input)(uint64_t ns) = NULL;
+static void (*sim_gpio_hook)(uint64_t ns, uint32_t levels) = NULL;
+static struct {
+	uint32_t cb;
+	int active;
+} sim_ch[15];
+
+/* Pacer state, sim_fifo_ns = simulated time the queued PWM FIFO words run out */
+#define PWM_FIFO_DEPTH	16
+
+static uint32_t pacer_period_ns = 0;
+static int pacer_users = 0;
+static uint64_t sim_fifo_ns = 0;
+
+/* Use the DMA simulator instead of the hardware, on = 1 */
+void dma_sim_enable(int on)
+{
+	dma_sim = on;
+}
+
+/* In simulation, either on request or because the DMA registers are not mapped, internal use only */
+static int dma_simulated(void)
+{
+	return dma_sim || base_pointer[11] == NULL;
+}
+
+/* Mailbox VideoCore memory calls, returns the first response word, internal use only */
+static uint32_t mbox_mem(uint32_t tag, uint32_t a, uint32_t b, uint32_t c, uint32_t nargs)
+{
+	uint32_t msg[9] __attribute__((aligned(16)));
+
+	msg[0] = sizeof(msg);
+	msg[1] = 0;
+	msg[2] = tag;
+	msg[3] = nargs * 4;
+	msg[4] = nargs * 4;
+	msg[5] = a;
+	msg[6] = b;
+	msg[7] = c;
+	msg[8] = 0;
+
+	if(mbox_property(msg) < 0){
+		return 0;
+	}
+	return msg[5];
+}
+
+/* Allocate uncached memory the DMA engine can access, returns 1 on success, internal use only */
+static int dma_mem_alloc(struct dma_mem *m, uint32_t size)
+{
+	int fd, i;
+
+	memset(m, 0, sizeof(*m));
+	m->size = (size + 4095) & ~4095U;
+
+	if(dma_simulated()){
+		for(i = 0; i < DMA_SIM_REGIONS && sim_region[i]; i++);
+		if(i == DMA_SIM_REGIONS || posix_memalign(&m->virt, 4096, m->size) != 0){
+			return 0;
+		}
+		memset(m->virt, 0, m->size);
+		m->bus = sim_next_bus;
+		sim_next_bus += m->size + 4096;
+		sim_region[i] = m;
+		return 1;
+	}
+
+	/* direct uncached alias on BCM2835, L1 non-allocating coherent alias on the others */
+	m->handle = mbox_mem(0x3000C, m->size, 4096, peri_base == 0x20000000 ? 0xC : 0x4, 3);
+	if(m->handle == 0){
+		return 0;
+	}
+	m->bus = mbox_mem(0x3000D, m->handle, 0, 0, 1);
+	if(m->bus == 0){
+		mbox_mem(0x3000F, m->handle, 0, 0, 1);
+		return 0;
+	}
+
+	fd = open("/dev/mem", O_RDWR | O_SYNC);
+	if(fd >= 0){
+		m->virt = mmap(NULL, m->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, m->bus & ~0xC0000000);
+		close(fd);
+	}
+	if(fd < 0 || m->virt == MAP_FAILED){
+		m->virt = NULL;
+		mbox_mem(0x3000E, m->handle, 0, 0, 1);
+		mbox_mem(0x3000F, m->handle, 0, 0, 1);
+		return 0;
+	}
+	memset(m->virt, 0, m->size);
+	return 1;
+}
+
+/* Release memory from dma_mem_alloc(), internal use only */
+static void dma_mem_free(struct dma_mem *m)
+{
+	int i;
+
+	if(m->virt == NULL){
+		return;
+	}
+	if(m->handle == 0){
+		for(i = 0; i < DMA_SIM_REGIONS; i++){
+			if(sim_region[i] == m){
+				sim_region[i] = NULL;
+			}
+		}
+		free(m->virt);
+	}
+	else{
+		munmap(m->virt, m->size);
+		mbox_mem(0x3000E, m->handle, 0, 0, 1);
+		mbox_mem(0x3000F, m->handle, 0, 0, 1);
+	}
+	memset(m, 0, sizeof(*m));
+}
+
+/* Bus address of a pointer into a dma_mem block, internal use only */
+static inline uint32_t dma_bus(const struct dma_mem *m, const void *p)
+{
+	return m->bus + (uint32_t)((const uint8_t *)p - (const uint8_t *)m->virt);
+}
+
+/* DMA channel registers, internal use only */
+static inline volatile uint32_t *dma_regs(uint8_t ch)
+{
+	return base_pointer[11] + ch * 0x100 / 4;
+}
+
+/* Reset a channel and start it on a control block chain, internal use only */
+static void dma_chan_start(uint8_t ch, uint32_t cb_bus)
+{
+	volatile uint32_t *r;
+
+	if(dma_simulated()){
+		sim_ch[ch].cb = cb_bus;
+		sim_ch[ch].active = cb_bus != 0;
+		return;
+	}
+	r = dma_regs(ch);
+	*DMA_ENABLE |= 1 << ch;
+	r[0] = DMA_CS_RESET;
+	uswait(10);
+	r[0] = DMA_CS_INT | DMA_CS_END;
+	r[1] = cb_bus;				// CONBLK_AD
+	r[8] = 7;				// DEBUG, clear the error flags
+	__sync_synchronize();
+	/* WAIT_FOR_OUTSTANDING_WRITES, PANIC_PRIORITY 15, PRIORITY 8, ACTIVE */
+	r[0] = (1 << 28) | (15 << 20) | (8 << 16) | DMA_CS_ACTIVE;
+}
+
+/* Stop a channel, internal use only */
+static void dma_chan_stop(uint8_t ch)
+{
+	volatile uint32_t *r;
+
+	if(dma_simulated()){
+		sim_ch[ch].active = 0;
+		return;
+	}
+	r = dma_regs(ch);
+	r[0] = 0;
+	uswait(10);
+	r[0] = DMA_CS_RESET;
+	uswait(10);
+}
+
+/* Channel still walking its chain, internal use only */
+static int dma_chan_active(uint8_t ch)
+{
+	if(dma_simulated()){
+		return sim_ch[ch].active;
+	}
+	__sync_synchronize();
+	return (dma_regs(ch)[0] & DMA_CS_ACTIVE) != 0;
+}
+
+/* Bus address of the control block being processed, internal use only */
+static uint32_t dma_chan_cb(uint8_t ch)
+{
+	if(dma_simulated()){
+		return sim_ch[ch].cb;
+	}
+	__sync_synchronize();
+	return dma_regs(ch)[1];
+}
+
+/*
+ * Start the PWM DREQ pacer, one DREQ per period_ns (10 ns resolution, at least 100 ns)
+ * Fails if PWM is already used by the pwm_* functions, internal use only
+ */
+static int dma_pacer_start(uint32_t period_ns)
+{
+	int i;
+
+	period_ns = period_ns / 10 * 10;
+	if(period_ns < 100){
+		printf("dma_pacer_start() error: ");
+		puts("The DMA pacing period must be at least 100 ns.");
+		return 0;
+	}
+	if(pacer_users == 0 && !dma_simulated() && (*CTL & ((1 << 8) | (1 << 0)))){
+		printf("dma_pacer_start() error: ");
+		puts("PWM is in use, call pwm_reset_pin() on its pins first.");
+		return 0;
+	}
+	if(pacer_users > 0){
+		if(period_ns != pacer_period_ns){
+			printf("dma_pacer_start() error: ");
+			puts("The PWM pacer is already running at another period.");
+			return 0;
+		}
+		pacer_users++;
+		return 1;
+	}
+	pacer_users = 1;
+	pacer_period_ns = period_ns;
+
+	if(dma_simulated()){
+		sim_fifo_ns = sim_time_ns;
+		return 1;
+	}
+
+	*CTL = 0;
+	uswait(10);
+
+	/* PWM clock from PLLD/5 = 100 MHz */
+	*GPCTL = 0x5A000006;
+	for(i = 0; i < 100 && isBitSet(GPCTL, 7); i++){
+		uswait(10);
+	}
+	if(isBitSet(GPCTL, 7)){
+		*GPCTL = 0x5A000020;
+		uswait(100);
+	}
+	*GPDIV = 0x5A000000 | (5 << 12);
+	*GPCTL = 0x5A000016;
+	uswait(10);
+
+	*RNG1 = period_ns / 10;
+	*PWM_DMAC = (1UL << 31) | (15 << 8) | 15;	// ENAB, PANIC 15, DREQ 15
+	*CTL = 1 << 6;					// CLRF1
+	uswait(10);
+	*CTL = (1 << 5) | (1 << 1) | (1 << 0);		// USEF1, MODE1 serialiser, PWEN1
+	return 1;
+}
+
+/* Stop the PWM DREQ pacer after its last user, internal use only */
+static void dma_pacer_stop(void)
+{
+	if(pacer_users == 0 || --pacer_users > 0){
+		return;
+	}
+	if(!dma_simulated()){
+		*CTL = 0;
+		*PWM_DMAC = 0;
+	}
+}
+
+/* Set the function returning the simulated GPLEV0 input levels at a given time */
+void dma_sim_input(uint32_t (*fn)(uint64_t ns))
+{
+	sim_input = fn;
+}
+
+/* Set a function called on every simulated GPIO output change */
+void dma_sim_gpio_hook(void (*fn)(uint64_t ns, uint32_t levels))
+{
+	sim_gpio_hook = fn;
+}
+
+/* Simulated time in ns, advanced by the pacer */
+uint64_t dma_sim_time(void)
+{
+	return sim_time_ns;
+}
+
+/* Simulated GPIO output levels */
+uint32_t dma_sim_gpio(void)
+{
+	return sim_gpio;
+}
+
+/* Simulated memory word at a bus address, NULL if outside all blocks, internal use only */
+static uint32_t *sim_mem(uint32_t bus)
+{
+	int i;
+
+	for(i = 0; i < DMA_SIM_REGIONS; i++){
+		struct dma_mem *m = sim_region[i];
+		if(m && bus >= m->bus && bus - m->bus < m->size){
+			return (uint32_t *)((uint8_t *)m->virt + (bus - m->bus));
+		}
+	}
+	return NULL;
+}
+
+static uint32_t sim_periph_read(uint32_t bus);
+static void sim_periph_write(uint32_t bus, uint32_t value);
+
+/*
+ * Walk the simulated control block chain of a channel for up to max_cbs blocks
+ * (0 = until the end of the chain, do not use with cyclic chains).
+ * Returns the no. of control blocks processed, -1 on a bad address.
+ */
+long dma_sim_run(uint8_t ch, uint32_t max_cbs)
+{
+	struct dma_cb *cb;
+	uint32_t *p, k, words, src, dst, w;
+	long n = 0;
+
+	if(ch > 14){
+		return -1;
+	}
+	while(sim_ch[ch].active && (max_cbs == 0 || (uint32_t)n < max_cbs)){
+
+		cb = (struct dma_cb *)sim_mem(sim_ch[ch].cb);
+		if(cb == NULL){
+			printf("%s() error: ", __func__);
+			puts("Control block outside of the DMA memory.");
+			sim_ch[ch].active = 0;
+			return -1;
+		}
+
+		words = (cb->txfr_len + 3) / 4;
+		for(k = 0; k < words; k++){
+			src = cb->source_ad + ((cb->ti & DMA_TI_SRC_INC) ? k * 4 : 0);
+			dst = cb->dest_ad + ((cb->ti & DMA_TI_DEST_INC) ? k * 4 : 0);
+
+			if((src >> 24) == (BUS_BASE >> 24)){
+				w = sim_periph_read(src);
+			}
+			else if((p = sim_mem(src)) != NULL){
+				w = *p;
+			}
+			else{
+				sim_ch[ch].active = 0;
+				return -1;
+			}
+
+			/*
+			 * PWM paced words: the FIFO drains one word per pacer period and
+			 * takes new words without waiting until PWM_FIFO_DEPTH are queued
+			 */
+			if((cb->ti & (DMA_TI_SRC_DREQ | DMA_TI_DEST_DREQ)) && ((cb->ti >> 16) & 0x1F) == DMA_PERMAP_PWM){
+				if(sim_fifo_ns < sim_time_ns){
+					sim_fifo_ns = sim_time_ns;
+				}
+				if(sim_fifo_ns - sim_time_ns >= (uint64_t)PWM_FIFO_DEPTH * pacer_period_ns){
+					sim_time_ns = sim_fifo_ns - (uint64_t)(PWM_FIFO_DEPTH - 1) * pacer_period_ns;
+				}
+				sim_fifo_ns += pacer_period_ns;
+			}
+
+			if((dst >> 24) == (BUS_BASE >> 24)){
+				sim_periph_write(dst, w);
+			}
+			else if((p = sim_mem(dst)) != NULL){
+				*p = w;
+			}
+			else{
+				sim_ch[ch].active = 0;
+				return -1;
+			}
+		}
+
+		n++;
+		sim_ch[ch].cb = cb->nextconbk;
+		if(cb->nextconbk == 0){
+			sim_ch[ch].active = 0;
+		}
+	}
+	return n;
+}
+
+/* SPI0 FIFO model in loopback (MOSI to MISO): the bytes sent */
+static uint8_t *sim_spi_buf = NULL;
+static size_t sim_spi_head = 0, sim_spi_tail = 0, sim_spi_size = 0;
+
+/* Queue a byte sent on MOSI, internal use only */
+static void sim_spi_push(uint8_t byte)
+{
+	if(sim_spi_head == sim_spi_size){
+		size_t size = sim_spi_size ? sim_spi_size * 2 : 65536;
+		uint8_t *p = realloc(sim_spi_buf, size);
+		if(p == NULL){
+			return;
+		}
+		sim_spi_buf = p;
+		sim_spi_size = size;
+	}
+	sim_spi_buf[sim_spi_head++] = byte;
+}
+
+/* Simulated peripheral register read, internal use only */
+static uint32_t sim_periph_read(uint32_t bus)
+{
+	uint32_t w = 0;
+	int i;
+
+	switch(bus){
+	case BUS_SPI_FIFO:
+		for(i = 0; i < 4 && sim_spi_tail < sim_spi_head; i++){
+			w |= (uint32_t)sim_spi_buf[sim_spi_tail++] << (8 * i);
+		}
+		if(sim_spi_tail == sim_spi_head){
+			sim_spi_tail = sim_spi_head = 0;
+		}
+		return w;
+	case BUS_ST_CLO:
+		return (uint32_t)(sim_time_ns / 1000);
+	case BUS_GPLEV0:
+		return sim_input ? sim_input(sim_time_ns) : sim_gpio;
+	default:
+		return 0;
+	}
+}
+
+/* Simulated peripheral register write, internal use only */
+static void sim_periph_write(uint32_t bus, uint32_t value)
+{
+	int i;
+
+	switch(bus){
+	case BUS_SPI_FIFO:
+		/* with DMAEN each word carries 4 data bytes, LSB first */
+		for(i = 0; i < 4; i++){
+			sim_spi_push((uint8_t)(value >> (8 * i)));
+		}
+		break;
+	case BUS_GPSET0:
+		sim_gpio |= value;
+		if(sim_gpio_hook){
+			sim_gpio_hook(sim_time_ns, sim_gpio);
+		}
+		break;
+	case BUS_GPCLR0:
+		sim_gpio &= ~value;
+		if(sim_gpio_hook){
+			sim_gpio_hook(sim_time_ns, sim_gpio);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+
+/*************************************
+
+	DMA Waveform Functions
+
+**************************************/
+/*
+ * GPIO waveforms played by DMA: for each pulse one control block writes the set
+ * mask to GPSET0, one writes the clear mask to GPCLR0, and one or more write the
+ * delay (in pacer ticks) to the PWM FIFO. The edges keep their timing to within
+ * the tick regardless of CPU load, and the CPU is idle while a waveform plays.
+ * The pins must be set as outputs beforehand.
+ *
+ * The PWM FIFO takes PWM_FIFO_DEPTH words without waiting when it is empty, as
+ * it is at the start of every waveform, so a lead-in block fills it first: the
+ * first edge comes PWM_FIFO_DEPTH ticks or less after wave_send(), and from then
+ * on every delay word waits for one tick. A repeating waveform loops back past
+ * the lead-in.
+ */
+static struct dma_mem wave_mem;
+static uint8_t wave_ch = 0;
+static uint32_t wave_tick_ns = 0;
+
+/*
+ * Set up the waveform engine
+ * dma_ch = DMA channel (e.g. 14), tick_ns = pacing period, delays are rounded to it
+ * Returns 1 on success
+ */
+int wave_init(uint8_t dma_ch, uint32_t tick_ns)
+{
+	if(dma_ch > 14){
+		printf("%s() error: ", __func__);
+		puts("Invalid DMA channel (0 to 14).");
+		return 0;
+	}
+	if(wave_tick_ns != 0){
+		printf("%s() error: ", __func__);
+		puts("The waveform engine is already set up.");
+		return 0;
+	}
+	if(!dma_pacer_start(tick_ns)){
+		return 0;
+	}
+	wave_ch = dma_ch;
+	wave_tick_ns = pacer_period_ns;
+	return 1;
+}
+
+/* Stop the current waveform */
+void wave_stop(void)
+{
+	if(wave_mem.virt == NULL){
+		return;
+	}
+	dma_chan_stop(wave_ch);
+	dma_mem_free(&wave_mem);
+}
+
+/* Stop the waveform engine */
+void wave_close(void)
+{
+	if(wave_tick_ns == 0){
+		return;
+	}
+	wave_stop();
+	dma_pacer_stop();
+	wave_tick_ns = 0;
+}
+
+/*
+ * Build and start a waveform, replacing the one playing
+ * pulses = GPIO 0-31 masks to set and clear, then the delay to the next pulse
+ * repeat = 1 to loop the waveform until wave_stop()
+ * Returns 1 on success
+ */
+int wave_send(const struct wave_pulse * pulses, size_t n, int repeat)
+{
+	struct dma_cb *cb, *first;
+	uint32_t ticks, len;
+	size_t i, ncb = 0;
+
+	if(wave_tick_ns == 0 || n == 0){
+		printf("%s() error: ", __func__);
+		puts("Call wave_init() first, and pass at least one pulse.");
+		return 0;
+	}
+
+	ncb = 1;	// lead-in
+	for(i = 0; i < n; i++){
+		ticks = (pulses[i].delay_ns + wave_tick_ns / 2) / wave_tick_ns;
+		ncb += (pulses[i].set != 0) + (pulses[i].clr != 0) + (ticks + DMA_MAX_LEN / 4 - 1) / (DMA_MAX_LEN / 4);
+	}
+	if(ncb == 1 || ncb > UINT32_MAX / sizeof(struct dma_cb)){
+		printf("%s() error: ", __func__);
+		puts("Empty or too long waveform.");
+		return 0;
+	}
+
+	wave_stop();
+	if(!dma_mem_alloc(&wave_mem, (uint32_t)(ncb * sizeof(struct dma_cb)))){
+		printf("%s() error: ", __func__);
+		puts("Cannot allocate uncached DMA memory.");
+		return 0;
+	}
+
+	/* fill the empty PWM FIFO, so the first delay word already waits a tick */
+	cb = wave_mem.virt;
+	cb->pad[0] = 0;
+	cb->ti = DMA_TI_NO_WIDE_BURSTS | DMA_TI_WAIT_RESP | DMA_TI_DEST_DREQ | DMA_TI_PERMAP(DMA_PERMAP_PWM);
+	cb->source_ad = dma_bus(&wave_mem, &cb->pad[0]);
+	cb->dest_ad = BUS_PWM_FIF1;
+	cb->txfr_len = PWM_FIFO_DEPTH * 4;
+	first = ++cb;
+
+	for(i = 0; i < n; i++){
+		if(pulses[i].set){
+			cb->pad[0] = pulses[i].set;
+			cb->ti = DMA_TI_NO_WIDE_BURSTS | DMA_TI_WAIT_RESP;
+			cb->source_ad = dma_bus(&wave_mem, &cb->pad[0]);
+			cb->dest_ad = BUS_GPSET0;
+			cb->txfr_len = 4;
+			cb++;
+		}
+		if(pulses[i].clr){
+			cb->pad[0] = pulses[i].clr;
+			cb->ti = DMA_TI_NO_WIDE_BURSTS | DMA_TI_WAIT_RESP;
+			cb->source_ad = dma_bus(&wave_mem, &cb->pad[0]);
+			cb->dest_ad = BUS_GPCLR0;
+			cb->txfr_len = 4;
+			cb++;
+		}
+		/* the same word written ticks times to the paced PWM FIFO */
+		ticks = (pulses[i].delay_ns + wave_tick_ns / 2) / wave_tick_ns;
+		while(ticks > 0){
+			len = ticks > DMA_MAX_LEN / 4 ? DMA_MAX_LEN / 4 : ticks;
+			cb->ti = DMA_TI_NO_WIDE_BURSTS | DMA_TI_WAIT_RESP | DMA_TI_DEST_DREQ | DMA_TI_PERMAP(DMA_PERMAP_PWM);
+			cb->source_ad = dma_bus(&wave_mem, &cb->pad[0]);
+			cb->dest_ad = BUS_PWM_FIF1;
+			cb->txfr_len = len * 4;
+			cb++;
+			ticks -= len;
+		}
+	}
+
+	/* link the chain, back to the first pulse when repeating */
+	cb = wave_mem.virt;
+	for(i = 0; i < ncb; i++){
+		cb[i].nextconbk = i + 1 < ncb ? dma_bus(&wave_mem, &cb[i + 1]) : (repeat ? dma_bus(&wave_mem, first) : 0);
+	}
+	__sync_synchronize();
+
+	dma_chan_start(wave_ch, dma_bus(&wave_mem, cb));
+	return 1;
+}
+
+/* Waveform still playing, returns 1 if busy */
+int wave_busy(void)
+{
+	return wave_mem.virt != NULL && dma_chan_active(wave_ch);
+}
+
+
+/*************************************
+
+	SPI DMA Functions
+
+**************************************/
+/*
+ * SPI0 transfers of spi_dma_min bytes or more go through two DMA channels once
+ * spi_dma_init() is called, the CPU pump stays the fallback for short transfers,
+ * the kernel backend, and when DMA is not set up.
+ *
+ * As in the spi-bcm2835 kernel driver, the CPU sets TA and DMAEN (no ADCS) and
+ * keeps TA set for the whole transfer, so the chip select stays asserted from
+ * the first byte to the last. The TX channel streams plain 4 byte words into the
+ * FIFO (TX DREQ, PERMAP 6), the RX chain copies the FIFO out (RX DREQ, PERMAP 7).
+ *
+ * Data goes through uncached bounce buffers of up to 16 control blocks of 65532
+ * bytes (1 MB) per segment; the CPU sleeps while a segment is in flight and the
+ * clock just pauses between segments. The last len % 4 bytes are sent by the CPU
+ * pump after DMAEN is dropped, still inside the same TA.
+ */
+#define SPI_DMA_CHUNK		65532
+#define SPI_DMA_CHUNKS		16
+#define SPI_DMA_MIN		4096
+
+static struct dma_mem spi_dma_mem;
+static uint8_t spi_dma_tx_ch = 0;
+static uint8_t spi_dma_rx_ch = 0;
+static int spi_dma_ready = 0;
+
+/*
+ * Enable DMA for large SPI0 transfers
+ * tx_ch, rx_ch = DMA channels (0 to 14), not used by the firmware or the kernel
+ * Returns 1 on success
+ */
+int spi_dma_init(uint8_t tx_ch, uint8_t rx_ch)
+{
+	uint32_t size;
+
+	if(tx_ch > 14 || rx_ch > 14 || tx_ch == rx_ch){
+		printf("%s() error: ", __func__);
+		puts("Invalid DMA channels (0 to 14, two different channels).");
+		return 0;
+	}
+	if(spi_dma_ready){
+		return 1;
+	}
+
+	/* TX data, RX data, then the control blocks */
+	size = 2 * SPI_DMA_CHUNKS * SPI_DMA_CHUNK
+	     + 2 * SPI_DMA_CHUNKS * sizeof(struct dma_cb);
+	if(!dma_mem_alloc(&spi_dma_mem, size)){
+		printf("%s() error: ", __func__);
+		puts("Cannot allocate uncached DMA memory.");
+		return 0;
+	}
+	spi_dma_tx_ch = tx_ch;
+	spi_dma_rx_ch = rx_ch;
+	spi_dma_ready = 1;
+	return 1;
+}
+
+/* Go back to CPU transfers only */
+void spi_dma_close(void)
+{
+	if(!spi_dma_ready){
+		return;
+	}
+	spi_dma_ready = 0;
+	dma_mem_free(&spi_dma_mem);
+}
+
+/* Wait for a channel to reach the end of its chain, internal use only */
+static void dma_chan_wait(uint8_t ch)
+{
+	if(dma_simulated()){
+		dma_sim_run(ch, 0);
+		return;
+	}
+	while(dma_chan_active(ch)){
+		uswait(50);
+	}
+}
+
+/*
+ * DMA transfer engine, internal use only. The SPI0 bus lock must be held.
+ * dev = device handle, NULL for the legacy functions (current CS register settings)
+ * The SPI registers are left alone in simulation, the tail bytes loop back.
+ * Returns 0 if the transfer is not for DMA and the caller must pump it
+ */
+static int spi_dma_pump(const struct spi_device * dev, const char * wbuf, char * rbuf, size_t len)
+{
+	int sim = dma_simulated();
+	uint32_t cs_reg;
+	uint8_t *txbuf = spi_dma_mem.virt;
+	uint8_t *rxbuf = txbuf + SPI_DMA_CHUNKS * SPI_DMA_CHUNK;
+	struct dma_cb *txcb = (struct dma_cb *)(rxbuf + SPI_DMA_CHUNKS * SPI_DMA_CHUNK);
+	struct dma_cb *rxcb = txcb + SPI_DMA_CHUNKS;
+	size_t done = 0, seg, n, tail;
+	uint32_t k, nchunks, off;
+
+	if(!spi_dma_ready || spi_dev_fd >= 0 || len < SPI_DMA_MIN){
+		return 0;
+	}
+
+	tail = len % 4;
+	len -= tail;
+
+	if(dev){
+		cs_reg = dev->cs_reg;
+	}
+	else{
+		cs_reg = sim ? 0 : *SPI_CS & ~(SPI_CS_TA | (3 << 4));
+	}
+	if(!sim){
+		*SPI_DC = (0x30 << 24) | (0x20 << 16) | (0x10 << 8) | 0x20;	// RPANIC, RDREQ, TPANIC, TDREQ
+
+		/* clear both FIFOs, then assert CS with TA until the last byte */
+		*SPI_CS = cs_reg | (3 << 4);
+		*SPI_CS = cs_reg | SPI_CS_TA | (1 << 8);	// TA | DMAEN
+		__sync_synchronize();
+	}
+
+	while(done < len){
+
+		seg = len - done > (size_t)SPI_DMA_CHUNKS * SPI_DMA_CHUNK ? (size_t)SPI_DMA_CHUNKS * SPI_DMA_CHUNK : len - done;
+		nchunks = (uint32_t)((seg + SPI_DMA_CHUNK - 1) / SPI_DMA_CHUNK);
+
+		if(wbuf){
+			memcpy(txbuf, wbuf + done, seg);
+		}
+		else{
+			memset(txbuf, 0, seg);
+		}
+
+		for(k = 0, off = 0; k < nchunks; k++, off += SPI_DMA_CHUNK){
+			n = seg - off > SPI_DMA_CHUNK ? SPI_DMA_CHUNK : seg - off;
+
+			txcb[k].ti = DMA_TI_NO_WIDE_BURSTS | DMA_TI_WAIT_RESP | DMA_TI_SRC_INC
+				   | DMA_TI_DEST_DREQ | DMA_TI_PERMAP(DMA_PERMAP_SPI_TX);
+			txcb[k].source_ad = dma_bus(&spi_dma_mem, txbuf + off);
+			txcb[k].dest_ad = BUS_SPI_FIFO;
+			txcb[k].txfr_len = (uint32_t)n;
+			txcb[k].nextconbk = k + 1 < nchunks ? dma_bus(&spi_dma_mem, &txcb[k + 1]) : 0;
+
+			rxcb[k].ti = DMA_TI_NO_WIDE_BURSTS | DMA_TI_WAIT_RESP | DMA_TI_DEST_INC
+				   | DMA_TI_SRC_DREQ | DMA_TI_PERMAP(DMA_PERMAP_SPI_RX);
+			rxcb[k].source_ad = BUS_SPI_FIFO;
+			rxcb[k].dest_ad = dma_bus(&spi_dma_mem, rxbuf + off);
+			rxcb[k].txfr_len = (uint32_t)n;
+			rxcb[k].nextconbk = k + 1 < nchunks ? dma_bus(&spi_dma_mem, &rxcb[k + 1]) : 0;
+		}
+		__sync_synchronize();
+
+		dma_chan_start(spi_dma_rx_ch, dma_bus(&spi_dma_mem, rxcb));
+		dma_chan_start(spi_dma_tx_ch, dma_bus(&spi_dma_mem, txcb));
+		dma_chan_wait(spi_dma_tx_ch);
+		dma_chan_wait(spi_dma_rx_ch);
+
+		if(rbuf){
+			memcpy(rbuf + done, rxbuf, seg);
+		}
+		done += seg;
+	}
+
+	if(sim){
+		if(tail > 0 && rbuf){
+			for(n = 0; n < tail; n++){
+				rbuf[len + n] = wbuf ? wbuf[len + n] : 0;
+			}
+		}
+		return 1;
+	}
+
+	/* drop DMAEN only, the tail bytes go out within the same TA */
+	*SPI_CS = cs_reg | SPI_CS_TA;
+	__sync_synchronize();
+	if(tail > 0){
+		spi_pump(wbuf ? wbuf + len : NULL, rbuf ? rbuf + len : NULL, tail);
+	}
+	*SPI_CS = cs_reg;
+	__sync_synchronize();
+	return 1;
+}
+
+
+/*************************************
+
+	DMA GPIO Sampling Functions
+
+**************************************/
+/*
+ * GPLEV0 sampled by DMA into a ring in uncached memory, paced by the PWM DREQ.
+ *
+ * The ring is made of blocks of 256 samples. Each block starts with a control
+ * block copying the system timer low word into the block's timestamp, then two
+ * control blocks per sample: one copies GPLEV0 into the sample slot, the other
+ * writes one word to the paced PWM FIFO. The last block links back to the first.
+ * A lead-in block fills the empty PWM FIFO first, so the first samples do not
+ * burst in ahead of the pacer.
+ *
+ * gpio_sample_edges() finds the DMA position from its current control block,
+ * and turns the samples since the last call into level changes. Their times
+ * are interpolated between the timestamps of the block and the next one, so
+ * they follow the rate the DMA engine actually kept, and the 32-bit timer word
+ * is extended with the high word of st_read(). The DMA chain needs about a
+ * microsecond per sample, so the rate is limited to SAMPLE_MAX_HZ. When the
+ * consumer falls a whole ring behind, by time or by unread samples, the lost
+ * samples are skipped and counted as an overrun.
+ */
+#define SAMPLE_BLOCK	256
+#define SAMPLE_MAX_HZ	1000000
+
+static struct dma_mem sample_mem;
+static uint8_t sample_ch = 0;
+static uint32_t sample_blocks = 0;
+static uint32_t sample_period_ns = 0;
+static uint32_t *sample_ts = NULL;		/* one timestamp per block, us */
+static uint32_t *sample_buf = NULL;		/* GPLEV0 samples */
+static struct dma_cb *sample_cb = NULL;		/* first block, after the lead-in */
+static uint32_t sample_rpos = 0;		/* next sample to decode */
+static uint32_t sample_wlast = 0;		/* DMA position at the last call */
+static uint32_t sample_pending = 0;		/* samples written but not decoded yet */
+static uint32_t sample_prev = 0;		/* levels of the previous sample */
+static uint64_t sample_last_poll = 0;
+static uint32_t sample_overruns = 0;
+static int sample_first = 1;
+
+/* System timer in us, the simulated one when the DMA is simulated, internal use only */
+static uint64_t sample_now(void)
+{
+	return dma_simulated() ? sim_time_ns / 1000 : st_read();
+}
+
+/*
+ * Start sampling GPIO 0-31
+ * dma_ch = DMA channel (0 to 14), rate_hz = samples per second, 1 MHz at most
+ * nsamples = ring length, rounded up to blocks of 256 (0 = 16384)
+ * Returns 1 on success
+ */
+int gpio_sample_start(uint8_t dma_ch, uint32_t rate_hz, uint32_t nsamples)
+{
+	struct dma_cb *cb;
+	uint32_t b, k, ncb, i;
+
+	if(dma_ch > 14 || rate_hz == 0 || rate_hz > SAMPLE_MAX_HZ){
+		printf("%s() error: ", __func__);
+		puts("Invalid DMA channel (0 to 14) or sample rate (1 Hz to 1 MHz).");
+		return 0;
+	}
+	if(sample_mem.virt != NULL){
+		printf("%s() error: ", __func__);
+		puts("GPIO sampling is already running.");
+		return 0;
+	}
+	if(!dma_pacer_start(1000000000 / rate_hz)){
+		return 0;
+	}
+
+	sample_blocks = ((nsamples ? nsamples : 16384) + SAMPLE_BLOCK - 1) / SAMPLE_BLOCK;
+	ncb = sample_blocks * (1 + 2 * SAMPLE_BLOCK);
+	if(!dma_mem_alloc(&sample_mem, (1 + ncb) * sizeof(struct dma_cb) + sample_blocks * (SAMPLE_BLOCK + 1) * 4)){
+		dma_pacer_stop();
+		printf("%s() error: ", __func__);
+		puts("Cannot allocate uncached DMA memory.");
+		return 0;
+	}
+
+	/* lead-in, fills the PWM FIFO */
+	cb = sample_mem.virt;
+	cb->ti = DMA_TI_NO_WIDE_BURSTS | DMA_TI_WAIT_RESP | DMA_TI_DEST_DREQ | DMA_TI_PERMAP(DMA_PERMAP_PWM);
+	cb->source_ad = dma_bus(&sample_mem, &cb->pad[0]);
+	cb->dest_ad = BUS_PWM_FIF1;
+	cb->txfr_len = PWM_FIFO_DEPTH * 4;
+	cb->nextconbk = dma_bus(&sample_mem, cb + 1);
+
+	sample_cb = cb + 1;
+	sample_ts = (uint32_t *)(sample_cb + ncb);
+	sample_buf = sample_ts + sample_blocks;
+	sample_period_ns = pacer_period_ns;
+
+	for(b = 0, cb = sample_cb; b < sample_blocks; b++){
+		cb->ti = DMA_TI_NO_WIDE_BURSTS | DMA_TI_WAIT_RESP;
+		cb->source_ad = BUS_ST_CLO;
+		cb->dest_ad = dma_bus(&sample_mem, &sample_ts[b]);
+		cb->txfr_len = 4;
+		cb++;
+		for(k = 0; k < SAMPLE_BLOCK; k++){
+			cb->ti = DMA_TI_NO_WIDE_BURSTS | DMA_TI_WAIT_RESP;
+			cb->source_ad = BUS_GPLEV0;
+			cb->dest_ad = dma_bus(&sample_mem, &sample_buf[b * SAMPLE_BLOCK + k]);
+			cb->txfr_len = 4;
+			cb++;
+			cb->ti = DMA_TI_NO_WIDE_BURSTS | DMA_TI_WAIT_RESP | DMA_TI_DEST_DREQ | DMA_TI_PERMAP(DMA_PERMAP_PWM);
+			cb->source_ad = dma_bus(&sample_mem, &cb->pad[0]);
+			cb->dest_ad = BUS_PWM_FIF1;
+			cb->txfr_len = 4;
+			cb++;
+		}
+	}
+	for(i = 0; i < ncb; i++){
+		sample_cb[i].nextconbk = dma_bus(&sample_mem, &sample_cb[(i + 1) % ncb]);
+	}
+	__sync_synchronize();
+
+	sample_ch = dma_ch;
+	sample_rpos = 0;
+	sample_wlast = 0;
+	sample_pending = 0;
+	sample_overruns = 0;
+	sample_first = 1;
+	sample_last_poll = sample_now();
+	dma_chan_start(sample_ch, dma_bus(&sample_mem, sample_mem.virt));
+	return 1;
+}
+
+/* Stop GPIO sampling */
+void gpio_sample_stop(void)
+{
+	if(sample_mem.virt == NULL){
+		return;
+	}
+	dma_chan_stop(sample_ch);
+	dma_mem_free(&sample_mem);
+	dma_pacer_stop();
+	sample_cb = NULL;
+	sample_ts = sample_buf = NULL;
+}
+
+/* Ring index of the next sample the DMA engine will write, internal use only */
+static uint32_t sample_wpos(void)
+{
+	uint32_t bus = dma_chan_cb(sample_ch);
+	uint32_t per_block = 1 + 2 * SAMPLE_BLOCK;
+	uint32_t idx;
+
+	/* still in the lead-in */
+	if(bus < dma_bus(&sample_mem, sample_cb)){
+		return 0;
+	}
+	idx = (bus - dma_bus(&sample_mem, sample_cb)) / sizeof(struct dma_cb);
+	if(idx >= sample_blocks * per_block){
+		return sample_wlast;
+	}
+	return (idx / per_block) * SAMPLE_BLOCK + (idx % per_block) / 2;
+}
+
+/* Extend a block timestamp to 64 bits, it lies within 71 minutes before now, internal use only */
+static uint64_t sample_ts64(uint32_t ts, uint64_t now)
+{
+	return now - (uint32_t)((uint32_t)now - ts);
+}
+
+/*
+ * Decode the samples taken since the last call into edges
+ * mask = GPIO 0-31 pins of interest, edges = output array of up to max entries
+ * Returns the no. of edges found, call again while it returns max
+ */
+size_t gpio_sample_edges(struct gpio_edge * edges, size_t max, uint32_t mask)
+{
+	uint32_t wpos, total, level, b, k, bnext;
+	uint64_t now, ring_us, t0, t1;
+	size_t n = 0;
+
+	if(sample_mem.virt == NULL){
+		return 0;
+	}
+	total = sample_blocks * SAMPLE_BLOCK;
+	wpos = sample_wpos();
+	now = sample_now();
+
+	/*
+	 * A whole ring behind, the samples in between are gone: either too long since
+	 * the last call, or more samples written since than the ring holds
+	 */
+	sample_pending += (wpos + total - sample_wlast) % total;
+	sample_wlast = wpos;
+	ring_us = (uint64_t)total * sample_period_ns / 1000;
+	if(now - sample_last_poll > ring_us || sample_pending >= total){
+		sample_overruns++;
+		sample_rpos = wpos;
+		sample_pending = 0;
+		sample_first = 1;
+	}
+	sample_last_poll = now;
+
+	while(sample_rpos != wpos && n < max){
+		b = sample_rpos / SAMPLE_BLOCK;
+		k = sample_rpos % SAMPLE_BLOCK;
+		level = sample_buf[sample_rpos];
+
+		if(sample_first){
+			sample_prev = level;
+			sample_first = 0;
+		}
+		else if((level ^ sample_prev) & mask){
+			/*
+			 * Between this block's timestamp and the next one, once the DMA is past
+			 * the next one: while it waits on the last pacing word of this block the
+			 * write position already reads as the next block, whose stamp is stale
+			 */
+			t0 = sample_ts64(sample_ts[b], now);
+			bnext = (b + 1) % sample_blocks;
+			t1 = t0;
+			if(bnext != b && (wpos + total - b * SAMPLE_BLOCK) % total > SAMPLE_BLOCK){
+				t1 = sample_ts64(sample_ts[bnext], now);
+			}
+			if(t1 > t0){
+				edges[n].time_ns = t0 * 1000 + (t1 - t0) * 1000 * k / SAMPLE_BLOCK;
+			}
+			else{
+				edges[n].time_ns = t0 * 1000 + (uint64_t)k * sample_period_ns;
+			}
+			edges[n].levels = level;
+			edges[n].changed = (level ^ sample_prev) & mask;
+			n++;
+		}
+		sample_prev = level;
+		sample_rpos = (sample_rpos + 1) % total;
+		sample_pending--;
+	}
+	return n;
+}
+
+/* No. of times the consumer fell a whole ring behind */
+uint32_t gpio_sample_overruns(void)
+{
+	return sample_overruns;
+}
+
+
+/*************************************
+
+	Software SPI Functions
+
+**************************************/
+/*
+ * Bit-banged SPI master on any GPIO pins (0 to 31).
+ *
+ * Outputs are driven with gpio_write_mask() and MISO is sampled with a
+ * single GPLEV read. When the clock edge and the new data bit go to the same
+ * level they change in one store, otherwise in one GPSET and one GPCLR store.
+ * MISO is sampled right before the edge on which the slave changes its output.
+ *
+ * Words of 1 to 32 bits are shifted MSB or LSB first. In half-duplex (3-wire)
+ * mode MOSI is the bidirectional data line, it is switched to input for reads.
+ */
+
+/*
+ * Initialize a software SPI bus
+ * miso = SOFT_SPI_NONE for write only or half-duplex, cs = SOFT_SPI_NONE if handled elsewhere
+ * mode = SPI data mode 0 to 3, bits = word size 1 to 32, flags = SOFT_SPI_LSB_FIRST, SOFT_SPI_3WIRE
+ * half_period_ns = min. clock half period, 0 = as fast as the GPIO allows
+ * Returns 1 on success
+ */
+int soft_spi_init(struct soft_spi * bus, uint8_t sclk, uint8_t mosi, uint8_t miso, uint8_t cs,
+		  uint8_t mode, uint8_t bits, uint8_t flags, uint32_t half_period_ns)
+{
+	if(sclk > 31 || mosi > 31 || (miso > 31 && miso != SOFT_SPI_NONE) || (cs > 31 && cs != SOFT_SPI_NONE)
+	   || mode > 3 || bits == 0 || bits > 32){
+		printf("%s() error: ", __func__);
+		puts("Invalid pin (GPIO 0 to 31), mode or bits parameter.");
+		return 0;
+	}
+
+	memset(bus, 0, sizeof(*bus));
+	bus->mosi = mosi;
+	bus->mode = mode;
+	bus->bits = bits;
+	bus->flags = flags;
+	bus->half_period_ns = half_period_ns;
+	bus->clk_mask = 1UL << sclk;
+	bus->mosi_mask = 1UL << mosi;
+	bus->miso_mask = (flags & SOFT_SPI_3WIRE) ? bus->mosi_mask : (miso != SOFT_SPI_NONE ? 1UL << miso : 0);
+	bus->cs_mask = cs != SOFT_SPI_NONE ? 1UL << cs : 0;
+	bus->idle = (mode & 2) ? bus->clk_mask : 0;
+
+	/* clock idle, chip select released */
+	gpio_write_mask(bus->clk_mask | bus->cs_mask, bus->idle | bus->cs_mask);
+	gpio_output(sclk);
+	gpio_output(mosi);
+	if(bus->cs_mask){
+		gpio_output(cs);
+	}
+	if(miso != SOFT_SPI_NONE && !(flags & SOFT_SPI_3WIRE)){
+		gpio_input(miso);
+	}
+	return 1;
+}
+
+/* Shift one word out and in, internal use only */
+static uint32_t soft_spi_shift(const struct soft_spi * bus, uint32_t out, int write)
+{
+	uint32_t active = bus->idle ^ bus->clk_mask;
+	uint32_t mask = bus->clk_mask | (write ? bus->mosi_mask : 0);
+	uint32_t in = 0, bit, level;
+	int cpha = bus->mode & 1;
+	int i, b;
+
+	for(i = 0; i < bus->bits; i++){
+
+		b = (bus->flags & SOFT_SPI_LSB_FIRST) ? i : bus->bits - 1 - i;
+		bit = ((out >> b) & 1) ? bus->mosi_mask : 0;
+
+		/* CPHA 0: data set together with the previous trailing edge (or up front for bit 0) */
+		if(!cpha && i == 0 && write){
+			gpio_write_mask(bus->mosi_mask, bit);
+		}
+
+		/* leading edge, with the data bit for CPHA 1 */
+		if(cpha){
+			gpio_write_mask(mask, active | bit);
+		}
+		else{
+			gpio_write_mask(bus->clk_mask, active);
+		}
+		spin_ns(bus->half_period_ns);
+
+		/* sample right before the trailing edge */
+		level = *GPLEV;
+		in |= ((level & bus->miso_mask) ? 1UL : 0) << b;
+
+		/* trailing edge, with the next data bit for CPHA 0 */
+		if(!cpha && i + 1 < bus->bits && write){
+			int nb = (bus->flags & SOFT_SPI_LSB_FIRST) ? i + 1 : bus->bits - 2 - i;
+			gpio_write_mask(mask, bus->idle | (((out >> nb) & 1) ? bus->mosi_mask : 0));
+		}
+		else{
+			gpio_write_mask(bus->clk_mask, bus->idle);
+		}
+		spin_ns(bus->half_period_ns);
+	}
+	return in;
+}
+
+/* Assert/release the chip select, internal use only */
+static inline void soft_spi_cs(const struct soft_spi * bus, int assert)
+{
+	if(bus->cs_mask){
+		if(assert){
+			*GPCLR = bus->cs_mask;
+		}
+		else{
+			*GPSET = bus->cs_mask;
+		}
+	}
+}
+
+/*
+ * Full-duplex transfer of n words in one chip select assertion
+ * wbuf = NULL sends zeros, rbuf = NULL discards the received words
+ */
+void soft_spi_transfer(const struct soft_spi * bus, const uint32_t * wbuf, uint32_t * rbuf, size_t n)
+{
+	uint32_t in;
+	size_t i;
+
+	__sync_synchronize();
+	soft_spi_cs(bus, 1);
+	for(i = 0; i < n; i++){
+		in = soft_spi_shift(bus, wbuf ? wbuf[i] : 0, 1);
+		if(rbuf){
+			rbuf[i] = in;
+		}
+	}
+	soft_spi_cs(bus, 0);
+	__sync_synchronize();
+}
+
+/*
+ * Half-duplex transfer: write wn words, then read rn words on the same data line
+ * (3-wire) or on MISO, in one chip select assertion
+ */
+void soft_spi_write_read(const struct soft_spi * bus, const uint32_t * wbuf, size_t wn, uint32_t * rbuf, size_t rn)
+{
+	size_t i;
+
+	__sync_synchronize();
+	soft_spi_cs(bus, 1);
+	for(i = 0; i < wn; i++){
+		soft_spi_shift(bus, wbuf[i], 1);
+	}
+	if(rn > 0){
+		if(bus->flags & SOFT_SPI_3WIRE){
+			gpio_input(bus->mosi);
+		}
+		for(i = 0; i < rn; i++){
+			rbuf[i] = soft_spi_shift(bus, 0, 0);
+		}
+		if(bus->flags & SOFT_SPI_3WIRE){
+			gpio_output(bus->mosi);
+		}
+	}
+	soft_spi_cs(bus, 0);
+	__sync_synchronize();
+}
+
+
+/*************************************
+
+	Software I2C Functions
+
+**************************************/
+/*
+ * Bit-banged open-drain I2C master on any GPIO pin pair (0 to 31), for devices
+ * with conflicting addresses or boards where GPIO 2/3 are taken.
+ *
+ * A line is pulled low by switching the pin to output (its output latch is kept
+ * low) and released by switching it back to input, so external pull-ups are
+ * required. The GPFSEL words of both pins are shadowed at the start of each
+ * transaction, so every edge is a single register store instead of a
+ * read-modify-write. SCL is read back after each release, a slave holding it
+ * low (clock stretching) is waited for up to stretch_us.
+ *
+ * Each SCL half period is timed from the last clock edge on the system timer,
+ * so CPU frequency scaling cannot make the clock faster than requested. Only
+ * the sub-microsecond rest and the short hold/rise paddings use a busy-wait
+ * loop, calibrated at the highest CPU clock seen. The transfer functions return
+ * the same status codes as i2c_transfer().
+ */
+
+/* Busy-wait loop, internal use only */
+static void si2c_loop(uint32_t n)
+{
+	volatile uint32_t i;
+
+	for(i = 0; i < n; i++);
+}
+
+/*
+ * Calibrate the busy-wait loop against the system timer, loops per ms
+ * After a busy warm-up, so the CPU frequency governor has ramped up, the fastest
+ * of three runs is kept: at a lower clock the paddings only get longer.
+ */
+static uint32_t si2c_calibrate(void)
+{
+	uint32_t n = 10000, best = 0, rate;
+	uint64_t t0, t;
+	int run;
+
+	t0 = st_read();
+	while(st_read() - t0 < 50000);
+
+	for(run = 0; run < 3; run++){
+		for(;;){
+			t0 = st_read();
+			si2c_loop(n);
+			t = st_read() - t0;
+			if(t >= 2000 || n > (1U << 30)){
+				break;
+			}
+			n *= 2;
+		}
+		rate = (uint32_t)((uint64_t)n * 1000 / (t ? t : 1));
+		best = rate > best ? rate : best;
+	}
+	return best;
+}
+
+/* Note the time of a clock edge, internal use only */
+static inline void si2c_mark(struct soft_i2c * bus)
+{
+	bus->mark = st_read();
+}
+
+/*
+ * Wait until half an SCL period has passed since the last mark, internal use only
+ * More than half_us timer counts guarantees at least half_us whole microseconds.
+ */
+static void si2c_half(struct soft_i2c * bus)
+{
+	while(st_read() - bus->mark <= bus->half_us);
+	si2c_loop(bus->pad_loops);
+}
+
+/* Write the shadowed GPFSEL word(s) for the current line states, internal use only */
+static void si2c_lines(struct soft_i2c * bus)
+{
+	volatile uint32_t * gpsel = (uint32_t *)GPSEL;
+	uint32_t sda = bus->sda_low ? bus->sda_out : 0;
+	uint32_t scl = bus->scl_low ? bus->scl_out : 0;
+
+	if(bus->sda_reg == bus->scl_reg){
+		gpsel[bus->sda_reg] = bus->sda_shadow | sda | scl;
+	}
+	else{
+		gpsel[bus->sda_reg] = bus->sda_shadow | sda;
+		gpsel[bus->scl_reg] = bus->scl_shadow | scl;
+	}
+}
+
+static inline void si2c_sda(struct soft_i2c * bus, int low)
+{
+	bus->sda_low = low;
+	si2c_lines(bus);
+}
+
+/* Release SCL and wait while a slave stretches the clock, returns 0 on timeout */
+static int si2c_scl_release(struct soft_i2c * bus)
+{
+	uint64_t deadline;
+
+	bus->scl_low = 0;
+	si2c_lines(bus);
+	si2c_loop(bus->rise_loops);
+
+	if(!(*GPLEV & bus->scl_mask)){
+		deadline = st_read() + bus->stretch_us;
+		while(!(*GPLEV & bus->scl_mask)){
+			if(st_read() > deadline){
+				return 0;
+			}
+		}
+	}
+	si2c_mark(bus);
+	return 1;
+}
+
+static inline void si2c_scl_low(struct soft_i2c * bus)
+{
+	bus->scl_low = 1;
+	si2c_lines(bus);
+	si2c_mark(bus);
+}
+
+/* Take a fresh copy of the GPFSEL words with both pins as input, internal use only */
+static void si2c_shadow(struct soft_i2c * bus)
+{
+	volatile uint32_t * gpsel = (uint32_t *)GPSEL;
+
+	__sync_synchronize();
+	bus->sda_shadow = gpsel[bus->sda_reg] & ~(7UL << bus->sda_shift) & ~(bus->sda_reg == bus->scl_reg ? 7UL << bus->scl_shift : 0);
+	bus->scl_shadow = gpsel[bus->scl_reg] & ~(7UL << bus->scl_shift) & ~(bus->sda_reg == bus->scl_reg ? 7UL << bus->sda_shift : 0);
+}
+
+/*
+ * Initialize a software I2C bus
+ * hz = SCL frequency (up to 400 kHz), stretch_us = clock stretch timeout in us
+ * Returns 1 on success
+ */
+int soft_i2c_init(struct soft_i2c * bus, uint8_t sda, uint8_t scl, uint32_t hz, uint32_t stretch_us)
+{
+	static uint32_t loops_per_ms = 0;
+	uint32_t half_ns;
+	int i;
+
+	if(sda > 31 || scl > 31 || sda == scl || hz == 0 || hz > 400000){
+		printf("%s() error: ", __func__);
+		puts("Invalid pin (GPIO 0 to 31) or frequency (up to 400 kHz).");
+		return 0;
+	}
+
+	if(loops_per_ms == 0){
+		loops_per_ms = si2c_calibrate();
+	}
+
+	memset(bus, 0, sizeof(*bus));
+	bus->sda_mask = 1UL << sda;
+	bus->scl_mask = 1UL << scl;
+	bus->sda_reg = sda / 10;
+	bus->scl_reg = scl / 10;
+	bus->sda_shift = (sda % 10) * 3;
+	bus->scl_shift = (scl % 10) * 3;
+	bus->sda_out = 1UL << bus->sda_shift;
+	bus->scl_out = 1UL << bus->scl_shift;
+	bus->stretch_us = stretch_us;
+
+	/* half of the SCL period, an eighth of it for the line rise and data hold times */
+	half_ns = (uint32_t)(500000000ULL / hz);
+	bus->half_us = half_ns / 1000;
+	bus->pad_loops = (uint32_t)((uint64_t)loops_per_ms * (half_ns % 1000) / 1000000);
+	bus->rise_loops = (uint32_t)((uint64_t)loops_per_ms * (half_ns / 8) / 1000000);
+
+	/* both lines released, output latches low */
+	*GPCLR = bus->sda_mask | bus->scl_mask;
+	si2c_shadow(bus);
+	si2c_lines(bus);
+
+	/* bus recovery: clock out a slave that holds SDA low after an aborted transfer */
+	for(i = 0; i < 9 && !(*GPLEV & bus->sda_mask); i++){
+		si2c_scl_low(bus);
+		si2c_half(bus);
+		si2c_scl_release(bus);
+		si2c_half(bus);
+	}
+	if(!(*GPLEV & bus->sda_mask) || !(*GPLEV & bus->scl_mask)){
+		printf("%s() error: ", __func__);
+		puts("SDA or SCL is held low, check the pull-up resistors.");
+		return 0;
+	}
+	return 1;
+}
+
+/* START or repeated START condition, internal use only */
+static int si2c_start(struct soft_i2c * bus)
+{
+	si2c_loop(bus->rise_loops);
+	si2c_sda(bus, 0);
+	si2c_half(bus);
+	if(!si2c_scl_release(bus)){
+		return 0;
+	}
+	si2c_half(bus);
+	si2c_sda(bus, 1);
+	si2c_mark(bus);
+	si2c_half(bus);
+	si2c_scl_low(bus);
+	return 1;
+}
+
+/* STOP condition, then the bus free time, internal use only */
+static int si2c_stop(struct soft_i2c * bus)
+{
+	int ok;
+
+	si2c_loop(bus->rise_loops);
+	si2c_sda(bus, 1);
+	si2c_half(bus);
+	ok = si2c_scl_release(bus);
+	si2c_half(bus);
+	si2c_sda(bus, 0);
+	si2c_mark(bus);
+	si2c_half(bus);
+	si2c_mark(bus);
+	si2c_half(bus);
+	return ok;
+}
+
+/*
+ * Shift one byte out (read = 0) or in (read = 1), internal use only
+ * The acknowledge bit is returned in *ack (0 = ACK) for a write, and sent
+ * from *ack for a read. Returns 0 on a clock stretch timeout.
+ */
+static int si2c_byte(struct soft_i2c * bus, uint8_t * byte, int read, int * ack)
+{
+	uint8_t in = 0;
+	int i, bit;
+
+	for(i = 0; i < 9; i++){
+		if(i < 8){
+			bit = read ? 1 : (*byte >> (7 - i)) & 1;
+		}
+		else{
+			bit = read ? *ack : 1;
+		}
+		/* SCL low half: data hold, new data bit */
+		si2c_loop(bus->rise_loops);
+		si2c_sda(bus, !bit);
+		si2c_half(bus);
+		if(!si2c_scl_release(bus)){
+			return 0;
+		}
+		/* SCL high half, SDA sampled at its end */
+		si2c_half(bus);
+		bit = (*GPLEV & bus->sda_mask) ? 1 : 0;
+		si2c_scl_low(bus);
+		if(i < 8){
+			in = (uint8_t)((in << 1) | bit);
+		}
+		else if(!read){
+			*ack = bit;
+		}
+	}
+	if(read){
+		*byte = in;
+	}
+	return 1;
+}
+
+/*
+ * Write then read a number of bytes to/from a slave device in one transaction,
+ * with a repeated start between the phases, like i2c_transfer()
+ * 0 = success, 1 = NACK, 2 = clock stretch timeout, 4 = incomplete transfer
+ */
+uint8_t soft_i2c_transfer(struct soft_i2c * bus, uint8_t addr, const char * wbuf, uint16_t wlen, char * rbuf, uint16_t rlen)
+{
+	uint8_t result = 0, b;
+	uint16_t i;
+	int ack = 1;
+
+	si2c_shadow(bus);
+
+	/* the bus must be idle */
+	if(!(*GPLEV & bus->sda_mask) || !(*GPLEV & bus->scl_mask)){
+		return 4;
+	}
+
+	if(wlen > 0 || rlen == 0){
+		b = (uint8_t)(addr << 1);
+		if(!si2c_start(bus) || !si2c_byte(bus, &b, 0, &ack)){
+			result = 2;
+			goto stop;
+		}
+		if(ack){
+			result = 1;
+			goto stop;
+		}
+		for(i = 0; i < wlen; i++){
+			b = (uint8_t)wbuf[i];
+			if(!si2c_byte(bus, &b, 0, &ack)){
+				result = 2;
+				goto stop;
+			}
+			if(ack){
+				result = 1;
+				goto stop;
+			}
+		}
+	}
+
+	if(rlen > 0){
+		b = (uint8_t)((addr << 1) | 1);
+		if(!si2c_start(bus) || !si2c_byte(bus, &b, 0, &ack)){
+			result = 2;
+			goto stop;
+		}
+		if(ack){
+			result = 1;
+			goto stop;
+		}
+		for(i = 0; i < rlen; i++){
+			ack = i + 1 == rlen;	/* NACK the last byte */
+			if(!si2c_byte(bus, &b, 1, &ack)){
+				result = 2;
+				goto stop;
+			}
+			rbuf[i] = (char)b;
+		}
+	}
+
+stop:
+	if(!si2c_stop(bus) && result == 0){
+		result = 2;
+	}
+	bus->sda_low = bus->scl_low = 0;
+	si2c_lines(bus);
+	return result;
+}
+
+/* Write a number of bytes to a slave device, returns the i2c_transfer() status */
+uint8_t soft_i2c_write(struct soft_i2c * bus, uint8_t addr, const char * wbuf, uint16_t len)
+{
+	return soft_i2c_transfer(bus, addr, wbuf, len, NULL, 0);
+}
+
+/* Read a number of bytes from a slave device, returns the i2c_transfer() status */
+uint8_t soft_i2c_read(struct soft_i2c * bus, uint8_t addr, char * rbuf, uint16_t len)
+{
+	return soft_i2c_transfer(bus, addr, NULL, 0, rbuf, len);
+}
+
+
+/*************************************
+
+	Software UART Functions
+
+**************************************/
+/*
+ * 8N1 software UART channels on any GPIO pins (0 to 31), up to 115200 baud,
+ * all served by one engine thread that busy-polls the system timer and GPLEV.
+ *
+ * TX: each byte taken from the channel's ring is compiled into a short list of
+ * line transitions (time offset, level) for its start, data and stop bits. Due
+ * transitions of all channels are merged into one GPSET and one GPCLR store.
+ *
+ * RX: the level of every RX pin is timestamped with the system timer on each
+ * poll. A falling edge on an idle line starts a frame, and each bit takes the
+ * level the line had at the centre of its bit time. A frame whose start bit is
+ * not low or whose stop bit is not high counts as a framing error.
+ *
+ * The engine keeps one CPU busy while any channel is open.
+ */
+#define SUART_MAX	8
+
+struct suart {
+	atomic_int state;		/* 0 = free, 1 = open, 2 = closing */
+	uint8_t tx, rx;
+	uint32_t tx_mask;
+	uint32_t rx_mask;
+	uint32_t bit_q8;		/* bit time in 1/256 us */
+	struct ring txr;
+	struct ring rxr;
+
+	/* transmitter, current compiled frame */
+	uint64_t tx_t0;			/* frame start, us */
+	uint64_t tx_free;		/* end of the stop bit, us */
+	uint32_t tx_at[10];		/* transition offsets, us */
+	uint8_t tx_lvl[10];
+	uint8_t tx_n, tx_i;
+
+	/* receiver */
+	uint64_t rx_t0;			/* start bit falling edge, us */
+	uint16_t rx_bits;
+	uint8_t rx_k;			/* no. of bits decoded */
+	uint8_t rx_busy;
+	uint8_t rx_lvl;			/* last polled level */
+
+	_Atomic uint64_t tx_bytes;
+	_Atomic uint64_t rx_bytes;
+	_Atomic uint32_t framing_errors;
+	_Atomic uint32_t rx_dropped;
+};
+
+static struct suart suart[SUART_MAX];
+static pthread_mutex_t suart_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t suart_thread;
+static atomic_int suart_running = 0;
+static int suart_open_count = 0;
+
+/* Compile one byte into line transitions starting at t0, internal use only */
+static void suart_compile(struct suart *u, uint8_t byte, uint64_t t0)
+{
+	uint32_t frame = 0x200 | ((uint32_t)byte << 1);	// start 0, data LSB first, stop 1
+	uint8_t level, prev = 1;
+	int k;
+
+	u->tx_n = 0;
+	for(k = 0; k < 10; k++){
+		level = (frame >> k) & 1;
+		if(level != prev){
+			u->tx_at[u->tx_n] = (uint32_t)(((uint64_t)k * u->bit_q8 + 128) >> 8);
+			u->tx_lvl[u->tx_n] = level;
+			u->tx_n++;
+			prev = level;
+		}
+	}
+	u->tx_i = 0;
+	u->tx_t0 = t0;
+	u->tx_free = t0 + (((uint64_t)10 * u->bit_q8 + 255) >> 8);
+}
+
+/* Decode the RX line level polled at time now, internal use only */
+static void suart_rx(struct suart *u, uint8_t level, uint64_t now)
+{
+	uint8_t byte;
+
+	if(u->rx_busy){
+		/* bits whose centre has passed had the level seen before this poll */
+		while(u->rx_k < 10 && (u->rx_t0 << 8) + (((uint64_t)2 * u->rx_k + 1) * u->bit_q8 >> 1) <= (now << 8)){
+			if(u->rx_lvl){
+				u->rx_bits |= 1 << u->rx_k;
+			}
+			u->rx_k++;
+		}
+		if(u->rx_k == 10){
+			if(!(u->rx_bits & 1) && (u->rx_bits & 0x200)){
+				byte = (u->rx_bits >> 1) & 0xFF;
+				if(ring_write(&u->rxr, &byte, 1) == 1){
+					atomic_fetch_add_explicit(&u->rx_bytes, 1, memory_order_relaxed);
+				}
+				else{
+					atomic_fetch_add_explicit(&u->rx_dropped, 1, memory_order_relaxed);
+				}
+			}
+			else{
+				atomic_fetch_add_explicit(&u->framing_errors, 1, memory_order_relaxed);
+			}
+			u->rx_busy = 0;
+		}
+	}
+
+	/* falling edge on an idle line, start bit */
+	if(!u->rx_busy && u->rx_lvl && !level){
+		u->rx_busy = 1;
+		u->rx_t0 = now;
+		u->rx_bits = 0;
+		u->rx_k = 0;
+	}
+	u->rx_lvl = level;
+}
+
+/* Software UART engine thread */
+static void *suart_engine(void *arg)
+{
+	uint32_t set, clr, lev;
+	uint64_t now;
+	uint8_t byte;
+	int i, state;
+
+	(void)arg;
+
+	while(atomic_load_explicit(&suart_running, memory_order_relaxed)){
+
+		set = clr = 0;
+		now = st_read();
+		lev = *GPLEV;
+
+		for(i = 0; i < SUART_MAX; i++){
+			struct suart *u = &suart[i];
+
+			state = atomic_load_explicit(&u->state, memory_order_acquire);
+			if(state == 0){
+				continue;
+			}
+			if(state == 2){
+				/* leave the TX line idle and acknowledge the close */
+				set |= u->tx_mask;
+				atomic_store_explicit(&u->state, 0, memory_order_release);
+				continue;
+			}
+
+			if(u->tx_mask){
+				if(u->tx_i == u->tx_n && ring_read(&u->txr, &byte, 1) == 1){
+					suart_compile(u, byte, u->tx_free > now ? u->tx_free : now);
+					atomic_fetch_add_explicit(&u->tx_bytes, 1, memory_order_relaxed);
+				}
+				while(u->tx_i < u->tx_n && now >= u->tx_t0 + u->tx_at[u->tx_i]){
+					if(u->tx_lvl[u->tx_i]){
+						set |= u->tx_mask;
+					}
+					else{
+						clr |= u->tx_mask;
+					}
+					u->tx_i++;
+				}
+			}
+
+			if(u->rx_mask){
+				suart_rx(u, (lev & u->rx_mask) ? 1 : 0, now);
+			}
+		}
+
+		if(set){
+			*GPSET = set;
+		}
+		if(clr){
+			*GPCLR = clr;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Open a software UART channel, 8N1
+ * tx, rx = GPIO pins, SOFT_UART_NONE for a receive or transmit only channel
+ * baud = up to 115200
+ * Returns the channel no. (0 to 7), or -1 on failure
+ */
+int soft_uart_open(uint8_t tx, uint8_t rx, uint32_t baud)
+{
+	struct suart *u = NULL;
+	int ch;
+
+	if((tx > 31 && tx != SOFT_UART_NONE) || (rx > 31 && rx != SOFT_UART_NONE) || tx == rx
+	   || baud < 300 || baud > 115200){
+		printf("%s() error: ", __func__);
+		puts("Invalid pin (GPIO 0 to 31) or baud rate (300 to 115200).");
+		return -1;
+	}
+
+	pthread_mutex_lock(&suart_lock);
+
+	for(ch = 0; ch < SUART_MAX; ch++){
+		if(atomic_load(&suart[ch].state) == 0){
+			u = &suart[ch];
+			break;
+		}
+	}
+	if(u == NULL){
+		pthread_mutex_unlock(&suart_lock);
+		printf("%s() error: ", __func__);
+		puts("All software UART channels are in use.");
+		return -1;
+	}
+
+	/* reset the transmitter, receiver and counters, the ring user counts must survive */
+	u->tx_mask = 0;
+	u->rx_mask = 0;
+	memset(&u->tx_t0, 0, sizeof(*u) - offsetof(struct suart, tx_t0));
+	if(!ring_init(&u->txr, 4096, 1) || !ring_init(&u->rxr, 4096, 1)){
+		ring_free(&u->txr);
+		pthread_mutex_unlock(&suart_lock);
+		perror("soft_uart_open() error");
+		return -1;
+	}
+
+	u->tx = tx;
+	u->rx = rx;
+	u->bit_q8 = (uint32_t)((256ULL * 1000000 + baud / 2) / baud);
+	u->tx_free = st_read();
+
+	if(tx != SOFT_UART_NONE){
+		u->tx_mask = 1UL << tx;
+		*GPSET = u->tx_mask;	// idle high
+		gpio_output(tx);
+	}
+	if(rx != SOFT_UART_NONE){
+		u->rx_mask = 1UL << rx;
+		gpio_input(rx);
+		u->rx_lvl = (*GPLEV & u->rx_mask) ? 1 : 0;
+	}
+	atomic_store_explicit(&u->state, 1, memory_order_release);
+
+	if(suart_open_count++ == 0){
+		atomic_store(&suart_running, 1);
+		if(pthread_create(&suart_thread, NULL, suart_engine, NULL) != 0){
+			perror("pthread_create() error");
+			atomic_store(&suart_running, 0);
+			atomic_store(&u->state, 0);
+			suart_open_count--;
+			ring_free(&u->txr);
+			ring_free(&u->rxr);
+			pthread_mutex_unlock(&suart_lock);
+			return -1;
+		}
+	}
+
+	pthread_mutex_unlock(&suart_lock);
+	return ch;
+}
+
+/*
+ * Close a software UART channel, pending TX bytes are discarded
+ * May be called while another thread is in soft_uart_read() or soft_uart_write() on the channel
+ */
+void soft_uart_close(int ch)
+{
+	struct suart *u;
+
+	if(ch < 0 || ch >= SUART_MAX){
+		return;
+	}
+	u = &suart[ch];
+
+	pthread_mutex_lock(&suart_lock);
+
+	if(atomic_load(&u->state) != 1){
+		pthread_mutex_unlock(&suart_lock);
+		return;
+	}
+
+	/* wait for the engine to let go of the channel */
+	atomic_store(&u->state, 2);
+	while(atomic_load(&u->state) != 0){
+		uswait(10);
+	}
+
+	if(--suart_open_count == 0){
+		atomic_store(&suart_running, 0);
+		pthread_join(suart_thread, NULL);
+	}
+
+	ring_retire(&u->txr);
+	ring_retire(&u->rxr);
+	if(u->tx_mask){
+		gpio_input(u->tx);
+	}
+
+	pthread_mutex_unlock(&suart_lock);
+}
+
+/* Queue bytes for transmission, returns the no. of bytes queued */
+size_t soft_uart_write(int ch, const uint8_t * buf, size_t len)
+{
+	size_t n;
+
+	if(ch < 0 || ch >= SUART_MAX || !ring_enter(&suart[ch].txr, &suart[ch].state)){
+		return 0;
+	}
+	n = suart[ch].tx_mask ? ring_write(&suart[ch].txr, buf, len > UINT32_MAX ? UINT32_MAX : (uint32_t)len) : 0;
+	ring_leave(&suart[ch].txr);
+	return n;
+}
+
+/* Read up to len received bytes, returns the no. of bytes read */
+size_t soft_uart_read(int ch, uint8_t * buf, size_t len)
+{
+	size_t n;
+
+	if(ch < 0 || ch >= SUART_MAX || !ring_enter(&suart[ch].rxr, &suart[ch].state)){
+		return 0;
+	}
+	n = ring_read(&suart[ch].rxr, buf, len > UINT32_MAX ? UINT32_MAX : (uint32_t)len);
+	ring_leave(&suart[ch].rxr);
+	return n;
+}
+
+/*
+ * Get the channel counters
+ * framing_errors = frames with a bad start or stop bit,
+ * dropped = received bytes lost because the RX ring was full
+ */
+void soft_uart_stats(int ch, uint64_t * tx_bytes, uint64_t * rx_bytes, uint32_t * framing_errors, uint32_t * dropped)
+{
+	if(ch < 0 || ch >= SUART_MAX){
+		return;
+	}
+	if(tx_bytes){
+		*tx_bytes = atomic_load(&suart[ch].tx_bytes);
+	}
+	if(rx_bytes){
+		*rx_bytes = atomic_load(&suart[ch].rx_bytes);
+	}
+	if(framing_errors){
+		*framing_errors = atomic_load(&suart[ch].framing_errors);
+	}
+	if(dropped){
+		*dropped = atomic_load(&suart[ch].rx_dropped);
+	}
+}
+
+
+/*************************************
+
+	Batched Command Functions
+
+**************************************/
+/*
+ * One batch carries many GPIO, PWM, I2C and SPI operations, the same format is
+ * used by the peripheral daemon, the socket server and the command line tool.
+ * I2C and SPI are started on first use, SPI chip selects get their own device
+ * handle so mode and speed can differ per command.
+ */
+static int exec_i2c_on = 0;
+static int exec_spi_on = 0;
+static int exec_pwm_clk = 0;
+static struct spi_device exec_spi_dev[2];
+static uint32_t exec_spi_hz[2] = { 0, 0 };
+static uint8_t exec_spi_mode[2] = { 0xFF, 0xFF };
+
+/* Run one command, returns its status, internal use only */
+static uint16_t rpi_exec_one(struct rpi_cmd * c, uint8_t * data, uint32_t dlen)
+{
+	uint32_t hz;
+	uint8_t cs;
+
+	if((uint64_t)c->doff + c->wlen + c->rlen > dlen){
+		return RPI_ERR_INVALID;
+	}
+
+	switch(c->op){
+	case RPI_OP_NOP:
+		return 0;
+
+	case RPI_OP_GPIO_MODE:
+		if(c->pin > 53 || c->arg0 > 7){
+			return RPI_ERR_INVALID;
+		}
+		gpio_config(c->pin, (uint8_t)c->arg0);
+		return 0;
+
+	case RPI_OP_GPIO_PULL:
+		if(c->pin > 31 || c->arg0 > 2){
+			return RPI_ERR_INVALID;
+		}
+		gpio_enable_pud(c->pin, (uint8_t)c->arg0);
+		return 0;
+
+	case RPI_OP_GPIO_WRITE:
+		gpio_write_mask(c->arg0, c->arg1);
+		return 0;
+
+	case RPI_OP_GPIO_READ:
+		c->result = gpio_read_all();
+		return 0;
+
+	case RPI_OP_PWM:
+		if(c->pin != 12 && c->pin != 13 && c->pin != 18 && c->pin != 19){
+			return RPI_ERR_INVALID;
+		}
+		if(c->arg0 == 0){
+			pwm_reset_pin(c->pin);
+			return 0;
+		}
+		if(!exec_pwm_clk){
+			pwm_set_clock_freq(192);
+			exec_pwm_clk = 1;
+		}
+		pwm_set_pin(c->pin);
+		pwm_enable(c->pin, 1);
+		pwm_set_mode(c->pin, 1);
+		pwm_set_range(c->pin, c->arg0);
+		pwm_set_data(c->pin, c->arg1);
+		return 0;
+
+	case RPI_OP_I2C:
+		if(c->pin > 0x7F){
+			return RPI_ERR_INVALID;
+		}
+		if(!exec_i2c_on){
+			i2c_start();
+			exec_i2c_on = 1;
+		}
+		if(c->arg0 && c->arg0 != i2c_get_speed()){
+			i2c_set_speed(c->arg0, 0x40);
+		}
+		return i2c_transfer(c->pin, (const char *)data + c->doff, c->wlen, (char *)data + c->doff + c->wlen, c->rlen);
+
+	case RPI_OP_SPI:
+		cs = c->pin;
+		if(cs > 1 || c->arg0 > 3){
+			return RPI_ERR_INVALID;
+		}
+		if(!exec_spi_on){
+			spi_start();
+			exec_spi_on = 1;
+		}
+		hz = c->arg1 ? c->arg1 : 1000000;
+		if(exec_spi_mode[cs] != c->arg0){
+			spi_device_init(&exec_spi_dev[cs], cs, (uint8_t)c->arg0, 0, 256);
+			exec_spi_mode[cs] = (uint8_t)c->arg0;
+			exec_spi_hz[cs] = 0;
+		}
+		if(exec_spi_hz[cs] != hz){
+			spi_device_set_speed(&exec_spi_dev[cs], hz);
+			exec_spi_hz[cs] = hz;
+		}
+		spi_device_transfer(&exec_spi_dev[cs], (const char *)data + c->doff, (char *)data + c->doff, c->wlen);
+		return 0;
+
+	case RPI_OP_WAIT:
+		if(c->arg0 >= 1000){
+			mswait(c->arg0 / 1000);
+		}
+		uswait(c->arg0 % 1000);
+		return 0;
+
+	default:
+		return RPI_ERR_INVALID;
+	}
+}
+
+/*
+ * Execute a batch of commands in order
+ * data = buffer the I2C/SPI commands write from and read into (see struct rpi_cmd)
+ * Returns the no. of commands that completed with status 0
+ */
+uint32_t rpi_exec(struct rpi_cmd * cmd, uint32_t n, uint8_t * data, uint32_t dlen)
+{
+	uint32_t i, ok = 0;
+
+	for(i = 0; i < n; i++){
+		cmd[i].status = rpi_exec_one(&cmd[i], data, dlen);
+		ok += cmd[i].status == 0;
+	}
+	return ok;
+}
+
+
+/*************************************
+
+	Peripheral Daemon Functions
+
+**************************************/
+/*
+ * A single process (rpid) owns the peripherals and runs the commands of all
+ * clients, so their GPFSEL/CTL read-modify-writes can no longer interleave.
+ *
+ * The daemon creates the shared memory object /rpid with RPID_SLOTS client
+ * slots. A client claims a free slot by writing its pid, and then owns two
+ * single producer/single consumer rings in it: requests to the daemon and
+ * responses back. A message is a 4 byte length followed by a struct rpi_batch,
+ * its commands and its data. Clients ring the shared doorbell futex after
+ * posting a request, the daemon bumps the slot's response futex after
+ * answering. Both sides spin briefly before sleeping on the futex, so a round
+ * trip has no socket or pipe system calls.
+ *
+ * Each request carries a sequence number that the reply echoes, so a client
+ * drops late replies to requests it has given up on. Only the daemon frees a
+ * slot: rpi_client_close() marks it closing, and once a second the daemon also
+ * reclaims the slots of clients that exited without closing. A client must not
+ * use its connection from several threads.
+ */
+#define RPID_SHM	"/rpid"
+#define RPID_MAGIC	0x52504944	// "RPID"
+#define RPID_SLOTS	16
+#define RPID_RING_SIZE	65536
+#define RPID_MSG_MAX	(RPID_RING_SIZE / 2)
+#define RPID_SPIN	2000
+
+struct shm_ring {
+	_Atomic uint32_t head;		/* bytes written, free running */
+	_Atomic uint32_t tail;		/* bytes read, free running */
+	_Atomic uint32_t seq;		/* futex, bumped on each new message */
+	uint32_t pad;
+	uint8_t data[RPID_RING_SIZE];
+};
+
+struct rpid_slot {
+	_Atomic uint32_t pid;		/* owner, 0 = free */
+	_Atomic uint32_t closing;	/* set by the owner, the daemon frees the slot */
+	uint32_t pad[2];
+	struct shm_ring req;
+	struct shm_ring resp;
+};
+
+struct rpid_shm {
+	uint32_t magic;
+	uint32_t size;
+	_Atomic uint32_t doorbell;	/* futex, bumped on each request */
+	_Atomic uint32_t running;
+	_Atomic uint32_t pid;		/* daemon process */
+	struct rpid_slot slot[RPID_SLOTS];
+};
+
+static struct rpid_shm *rpid = NULL;
+static struct rpid_slot *client_slot = NULL;
+static uint8_t *client_buf = NULL;
+static uint32_t client_seq = 0;
+
+/* futex on a process shared word, internal use only */
+static long rpid_futex(_Atomic uint32_t *addr, int op, uint32_t val, const struct timespec *ts)
+{
+	return syscall(SYS_futex, (uint32_t *)addr, op, val, ts, NULL, 0);
+}
+
+/* Copy into/out of the ring at a free running position, internal use only */
+static void shm_ring_in(struct shm_ring *r, uint32_t pos, const void *src, uint32_t n)
+{
+	uint32_t off = pos % RPID_RING_SIZE;
+	uint32_t first = n < RPID_RING_SIZE - off ? n : RPID_RING_SIZE - off;
+
+	memcpy(r->data + off, src, first);
+	memcpy(r->data, (const uint8_t *)src + first, n - first);
+}
+
+static void shm_ring_out(const struct shm_ring *r, uint32_t pos, void *dst, uint32_t n)
+{
+	uint32_t off = pos % RPID_RING_SIZE;
+	uint32_t first = n < RPID_RING_SIZE - off ? n : RPID_RING_SIZE - off;
+
+	memcpy(dst, r->data + off, first);
+	memcpy((uint8_t *)dst + first, r->data, n - first);
+}
+
+/* Post a message made of three parts, returns 0 if it does not fit, internal use only */
+static int shm_ring_put(struct shm_ring *r, const void *a, uint32_t la, const void *b, uint32_t lb, const void *c, uint32_t lc)
+{
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	uint32_t len = la + lb + lc;
+
+	if(len > RPID_MSG_MAX || 4 + len > RPID_RING_SIZE - (head - tail)){
+		return 0;
+	}
+	shm_ring_in(r, head, &len, 4);
+	shm_ring_in(r, head + 4, a, la);
+	shm_ring_in(r, head + 4 + la, b, lb);
+	shm_ring_in(r, head + 4 + la + lb, c, lc);
+	atomic_store_explicit(&r->head, head + 4 + len, memory_order_release);
+	return 1;
+}
+
+/* Take the next message, returns its length, 0 if none, internal use only */
+static uint32_t shm_ring_get(struct shm_ring *r, uint8_t *buf)
+{
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+	uint32_t len;
+
+	if(head == tail){
+		return 0;
+	}
+	shm_ring_out(r, tail, &len, 4);
+	if(len > RPID_MSG_MAX || len > head - tail - 4){
+		/* corrupted by a misbehaving client, drop everything */
+		atomic_store_explicit(&r->tail, head, memory_order_release);
+		return 0;
+	}
+	shm_ring_out(r, tail + 4, buf, len);
+	atomic_store_explicit(&r->tail, tail + 4 + len, memory_order_release);
+	return len;
+}
+
+/* Check a batch message and locate its parts, returns 1 if valid, internal use only */
+static int rpi_batch_parse(uint8_t *msg, uint32_t len, struct rpi_cmd **cmd, uint8_t **data)
+{
+	struct rpi_batch *b = (struct rpi_batch *)msg;
+
+	if(len < sizeof(*b) || b->ncmd > (len - sizeof(*b)) / sizeof(struct rpi_cmd)
+	   || b->dlen != len - sizeof(*b) - b->ncmd * sizeof(struct rpi_cmd)){
+		return 0;
+	}
+	*cmd = (struct rpi_cmd *)(msg + sizeof(*b));
+	*data = msg + sizeof(*b) + b->ncmd * sizeof(struct rpi_cmd);
+	return 1;
+}
+
+/* Ask a running rpid_serve() to return, async-signal-safe */
+void rpid_stop(void)
+{
+	if(rpid){
+		atomic_store(&rpid->running, 0);
+		atomic_fetch_add(&rpid->doorbell, 1);
+		rpid_futex(&rpid->doorbell, FUTEX_WAKE, 1, NULL);
+	}
+}
+
+/* Free a slot and its rings, daemon side only */
+static void rpid_slot_free(struct rpid_slot *s)
+{
+	atomic_store(&s->closing, 0);
+	atomic_store(&s->req.head, 0);
+	atomic_store(&s->req.tail, 0);
+	atomic_store(&s->resp.head, 0);
+	atomic_store(&s->resp.tail, 0);
+	atomic_store_explicit(&s->pid, 0, memory_order_release);
+}
+
+/*
+ * Run the peripheral daemon until rpid_stop(), rpi_init() must be called first.
+ * mode = permissions of the shared memory object, e.g. 0660 for the owner group
+ * Returns 1 on a clean exit, 0 on failure
+ */
+int rpid_serve(mode_t mode)
+{
+	static uint8_t msg[RPID_MSG_MAX];
+	struct timespec idle = { 1, 0 };
+	struct rpi_cmd *cmd;
+	uint8_t *data;
+	uint32_t bell, len, pid, seq;
+	time_t now, reaped;
+	int fd, i, work;
+
+	shm_unlink(RPID_SHM);
+	fd = shm_open(RPID_SHM, O_CREAT | O_EXCL | O_RDWR, mode);
+	if(fd < 0 || fchmod(fd, mode) < 0 || ftruncate(fd, sizeof(struct rpid_shm)) < 0){
+		perror("rpid_serve() error");
+		if(fd >= 0){
+			close(fd);
+		}
+		return 0;
+	}
+	rpid = mmap(NULL, sizeof(struct rpid_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(rpid == MAP_FAILED){
+		perror("rpid_serve() error");
+		rpid = NULL;
+		shm_unlink(RPID_SHM);
+		return 0;
+	}
+	memset(rpid, 0, sizeof(*rpid));
+	rpid->size = sizeof(*rpid);
+	atomic_store(&rpid->pid, (uint32_t)getpid());
+	atomic_store(&rpid->running, 1);
+	__sync_synchronize();
+	rpid->magic = RPID_MAGIC;
+	reaped = time(NULL);
+
+	while(atomic_load(&rpid->running)){
+
+		bell = atomic_load_explicit(&rpid->doorbell, memory_order_acquire);
+		work = 0;
+
+		for(i = 0; i < RPID_SLOTS; i++){
+			struct rpid_slot *s = &rpid->slot[i];
+
+			if(atomic_load_explicit(&s->pid, memory_order_acquire) == 0){
+				continue;
+			}
+			if(atomic_load_explicit(&s->closing, memory_order_acquire)){
+				rpid_slot_free(s);
+				continue;
+			}
+			while((len = shm_ring_get(&s->req, msg)) > 0){
+				if(rpi_batch_parse(msg, len, &cmd, &data)){
+					rpi_exec(cmd, ((struct rpi_batch *)msg)->ncmd, data, ((struct rpi_batch *)msg)->dlen);
+				}
+				else{
+					/* invalid batch, answered with an empty one */
+					seq = len >= sizeof(struct rpi_batch) ? ((struct rpi_batch *)msg)->seq : 0;
+					memset(msg, 0, sizeof(struct rpi_batch));
+					((struct rpi_batch *)msg)->seq = seq;
+					len = sizeof(struct rpi_batch);
+				}
+				shm_ring_put(&s->resp, msg, len, NULL, 0, NULL, 0);
+				atomic_fetch_add_explicit(&s->resp.seq, 1, memory_order_release);
+				rpid_futex(&s->resp.seq, FUTEX_WAKE, 1, NULL);
+				work = 1;
+			}
+		}
+
+		/* reclaim the slots of dead clients once a second, busy or not */
+		now = time(NULL);
+		if(now != reaped){
+			reaped = now;
+			for(i = 0; i < RPID_SLOTS; i++){
+				pid = atomic_load(&rpid->slot[i].pid);
+				if(pid && kill((pid_t)pid, 0) < 0 && errno == ESRCH){
+					rpid_slot_free(&rpid->slot[i]);
+				}
+			}
+		}
+		if(work){
+			continue;
+		}
+
+		/* idle: sleep on the doorbell */
+		rpid_futex(&rpid->doorbell, FUTEX_WAIT, bell, &idle);
+	}
+
+	rpid->magic = 0;
+	munmap(rpid, sizeof(*rpid));
+	rpid = NULL;
+	shm_unlink(RPID_SHM);
+	return 1;
+}
+
+/*
+ * Connect to the peripheral daemon, instead of rpi_init()
+ * Returns 1 on success
+ */
+int rpi_client_open(void)
+{
+	struct stat st;
+	uint32_t free_pid;
+	int fd, i;
+
+	if(client_slot){
+		return 1;
+	}
+	fd = shm_open(RPID_SHM, O_RDWR, 0);
+	if(fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct rpid_shm)){
+		perror("rpi_client_open() error");
+		puts("Is rpid running?");
+		if(fd >= 0){
+			close(fd);
+		}
+		return 0;
+	}
+	rpid = mmap(NULL, sizeof(struct rpid_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(rpid == MAP_FAILED || rpid->magic != RPID_MAGIC){
+		printf("%s() error: ", __func__);
+		puts("Invalid rpid shared memory.");
+		if(rpid != MAP_FAILED){
+			munmap(rpid, sizeof(struct rpid_shm));
+		}
+		rpid = NULL;
+		return 0;
+	}
+
+	for(i = 0; i < RPID_SLOTS && client_slot == NULL; i++){
+		free_pid = 0;
+		if(atomic_compare_exchange_strong(&rpid->slot[i].pid, &free_pid, (uint32_t)getpid())){
+			client_slot = &rpid->slot[i];
+		}
+	}
+	client_buf = malloc(RPID_MSG_MAX);
+	if(client_slot == NULL || client_buf == NULL){
+		printf("%s() error: ", __func__);
+		puts("No free rpid client slot.");
+		rpi_client_close();
+		return 0;
+	}
+	return 1;
+}
+
+/* Disconnect from the peripheral daemon */
+void rpi_client_close(void)
+{
+	if(client_slot){
+		/* the daemon frees the slot, so no late reply can land in a new owner's ring */
+		atomic_store_explicit(&client_slot->closing, 1, memory_order_release);
+		atomic_fetch_add_explicit(&rpid->doorbell, 1, memory_order_release);
+		rpid_futex(&rpid->doorbell, FUTEX_WAKE, 1, NULL);
+		client_slot = NULL;
+	}
+	free(client_buf);
+	client_buf = NULL;
+	if(rpid){
+		munmap(rpid, sizeof(struct rpid_shm));
+		rpid = NULL;
+	}
+}
+
+/* Daemon still serving, client side only */
+static int rpid_alive(void)
+{
+	pid_t pid = (pid_t)atomic_load(&rpid->pid);
+
+	return rpid->magic == RPID_MAGIC && atomic_load(&rpid->running)
+	       && pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+/*
+ * Execute a batch of commands in the daemon, like rpi_exec()
+ * The results, statuses and read data are copied back into cmd and data.
+ * Waits as long as the daemon is alive, so long RPI_OP_WAIT or bus transfers are fine.
+ * Returns the no. of commands that completed with status 0, -1 on failure
+ */
+int rpi_client_exec(struct rpi_cmd * cmd, uint32_t n, uint8_t * data, uint32_t dlen)
+{
+	struct rpi_batch b = { n, dlen, 0 };
+	struct timespec ts = { 2, 0 };
+	struct rpi_cmd *rcmd;
+	uint8_t *rdata;
+	uint32_t seq, len = 0, i, ok = 0;
+	int spin;
+
+	if(client_slot == NULL){
+		return -1;
+	}
+	/* never 0, which the daemon uses for replies to unreadable requests */
+	if(++client_seq == 0){
+		client_seq = 1;
+	}
+	b.seq = client_seq;
+
+	seq = atomic_load_explicit(&client_slot->resp.seq, memory_order_acquire);
+	if(!shm_ring_put(&client_slot->req, &b, sizeof(b), cmd, n * sizeof(*cmd), data, dlen)){
+		printf("%s() error: ", __func__);
+		puts("Batch too large.");
+		return -1;
+	}
+	atomic_fetch_add_explicit(&rpid->doorbell, 1, memory_order_release);
+	rpid_futex(&rpid->doorbell, FUTEX_WAKE, 1, NULL);
+
+	/*
+	 * Spin for a fast answer, then sleep until the daemon bumps the response futex,
+	 * checking every 2 s that the daemon has not gone away.
+	 * Late replies to earlier requests that failed are dropped.
+	 */
+	for(spin = 0; (len = shm_ring_get(&client_slot->resp, client_buf)) == 0
+	    || len < sizeof(struct rpi_batch) || ((struct rpi_batch *)client_buf)->seq != client_seq; spin++){
+		if(len > 0){
+			continue;
+		}
+		if(spin < RPID_SPIN){
+			continue;
+		}
+		if(rpid_futex(&client_slot->resp.seq, FUTEX_WAIT, seq, &ts) < 0 && errno == ETIMEDOUT && !rpid_alive()){
+			printf("%s() error: ", __func__);
+			puts("No answer from rpid.");
+			return -1;
+		}
+		seq = atomic_load_explicit(&client_slot->resp.seq, memory_order_acquire);
+	}
+
+	if(!rpi_batch_parse(client_buf, len, &rcmd, &rdata) || ((struct rpi_batch *)client_buf)->ncmd != n){
+		return -1;
+	}
+	for(i = 0; i < n; i++){
+		cmd[i] = rcmd[i];
+		ok += cmd[i].status == 0;
+	}
+	memcpy(data, rdata, dlen);
+	return (int)ok;
+}
@@ -22,6 +22,8 @@
 #define RPI_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
 
 #define RPI_VERSION 100 /* Version 1.00 */
 
@@ -40,6 +42,11 @@ extern void rpi_init();
 ************************/
 extern uint8_t rpi_close();
 
+/* Core clock frequency in Hz */
+extern uint32_t rpi_core_clock(void);
+
+extern uint32_t rpi_core_clock_refresh(void);
+
 /*********************
      Time Delays
 **********************/
@@ -54,6 +61,8 @@ extern void mswait(uint32_t ms);  //millisecond time delay
 **********************/
 extern void gpio_config(uint8_t pin, uint8_t mode);
 
+extern uint8_t gpio_get_config(uint8_t pin);
+
 extern void gpio_input(uint8_t pin);
 
 extern void gpio_output(uint8_t pin);
@@ -62,6 +71,10 @@ extern uint8_t gpio_write(uint8_t pin, uint8_t bit);
 
 extern uint8_t gpio_read(uint8_t pin);
 
+extern void gpio_write_mask(uint32_t mask, uint32_t value);
+
+extern uint32_t gpio_read_all(void);
+
 extern void gpio_reset_all_events(uint8_t pin);
 
 extern void gpio_enable_high_event(uint8_t pin, uint8_t bit);
@@ -108,6 +121,16 @@ extern void pwm_set_range(uint8_t pin, uint32_t range);
 /*********************
  	I2C
 **********************/
+/* One write/read transaction for i2c_batch() */
+struct i2c_xfer {
+	uint8_t addr;
+	const char * wbuf;
+	uint16_t wlen;
+	char * rbuf;
+	uint16_t rlen;
+	uint8_t status;
+};
+
 extern int i2c_start();
 
 extern void i2c_stop();
@@ -118,33 +141,427 @@ extern void i2c_set_clock_freq(uint16_t divider);
 
 extern void i2c_data_transfer_speed(uint32_t baud);
 
+extern uint32_t i2c_set_speed(uint32_t hz, uint16_t clkt);
+
+extern uint32_t i2c_get_speed(void);
+
 extern uint8_t i2c_write(const char * wbuf, uint8_t len);
 
 extern uint8_t i2c_read(char * rbuf, uint8_t len);
 
 extern uint8_t i2c_byte_read(void);
 
+extern uint8_t i2c_transfer(uint8_t addr, const char * wbuf, uint16_t wlen, char * rbuf, uint16_t rlen);
+
+extern unsigned i2c_batch(struct i2c_xfer * x, unsigned n);
+
+/* Kernel /dev/i2c-N backend */
+extern int i2c_open_dev(uint8_t bus);
+
+extern void i2c_close_dev(void);
+
+/* I2C transaction scheduler */
+extern int i2c_sched_init(uint32_t scl_hz, uint8_t max_load);
+
+extern int i2c_sched_add(uint8_t addr, uint32_t period_us, const char * wbuf, uint8_t wlen, uint8_t rlen,
+			 void (*cb)(int id, const char *rbuf, uint8_t len, uint8_t status, void *arg), void *arg);
+
+extern uint32_t i2c_sched_load(void);
+
+extern void i2c_sched_run(uint32_t duration_ms);
+
+extern void i2c_sched_stop(void);
+
+extern uint32_t i2c_sched_misses(int id);
+
+extern uint32_t i2c_sched_errors(int id);
+
+extern uint32_t i2c_sched_jitter(int id);
+
+/* I2C slave (BSC/SPI slave peripheral) */
+extern int i2c_slave_start(uint8_t addr, void (*on_write)(uint8_t reg, const uint8_t *data, uint8_t len));
+
+extern void i2c_slave_stop(void);
+
+extern void i2c_slave_update(uint8_t reg, const uint8_t *values, uint16_t len);
+
 /********************
 	SPI
 *********************/
+/* SPI device handle, see spi_device_init() */
+#define SPI_CS_HW	0xFF	/* hardware chip select (CE0-CE2) */
+
+struct spi_device {
+	uint8_t bus;		/* 0 = SPI0, 1 = SPI1, 2 = SPI2 */
+	uint8_t cs;
+	uint8_t mode;
+	uint8_t cspol;
+	uint16_t divider;
+	uint32_t cs_reg;	/* precomputed SPI_CS (SPI1/SPI2 CNTL0) value */
+	uint32_t clk_reg;	/* precomputed SPI_CLK value */
+	uint32_t speed_hz;	/* requested speed, 0 if set as a divider */
+	uint32_t clk_gen;	/* core clock the divider was computed for */
+	uint8_t cs_gpio;	/* GPIO chip select pin, SPI_CS_HW for CE0-CE2 */
+	uint32_t cs_mask;	/* GPIO chip select pin mask */
+	uint16_t cs_setup_ns;
+	uint16_t cs_hold_ns;
+};
+
 extern int spi_start();
 
 extern void spi_stop();
 
 extern void spi_set_clock_freq(uint16_t divider);
 
+extern uint32_t spi_set_speed_hz(uint32_t hz);
+
 extern void spi_set_data_mode(uint8_t mode);
 
 extern void spi_set_chip_select_polarity(uint8_t cs, uint8_t active);
 
 extern void spi_chip_select(uint8_t cs);
 
-extern void spi_data_transfer(char* wbuf, char* rbuf, uint8_t len);
+extern void spi_data_transfer(const char* wbuf, char* rbuf, size_t len);
 
-extern void spi_write(char* wbuf, uint8_t len);
+extern void spi_write(const char* wbuf, uint8_t len);
 
 extern void spi_read(char* rbuf, uint8_t len);
 
+extern void spi_device_init(struct spi_device * dev, uint8_t cs, uint8_t mode, uint8_t cspol, uint16_t divider);
+
+extern void spi_device_set_bus(struct spi_device * dev, uint8_t bus);
+
+extern void spi_device_set_gpio_cs(struct spi_device * dev, uint8_t pin, uint16_t setup_ns, uint16_t hold_ns);
+
+extern uint32_t spi_device_set_speed(struct spi_device * dev, uint32_t hz);
+
+extern void spi_device_select(struct spi_device * dev);
+
+extern void spi_device_transfer(struct spi_device * dev, const char * wbuf, char * rbuf, size_t len);
+
+/* 9-bit (LoSSI) command/data transfers */
+extern void spi_lossi_write(struct spi_device * dev, int cmd, const uint8_t * data, size_t len);
+
+/* SPI0 and the auxiliary SPI1/SPI2 buses */
+extern int spi_bus_start(uint8_t bus);
+
+extern void spi_bus_stop(uint8_t bus);
+
+/* Kernel /dev/spidevB.C backend */
+extern int spi_open_dev(uint8_t bus, uint8_t cs);
+
+extern void spi_close_dev(void);
+
+
+/* SPI ADC acquisition (MCP3008 class) */
+struct adc_config {
+	struct spi_device * dev;
+	uint8_t channels[8];	/* channels to sample round-robin */
+	uint8_t nch;		/* no. of channels */
+	uint16_t decimation;	/* frames aggregated per record and channel */
+	uint8_t burst;		/* frames per chip select assertion, 1 to 21 */
+	uint32_t rate_hz;	/* frames per second, 0 = as fast as the bus allows */
+	uint32_t ring_size;	/* records, 0 = 4096 */
+};
+
+struct adc_sample {
+	uint64_t timestamp;	/* system timer us of the last frame */
+	uint8_t channel;
+	uint16_t min;
+	uint16_t max;
+	uint16_t mean;
+	uint16_t count;		/* frames aggregated */
+};
+
+extern int spi_adc_start(const struct adc_config * cfg);
+
+extern void spi_adc_stop(void);
+
+extern uint32_t spi_adc_read(struct adc_sample * samples, uint32_t max);
+
+extern void spi_adc_stats(uint64_t * frames, uint32_t * overruns);
+
+/* SPI streaming into memory-mapped files */
+#define SPI_STREAM_ASYNC	0x1	/* start writeback after each window */
+#define SPI_STREAM_SYNC		0x2	/* wait for each window to be on disk */
+#define SPI_STREAM_DROP		0x4	/* drop written windows from memory */
+
+extern int64_t spi_stream_file(struct spi_device * dev, const char * path, uint64_t total, size_t window, uint8_t policy);
+
+extern void spi_stream_stop(void);
+
+/* SPI display (ILI9341/ST7789 class) framebuffer */
+#define DISPLAY_MAX_DIRTY	8
+#define DISPLAY_LOSSI		0xFF	/* dc_pin for 9-bit panels */
+
+struct display_rect {
+	int x0, y0, x1, y1;	/* x1, y1 exclusive */
+};
+
+struct display {
+	struct spi_device * dev;
+	uint32_t dc_mask;	/* D/C GPIO pin mask, 0 for 9-bit panels */
+	uint16_t width;
+	uint16_t height;
+	uint16_t * fb;		/* pixels in panel byte order */
+	uint16_t * stage;	/* staging buffer for partial width rectangles */
+	struct display_rect dirty[DISPLAY_MAX_DIRTY];
+	int ndirty;
+	uint32_t frame_us;	/* duration of the last display_flush() */
+	uint32_t frame_bytes;	/* bytes sent by the last display_flush() */
+	uint32_t frames;
+};
+
+extern int display_init(struct display * d, struct spi_device * dev, uint8_t dc_pin, uint16_t width, uint16_t height);
+
+extern void display_free(struct display * d);
+
+extern void display_command(struct display * d, uint8_t cmd, const uint8_t * params, size_t len);
+
+extern void display_mark_dirty(struct display * d, int x, int y, int w, int h);
+
+extern void display_pixel(struct display * d, int x, int y, uint16_t color);
+
+extern void display_fill_rect(struct display * d, int x, int y, int w, int h, uint16_t color);
+
+extern void display_blit(struct display * d, int x, int y, int w, int h, const uint16_t * pixels);
+
+extern uint32_t display_flush(struct display * d);
+
+/* SPI slave (BSC/SPI slave peripheral) */
+extern int spi_slave_start(uint8_t mode, uint32_t ring_size, int cpu);
+
+extern void spi_slave_stop(void);
+
+extern size_t spi_slave_read(uint8_t * buf, size_t len);
+
+extern void spi_slave_stats(uint64_t * bytes, uint64_t * dropped, uint32_t * overruns);
+
+/* PL011 UART0 */
+#define UART_RTSCTS		0x1
+#define UART_2STOP		0x2
+#define UART_PARITY_EVEN	0x4
+#define UART_PARITY_ODD		0x8
+
+extern uint32_t uart_start(uint32_t baud, uint32_t flags, uint32_t ring_size, int cpu);
+
+extern void uart_stop(void);
+
+extern size_t uart_write(const uint8_t * buf, size_t len);
+
+extern size_t uart_read(uint8_t * buf, size_t len);
+
+extern void uart_stats(uint64_t * tx_bytes, uint64_t * rx_bytes, uint64_t * dropped, uint32_t * overruns, uint32_t * framing);
+
+/* PCM/I2S audio */
+#define PCM_FMT_I2S		0
+#define PCM_FMT_LEFT_J		1	/* left justified */
+#define PCM_FMT_DSP		2	/* short frame sync, channels back to back */
+
+#define PCM_TX			0x1
+#define PCM_RX			0x2
+#define PCM_SLAVE		0x4	/* bit clock and frame sync from the codec */
+
+struct pcm_config {
+	uint32_t rate;		/* frames per second */
+	uint8_t channels;	/* 1 or 2 */
+	uint8_t bits;		/* sample width, 8 to 32 */
+	uint8_t slot_bits;	/* bits per channel slot, 0 = bits */
+	uint8_t format;
+	uint8_t flags;
+	uint32_t ring_size;	/* samples, 0 = 65536 */
+	int cpu;		/* engine thread CPU, -1 = no pinning */
+};
+
+extern int pcm_start(const struct pcm_config * cfg);
+
+extern void pcm_stop(void);
+
+extern size_t pcm_write(const int32_t * samples, size_t n);
+
+extern size_t pcm_read(int32_t * samples, size_t n);
+
+extern void pcm_drain(void);
+
+extern long pcm_play_wav(const char * path);
+
+extern void pcm_stats(uint64_t * tx_samples, uint64_t * rx_samples, uint64_t * rx_dropped,
+		      uint32_t * ring_underruns, uint32_t * fifo_underruns, uint32_t * fifo_overruns);
+
+/* DMA simulator, for off-target tests of the DMA engines */
+extern void dma_sim_enable(int on);
+
+extern void dma_sim_input(uint32_t (*fn)(uint64_t ns));
+
+extern void dma_sim_gpio_hook(void (*fn)(uint64_t ns, uint32_t levels));
+
+extern uint64_t dma_sim_time(void);
+
+extern uint32_t dma_sim_gpio(void);
+
+extern long dma_sim_run(uint8_t ch, uint32_t max_cbs);
+
+/* DMA for large SPI0 transfers */
+extern int spi_dma_init(uint8_t tx_ch, uint8_t rx_ch);
+
+extern void spi_dma_close(void);
+
+/* DMA paced GPIO waveforms */
+struct wave_pulse {
+	uint32_t set;		/* GPIO 0-31 mask to set */
+	uint32_t clr;		/* GPIO 0-31 mask to clear */
+	uint32_t delay_ns;	/* time to the next pulse */
+};
+
+extern int wave_init(uint8_t dma_ch, uint32_t tick_ns);
+
+extern int wave_send(const struct wave_pulse * pulses, size_t n, int repeat);
+
+extern int wave_busy(void);
+
+extern void wave_stop(void);
+
+extern void wave_close(void);
+
+/* DMA GPIO sampling */
+struct gpio_edge {
+	uint64_t time_ns;	/* system timer based */
+	uint32_t levels;	/* GPIO 0-31 levels after the edge */
+	uint32_t changed;	/* pins that changed */
+};
+
+extern int gpio_sample_start(uint8_t dma_ch, uint32_t rate_hz, uint32_t nsamples);	/* up to 1 MHz */
+
+extern void gpio_sample_stop(void);
+
+extern size_t gpio_sample_edges(struct gpio_edge * edges, size_t max, uint32_t mask);
+
+extern uint32_t gpio_sample_overruns(void);
+
+/* Software SPI on any GPIO pins */
+#define SOFT_SPI_NONE		0xFF	/* no MISO or chip select pin */
+#define SOFT_SPI_LSB_FIRST	0x1
+#define SOFT_SPI_3WIRE		0x2	/* half-duplex on the MOSI pin */
+
+struct soft_spi {
+	uint8_t mosi;
+	uint8_t mode;
+	uint8_t bits;		/* word size, 1 to 32 */
+	uint8_t flags;
+	uint32_t half_period_ns;
+	uint32_t clk_mask;
+	uint32_t mosi_mask;
+	uint32_t miso_mask;
+	uint32_t cs_mask;
+	uint32_t idle;		/* clock idle level as a pin mask */
+};
+
+extern int soft_spi_init(struct soft_spi * bus, uint8_t sclk, uint8_t mosi, uint8_t miso, uint8_t cs,
+			 uint8_t mode, uint8_t bits, uint8_t flags, uint32_t half_period_ns);
+
+extern void soft_spi_transfer(const struct soft_spi * bus, const uint32_t * wbuf, uint32_t * rbuf, size_t n);
+
+extern void soft_spi_write_read(const struct soft_spi * bus, const uint32_t * wbuf, size_t wn, uint32_t * rbuf, size_t rn);
+
+/* Software I2C master on any GPIO pins */
+struct soft_i2c {
+	uint32_t sda_mask;
+	uint32_t scl_mask;
+	uint8_t sda_reg;	/* GPFSEL word index and bit shift of each pin */
+	uint8_t scl_reg;
+	uint8_t sda_shift;
+	uint8_t scl_shift;
+	uint32_t sda_out;	/* GPFSEL output bits */
+	uint32_t scl_out;
+	uint32_t sda_shadow;	/* GPFSEL words with both pins as input */
+	uint32_t scl_shadow;
+	uint8_t sda_low;
+	uint8_t scl_low;
+	uint32_t half_us;	/* half SCL period: whole us on the system timer */
+	uint32_t pad_loops;	/* and the sub-us rest as busy-wait loops */
+	uint32_t rise_loops;
+	uint32_t stretch_us;
+	uint64_t mark;		/* system timer at the last SCL edge */
+};
+
+extern int soft_i2c_init(struct soft_i2c * bus, uint8_t sda, uint8_t scl, uint32_t hz, uint32_t stretch_us);
+
+extern uint8_t soft_i2c_transfer(struct soft_i2c * bus, uint8_t addr, const char * wbuf, uint16_t wlen, char * rbuf, uint16_t rlen);
+
+extern uint8_t soft_i2c_write(struct soft_i2c * bus, uint8_t addr, const char * wbuf, uint16_t len);
+
+extern uint8_t soft_i2c_read(struct soft_i2c * bus, uint8_t addr, char * rbuf, uint16_t len);
+
+/* Software UART (8N1) on any GPIO pins */
+#define SOFT_UART_NONE		0xFF	/* no TX or RX pin */
+
+extern int soft_uart_open(uint8_t tx, uint8_t rx, uint32_t baud);
+
+extern void soft_uart_close(int ch);
+
+extern size_t soft_uart_write(int ch, const uint8_t * buf, size_t len);
+
+extern size_t soft_uart_read(int ch, uint8_t * buf, size_t len);
+
+extern void soft_uart_stats(int ch, uint64_t * tx_bytes, uint64_t * rx_bytes, uint32_t * framing_errors, uint32_t * dropped);
+
+/*
+ * Batched commands, run by rpi_exec() in-process or by the peripheral daemon
+ *
+ * RPI_OP_GPIO_MODE	pin, arg0 = gpio_config() mode
+ * RPI_OP_GPIO_PULL	pin, arg0 = 0 off, 1 pull-down, 2 pull-up
+ * RPI_OP_GPIO_WRITE	arg0 = GPIO 0-31 mask, arg1 = levels
+ * RPI_OP_GPIO_READ	result = GPIO 0-31 levels
+ * RPI_OP_PWM		pin = 12, 13, 18 or 19, arg0 = range (0 = off), arg1 = data
+ * RPI_OP_I2C		pin = address, arg0 = SCL Hz (0 = unchanged),
+ *			writes wlen bytes from data + doff, reads rlen bytes into data + doff + wlen
+ * RPI_OP_SPI		pin = chip select 0/1, arg0 = mode, arg1 = Hz (0 = 1 MHz),
+ *			full-duplex transfer of wlen bytes in place at data + doff
+ * RPI_OP_WAIT		arg0 = us
+ */
+#define RPI_OP_NOP		0
+#define RPI_OP_GPIO_MODE	1
+#define RPI_OP_GPIO_PULL	2
+#define RPI_OP_GPIO_WRITE	3
+#define RPI_OP_GPIO_READ	4
+#define RPI_OP_PWM		5
+#define RPI_OP_I2C		6
+#define RPI_OP_SPI		7
+#define RPI_OP_WAIT		8
+
+#define RPI_ERR_INVALID		0xFFFF	/* bad opcode, parameter or data range */
+
+struct rpi_cmd {
+	uint8_t op;
+	uint8_t pin;		/* GPIO pin, I2C address or SPI chip select */
+	uint16_t status;	/* 0 = ok, I2C status, RPI_ERR_INVALID */
+	uint16_t wlen;
+	uint16_t rlen;
+	uint32_t doff;		/* offset of the command data in the batch data */
+	uint32_t arg0;
+	uint32_t arg1;
+	uint32_t result;
+};
+
+/* Batch message header, followed by ncmd struct rpi_cmd and dlen bytes of data */
+struct rpi_batch {
+	uint32_t ncmd;
+	uint32_t dlen;
+	uint32_t seq;		/* request no., returned unchanged in the reply */
+};
+
+extern uint32_t rpi_exec(struct rpi_cmd * cmd, uint32_t n, uint8_t * data, uint32_t dlen);
+
+/* Peripheral daemon and its clients */
+extern int rpid_serve(mode_t mode);
+
+extern void rpid_stop(void);
+
+extern int rpi_client_open(void);
+
+extern void rpi_client_close(void);
+
+extern int rpi_client_exec(struct rpi_cmd * cmd, uint32_t n, uint8_t * data, uint32_t dlen);
 
 
 #ifdef __cplusplus
@@ -0,0 +1,323 @@
+/************************
+
+   Command Line Tool
+
+   GPIO, PWM, I2C and SPI access
+   from the shell, one command per
+   invocation or a stream of commands
+   after a single rpi_init()
+
+************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "rpi.h"
+
+/**
+ * Usage:
+ *
+ * $ sudo ./rpicmd list				mode and level of GPIO 0-27
+ * $ sudo ./rpicmd read <pin>
+ * $ sudo ./rpicmd write <pin> <0|1>
+ * $ sudo ./rpicmd mode <pin> <in|out|alt0-alt5>
+ * $ sudo ./rpicmd pull <pin> <off|down|up>
+ * $ sudo ./rpicmd pwm <12|13|18|19> <range> <data>	range 0 turns the pin off
+ * $ sudo ./rpicmd i2c <addr> [bytes ...] [r<n>]	write bytes, then read n bytes
+ * $ sudo ./rpicmd spi <cs> [bytes ...]		full-duplex transfer, mode 0, 1 MHz
+ * $ sudo ./rpicmd scan				I2C addresses 0x03-0x77 that ACK
+ * $ sudo ./rpicmd wait <us>
+ * $ sudo ./rpicmd batch [file]			commands from a file or stdin
+ *
+ * Numbers may be decimal or 0x hex. In batch mode each line holds one command,
+ * blank lines and lines starting with # are skipped, and the latency of every
+ * command is reported on stderr.
+ */
+
+#define MAX_CMD		128
+#define MAX_DATA	4096
+#define MAX_ARGS	64
+#define LINE_LEN	1024
+
+static const char *mode_name[8] = { "in", "out", "alt5", "alt4", "alt0", "alt1", "alt2", "alt3" };
+
+static struct rpi_cmd cmd[MAX_CMD];
+static uint8_t data[MAX_DATA];
+
+/* parse a decimal or 0x hex number, returns 0 on failure */
+static int number(const char *s, uint32_t *v)
+{
+	char *end;
+	unsigned long n = strtoul(s, &end, 0);
+
+	if(*s == '\0' || *end != '\0' || n > 0xFFFFFFFFUL){
+		return 0;
+	}
+	*v = (uint32_t)n;
+	return 1;
+}
+
+/* parse a GPIO pin no. up to max */
+static int pin_number(const char *s, uint32_t max, uint8_t *pin)
+{
+	uint32_t v;
+
+	if(!number(s, &v) || v > max){
+		printf("invalid pin %s\n", s);
+		return 0;
+	}
+	*pin = (uint8_t)v;
+	return 1;
+}
+
+/* parse data bytes, and an optional r<n> read length for I2C */
+static int data_bytes(int argc, char *argv[], int reads, uint16_t *wlen, uint16_t *rlen)
+{
+	uint32_t v;
+	int i;
+
+	*wlen = 0;
+	*rlen = 0;
+	for(i = 0; i < argc; i++){
+		if(reads && argv[i][0] == 'r' && i == argc - 1){
+			if(!number(argv[i] + 1, &v) || v > (uint32_t)(MAX_DATA - *wlen)){
+				printf("invalid read length %s\n", argv[i]);
+				return 0;
+			}
+			*rlen = (uint16_t)v;
+		}
+		else if(!number(argv[i], &v) || v > 0xFF || *wlen >= MAX_DATA){
+			printf("invalid byte %s\n", argv[i]);
+			return 0;
+		}
+		else{
+			data[(*wlen)++] = (uint8_t)v;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Translate one command line into rpi_cmd entries
+ * Returns the no. of commands, 0 on a usage error
+ */
+static uint32_t build(int argc, char *argv[])
+{
+	struct rpi_cmd *c = &cmd[0];
+	uint32_t v, i;
+	char *op = argv[0];
+
+	memset(cmd, 0, sizeof(cmd));
+
+	if(strcmp(op, "list") == 0 && argc == 1){
+		c->op = RPI_OP_GPIO_READ;
+		return 1;
+	}
+	if(strcmp(op, "read") == 0 && argc == 2){
+		c->op = RPI_OP_GPIO_READ;
+		return pin_number(argv[1], 31, &c->pin);
+	}
+	if(strcmp(op, "write") == 0 && argc == 3){
+		if(!pin_number(argv[1], 31, &c->pin) || !number(argv[2], &v) || v > 1){
+			return 0;
+		}
+		c->op = RPI_OP_GPIO_WRITE;
+		c->arg0 = 1UL << c->pin;
+		c->arg1 = v << c->pin;
+		return 1;
+	}
+	if(strcmp(op, "mode") == 0 && argc == 3){
+		c->op = RPI_OP_GPIO_MODE;
+		for(i = 0; i < 8 && strcmp(argv[2], mode_name[i]) != 0; i++);
+		c->arg0 = i;
+		if(i == 8){
+			printf("invalid mode %s\n", argv[2]);
+			return 0;
+		}
+		return pin_number(argv[1], 53, &c->pin);
+	}
+	if(strcmp(op, "pull") == 0 && argc == 3){
+		c->op = RPI_OP_GPIO_PULL;
+		c->arg0 = strcmp(argv[2], "off") == 0 ? 0 : strcmp(argv[2], "down") == 0 ? 1 : strcmp(argv[2], "up") == 0 ? 2 : 3;
+		if(c->arg0 == 3){
+			printf("invalid pull %s\n", argv[2]);
+			return 0;
+		}
+		return pin_number(argv[1], 31, &c->pin);
+	}
+	if(strcmp(op, "pwm") == 0 && argc == 4){
+		c->op = RPI_OP_PWM;
+		return pin_number(argv[1], 53, &c->pin) && number(argv[2], &c->arg0) && number(argv[3], &c->arg1);
+	}
+	if(strcmp(op, "i2c") == 0 && argc >= 2){
+		c->op = RPI_OP_I2C;
+		if(!number(argv[1], &v) || v > 0x7F){
+			return 0;
+		}
+		c->pin = (uint8_t)v;
+		return data_bytes(argc - 2, argv + 2, 1, &c->wlen, &c->rlen);
+	}
+	if(strcmp(op, "spi") == 0 && argc >= 2){
+		c->op = RPI_OP_SPI;
+		return pin_number(argv[1], 1, &c->pin) && data_bytes(argc - 2, argv + 2, 0, &c->wlen, &c->rlen);
+	}
+	if(strcmp(op, "scan") == 0 && argc == 1){
+		/* a one byte read from every address, each command reads into its own byte */
+		for(i = 0; i <= 0x77 - 0x03; i++){
+			cmd[i].op = RPI_OP_I2C;
+			cmd[i].pin = (uint8_t)(i + 0x03);
+			cmd[i].rlen = 1;
+			cmd[i].doff = i;
+		}
+		return i;
+	}
+	if(strcmp(op, "wait") == 0 && argc == 2){
+		c->op = RPI_OP_WAIT;
+		return number(argv[1], &c->arg0);
+	}
+	printf("invalid command or arguments: %s\n", op);
+	return 0;
+}
+
+/* print the results of a completed command, returns 0 if it failed */
+static int report(char *op, uint32_t n)
+{
+	uint32_t i, levels;
+	int found = 0;
+
+	if(strcmp(op, "scan") == 0){
+		for(i = 0; i < n; i++){
+			if(cmd[i].status == 0){
+				printf("%s0x%02x", found++ ? " " : "", cmd[i].pin);
+			}
+		}
+		puts(found ? "" : "no devices found");
+		return 1;
+	}
+
+	if(cmd[0].status == RPI_ERR_INVALID){
+		printf("%s: invalid parameter\n", op);
+		return 0;
+	}
+	if(cmd[0].status != 0){
+		printf("%s: bus error %u\n", op, cmd[0].status);
+		return 0;
+	}
+
+	if(strcmp(op, "list") == 0){
+		levels = cmd[0].result;
+		for(i = 0; i < 28; i++){
+			printf("GPIO %2u  %-4s  %u\n", i, mode_name[gpio_get_config((uint8_t)i)], (levels >> i) & 1);
+		}
+	}
+	else if(strcmp(op, "read") == 0){
+		printf("%u\n", (cmd[0].result >> cmd[0].pin) & 1);
+	}
+	else if(strcmp(op, "i2c") == 0 || strcmp(op, "spi") == 0){
+		/* I2C reads land after the written bytes, SPI reads replace them */
+		uint32_t off = strcmp(op, "i2c") == 0 ? cmd[0].wlen : 0;
+		n = strcmp(op, "i2c") == 0 ? cmd[0].rlen : cmd[0].wlen;
+		for(i = 0; i < n; i++){
+			printf("%s0x%02x", i ? " " : "", data[off + i]);
+		}
+		if(n > 0){
+			puts("");
+		}
+	}
+	return 1;
+}
+
+/*
+ * Build, run and report one command, latency_us returns the rpi_exec() time
+ * Returns 1 on success, 0 if the command failed, -1 if it could not be parsed
+ */
+static int run(int argc, char *argv[], double *latency_us)
+{
+	struct timespec t0, t1;
+	uint32_t n = build(argc, argv);
+
+	if(n == 0){
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	rpi_exec(cmd, n, data, MAX_DATA);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	*latency_us = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+	return report(argv[0], n);
+}
+
+/* run commands line by line, returns the no. of failed commands */
+static int batch(FILE *fp)
+{
+	char line[LINE_LEN];
+	char *argv[MAX_ARGS];
+	double us, total = 0, max = 0;
+	int argc, ret, count = 0, timed = 0, errors = 0;
+
+	while(fgets(line, sizeof(line), fp) != NULL){
+		argc = 0;
+		for(argv[argc] = strtok(line, " \t\r\n"); argv[argc] != NULL && argc < MAX_ARGS - 1; argv[argc] = strtok(NULL, " \t\r\n")){
+			argc++;
+		}
+		if(argc == 0 || argv[0][0] == '#'){
+			continue;
+		}
+		ret = run(argc, argv, &us);
+		fflush(stdout);
+		count++;
+		errors += ret != 1;
+		if(ret < 0){
+			continue;
+		}
+		fprintf(stderr, "# %-6s %10.1f us\n", argv[0], us);
+		timed++;
+		total += us;
+		max = us > max ? us : max;
+	}
+	if(timed > 0){
+		fprintf(stderr, "# %d commands, %d failed, mean %.1f us, max %.1f us\n", count, errors, total / timed, max);
+	}
+	return errors;
+}
+
+/************
+
+    main
+
+*************/
+int main(int argc, char *argv[]){
+
+	FILE *fp = stdin;
+	double us;
+	int errors;
+
+	if(argc < 2){
+		puts("usage: rpicmd list | read | write | mode | pull | pwm | i2c | spi | scan | wait | batch [file]");
+		return 1;
+	}
+
+	if(strcmp(argv[1], "batch") == 0 && argc > 2 && strcmp(argv[2], "-") != 0){
+		fp = fopen(argv[2], "r");
+		if(fp == NULL){
+			perror(argv[2]);
+			return 1;
+		}
+	}
+
+	rpi_init();
+
+	if(strcmp(argv[1], "batch") == 0){
+		errors = batch(fp);
+	}
+	else{
+		errors = run(argc - 1, argv + 1, &us) != 1;
+	}
+
+	if(fp != stdin){
+		fclose(fp);
+	}
+	rpi_close();
+	return errors ? 1 : 0;
+}
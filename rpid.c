@@ -0,0 +1,117 @@
+/************************
+
+   Peripheral Daemon
+
+   Owns the peripherals and runs
+   the batched commands of client
+   processes (rpi_client_open())
+   over shared memory rings
+
+************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#include "rpi.h"
+
+/**
+ * Usage:
+ *
+ * $ sudo ./rpid		shared memory /dev/shm/rpid, read-write for root only
+ * $ sudo ./rpid 0660		read-write for the group of /dev/shm/rpid as well
+ * $ ./rpid bench		round trips per second as a client, single and batched
+ *
+ * A client then calls rpi_client_open() instead of rpi_init(), and
+ * rpi_client_exec() to run a batch of struct rpi_cmd in the daemon.
+ */
+
+#define BENCH_COUNT	20000
+#define BENCH_BATCH	64
+
+/* Ctrl-C handler */
+void sighandler(int signum)
+{
+	(void)signum;
+	rpid_stop();
+}
+
+/* elapsed time in seconds */
+static double elapsed(struct timespec *t0)
+{
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+/* run a batch of n GPIO reads count/n times, returns operations per second */
+static double bench_run(uint32_t n, double *rtt_us)
+{
+	static struct rpi_cmd c[BENCH_BATCH];
+	struct timespec t0;
+	uint32_t i, k;
+	double t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(i = 0; i < BENCH_COUNT; i += n){
+		memset(c, 0, n * sizeof(*c));
+		for(k = 0; k < n; k++){
+			c[k].op = RPI_OP_GPIO_READ;
+		}
+		if(rpi_client_exec(c, n, NULL, 0) < 0){
+			puts("bench error: no answer from rpid.");
+			exit(1);
+		}
+	}
+	t = elapsed(&t0);
+	*rtt_us = t * 1e6 / (i / n);
+	return i / t;
+}
+
+/* operations per second and round trip time, one per request and batched */
+static int bench(void)
+{
+	double rtt;
+
+	if(!rpi_client_open()){
+		return 0;
+	}
+	printf("single:  %10.0f ops/s, %6.1f us per round trip\n", bench_run(1, &rtt), rtt);
+	printf("batch%d: %10.0f ops/s, %6.1f us per round trip\n", BENCH_BATCH, bench_run(BENCH_BATCH, &rtt), rtt);
+	rpi_client_close();
+	return 1;
+}
+
+/************
+
+    main
+
+*************/
+int main(int argc, char *argv[]){
+
+	mode_t mode = argc > 1 ? (mode_t)strtoul(argv[1], NULL, 8) : 0600;
+	struct sigaction sa;
+
+	if(argc > 1 && strcmp(argv[1], "bench") == 0){
+		return bench() ? 0 : 1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sighandler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	rpi_init();
+
+	puts("rpid running ...");
+	if(!rpid_serve(mode)){
+		rpi_close();
+		exit(1);
+	}
+
+	puts("\nclosing rpi ...");
+	rpi_close();
+	return 0;
+}
@@ -0,0 +1,349 @@
+/************************
+
+   Unix Socket Command Server
+
+   Runs batches of struct rpi_cmd
+   sent over a Unix domain socket,
+   for tools that cannot link the
+   library (Python, shell)
+
+************************/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "rpi.h"
+
+/**
+ * Usage:
+ *
+ * $ sudo ./rpisock [path]		serve on path (default /tmp/rpi.sock)
+ * $ ./rpisock bench [path]		operations per second, single and batched
+ *
+ * Protocol, all fields little-endian:
+ *
+ * request	uint32 length, then a message of that length
+ * message	struct rpi_batch { ncmd, dlen, seq }, ncmd struct rpi_cmd (24 bytes each), dlen data bytes
+ * response	the same message, with status/result of each command and the read data filled in
+ *
+ * See rpi.h for the commands. An invalid message is answered with ncmd = 0, dlen = 0
+ * and its seq.
+ */
+
+#define SOCK_PATH	"/tmp/rpi.sock"
+#define MAX_CLIENTS	16
+#define MSG_MAX		(1024 * 1024)
+
+#define BENCH_COUNT	20000
+#define BENCH_BATCH	64
+
+/* the reply is built in place of the request and sent from the same buffer */
+struct client {
+	int fd;
+	uint32_t have;		/* bytes received, length word included */
+	uint32_t out;		/* reply bytes to send, 0 while reading a request */
+	uint32_t sent;
+	uint8_t *buf;
+};
+
+static volatile sig_atomic_t running = 1;
+
+/* Ctrl-C handler */
+void sighandler(int signum)
+{
+	(void)signum;
+	running = 0;
+}
+
+/* write all bytes, returns 0 on failure */
+static int send_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t n;
+
+	while(len > 0){
+		n = send(fd, p, len, MSG_NOSIGNAL);
+		if(n < 0 && errno == EINTR){
+			continue;
+		}
+		if(n <= 0){
+			return 0;
+		}
+		p += n;
+		len -= (size_t)n;
+	}
+	return 1;
+}
+
+/* read all bytes, returns 0 on failure */
+static int recv_all(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	ssize_t n;
+
+	while(len > 0){
+		n = recv(fd, p, len, 0);
+		if(n < 0 && errno == EINTR){
+			continue;
+		}
+		if(n <= 0){
+			return 0;
+		}
+		p += n;
+		len -= (size_t)n;
+	}
+	return 1;
+}
+
+/* run one complete message in place, returns the length of the reply with its length word */
+static uint32_t run_message(uint8_t *buf, uint32_t len)
+{
+	uint8_t *msg = buf + 4;
+	struct rpi_batch *b = (struct rpi_batch *)msg;
+	uint32_t seq;
+
+	if(len < sizeof(*b) || b->ncmd > (len - sizeof(*b)) / sizeof(struct rpi_cmd)
+	   || b->dlen != len - sizeof(*b) - b->ncmd * sizeof(struct rpi_cmd)){
+		seq = len >= sizeof(*b) ? b->seq : 0;
+		memset(b, 0, sizeof(*b));
+		b->seq = seq;
+		len = sizeof(*b);
+	}
+	else{
+		rpi_exec((struct rpi_cmd *)(b + 1), b->ncmd,
+			 msg + sizeof(*b) + b->ncmd * sizeof(struct rpi_cmd), b->dlen);
+	}
+	memcpy(buf, &len, 4);
+	return len + 4;
+}
+
+/*
+ * Read requests and send replies without blocking, returns 0 to drop the client
+ * A client gets no new request read until its reply is out, so one that does
+ * not read its replies only stalls itself.
+ */
+static int client_io(struct client *c)
+{
+	uint32_t len;
+	ssize_t n;
+
+	for(;;){
+		if(c->out > 0){
+			n = send(c->fd, c->buf + c->sent, c->out - c->sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+				return 1;
+			}
+			if(n < 0 && errno == EINTR){
+				continue;
+			}
+			if(n <= 0){
+				return 0;
+			}
+			c->sent += (uint32_t)n;
+			if(c->sent == c->out){
+				c->out = 0;
+				c->have = 0;
+			}
+			continue;
+		}
+
+		len = MSG_MAX + 4;
+		if(c->have >= 4){
+			memcpy(&len, c->buf, 4);
+			if(len > MSG_MAX){
+				return 0;
+			}
+			len += 4;
+			if(c->have == len){
+				c->out = run_message(c->buf, len - 4);
+				c->sent = 0;
+				continue;
+			}
+		}
+		n = recv(c->fd, c->buf + c->have, (c->have < 4 ? 4 : len) - c->have, MSG_DONTWAIT);
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+			return 1;
+		}
+		if(n < 0 && errno == EINTR){
+			continue;
+		}
+		if(n <= 0){
+			return 0;
+		}
+		c->have += (uint32_t)n;
+	}
+}
+
+/* serve clients until Ctrl-C */
+static int serve(const char *path)
+{
+	struct pollfd pfd[MAX_CLIENTS + 1];
+	struct client cl[MAX_CLIENTS];
+	struct sockaddr_un addr;
+	int lfd, fd, i, n;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path);
+	if(lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, MAX_CLIENTS) < 0){
+		perror("socket error");
+		return 0;
+	}
+	chmod(path, 0660);
+
+	for(i = 0; i < MAX_CLIENTS; i++){
+		cl[i].fd = -1;
+		cl[i].have = 0;
+		cl[i].out = 0;
+		cl[i].buf = NULL;
+	}
+
+	printf("serving on %s ...\n", path);
+	while(running){
+
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		for(i = 0; i < MAX_CLIENTS; i++){
+			pfd[i + 1].fd = cl[i].fd;
+			pfd[i + 1].events = cl[i].out > 0 ? POLLOUT : POLLIN;
+		}
+		n = poll(pfd, MAX_CLIENTS + 1, 1000);
+		if(n <= 0){
+			continue;
+		}
+
+		if(pfd[0].revents & POLLIN){
+			fd = accept(lfd, NULL, NULL);
+			for(i = 0; fd >= 0 && i < MAX_CLIENTS && cl[i].fd >= 0; i++);
+			if(fd >= 0 && i < MAX_CLIENTS && (cl[i].buf = malloc(MSG_MAX + 4)) != NULL){
+				cl[i].fd = fd;
+				cl[i].have = 0;
+				cl[i].out = 0;
+			}
+			else if(fd >= 0){
+				close(fd);
+			}
+		}
+
+		for(i = 0; i < MAX_CLIENTS; i++){
+			if(cl[i].fd >= 0 && (pfd[i + 1].revents & (POLLIN | POLLOUT | POLLHUP | POLLERR))){
+				if(!client_io(&cl[i])){
+					close(cl[i].fd);
+					free(cl[i].buf);
+					cl[i].fd = -1;
+					cl[i].buf = NULL;
+				}
+			}
+		}
+	}
+
+	for(i = 0; i < MAX_CLIENTS; i++){
+		if(cl[i].fd >= 0){
+			close(cl[i].fd);
+			free(cl[i].buf);
+		}
+	}
+	close(lfd);
+	unlink(path);
+	return 1;
+}
+
+/* elapsed time in seconds */
+static double elapsed(struct timespec *t0)
+{
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+/* send a batch of n GPIO reads count/n times, returns operations per second */
+static double bench_run(int fd, uint32_t n)
+{
+	static uint8_t msg[4 + sizeof(struct rpi_batch) + BENCH_BATCH * sizeof(struct rpi_cmd)];
+	struct rpi_batch *b = (struct rpi_batch *)(msg + 4);
+	struct rpi_cmd *c = (struct rpi_cmd *)(b + 1);
+	uint32_t len = sizeof(*b) + n * sizeof(*c), i;
+	struct timespec t0;
+
+	memcpy(msg, &len, 4);
+	b->ncmd = n;
+	b->dlen = 0;
+	b->seq = 0;
+	memset(c, 0, n * sizeof(*c));
+	for(i = 0; i < n; i++){
+		c[i].op = RPI_OP_GPIO_READ;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(i = 0; i < BENCH_COUNT; i += n){
+		if(!send_all(fd, msg, 4 + len) || !recv_all(fd, msg, 4 + len)){
+			puts("bench error: connection lost.");
+			exit(1);
+		}
+	}
+	return i / elapsed(&t0);
+}
+
+/* operations per second, one per request and batched */
+static int bench(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+		perror("connect error");
+		return 0;
+	}
+	printf("single:  %10.0f ops/s\n", bench_run(fd, 1));
+	printf("batch%d: %10.0f ops/s\n", BENCH_BATCH, bench_run(fd, BENCH_BATCH));
+	close(fd);
+	return 1;
+}
+
+/************
+
+    main
+
+*************/
+int main(int argc, char *argv[]){
+
+	struct sigaction sa;
+
+	if(argc > 1 && strcmp(argv[1], "bench") == 0){
+		return bench(argc > 2 ? argv[2] : SOCK_PATH) ? 0 : 1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sighandler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	rpi_init();
+
+	if(!serve(argc > 1 ? argv[1] : SOCK_PATH)){
+		rpi_close();
+		exit(1);
+	}
+
+	puts("\nclosing rpi ...");
+	rpi_close();
+	return 0;
+}
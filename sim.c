@@ -0,0 +1,161 @@
+/************************
+
+   DMA Simulator Self-Test
+
+   Runs the DMA engines against
+   the built-in simulator, no
+   Raspberry Pi or root needed
+
+************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "rpi.h"
+
+/**
+ * Usage:
+ *
+ * $ ./sim		exit status 0 if all checks pass
+ *
+ * Checks:
+ *
+ * spi		3 MB SPI0 DMA transfer, the simulated FIFO loops MOSI back to MISO
+ * wave		waveform edges at the programmed times on the simulated GPIO
+ * sample	edges of a simulated 50 kHz square wave decoded by the GPIO sampler
+ */
+
+#define SPI_LEN		(3 * 1024 * 1024 + 7)	/* more than a DMA chunk, odd tail */
+
+#define WAVE_TICK	1000			/* ns */
+#define SAMPLE_PIN	17
+#define SAMPLE_HALF	10000			/* ns, half period of the input */
+
+int failed = 0;
+
+/* print and count the result of a check */
+void check(const char *name, int ok)
+{
+	printf("%-8s %s\n", name, ok ? "ok" : "FAILED");
+	failed += !ok;
+}
+
+/* SPI DMA loopback of a buffer larger than one DMA chunk */
+void spi_loopback(void){
+
+	char *wbuf = malloc(SPI_LEN);
+	char *rbuf = malloc(SPI_LEN);
+	size_t i;
+
+	if(wbuf == NULL || rbuf == NULL || !spi_dma_init(12, 13)){
+		check("spi", 0);
+		free(wbuf);
+		free(rbuf);
+		return;
+	}
+	for(i = 0; i < SPI_LEN; i++){
+		wbuf[i] = (char)(i * 7 + i / 65532);
+	}
+	memset(rbuf, 0, SPI_LEN);
+
+	spi_data_transfer(wbuf, rbuf, SPI_LEN);
+	check("spi", memcmp(wbuf, rbuf, SPI_LEN) == 0);
+
+	spi_dma_close();
+	free(wbuf);
+	free(rbuf);
+}
+
+/* GPIO changes seen by the simulator */
+uint64_t edge_ns[8];
+int edge_n = 0;
+
+void wave_hook(uint64_t ns, uint32_t levels){
+
+	(void)levels;
+	if(edge_n < 8){
+		edge_ns[edge_n] = ns;
+	}
+	edge_n++;
+}
+
+/* one shot waveform, each edge must land on its programmed time */
+void wave_edges(void){
+
+	struct wave_pulse p[] = {
+		{ 1 << 4, 0, 5000 },
+		{ 0, 1 << 4, 3000 },
+		{ 1 << 5, 0, 20000 },
+		{ 0, 1 << 5, 1000 },
+	};
+	uint64_t expect[] = { 0, 5000, 8000, 28000 };
+	int i, ok;
+
+	dma_sim_gpio_hook(wave_hook);
+	if(!wave_init(14, WAVE_TICK)){
+		check("wave", 0);
+		return;
+	}
+	wave_send(p, 4, 0);
+	dma_sim_run(14, 0);
+
+	ok = edge_n == 4;
+	for(i = 0; ok && i < 4; i++){
+		ok = edge_ns[i] - edge_ns[0] == expect[i];
+	}
+	check("wave", ok);
+
+	wave_close();
+	dma_sim_gpio_hook(NULL);
+}
+
+/* simulated GPIO input, a square wave on SAMPLE_PIN */
+uint32_t square(uint64_t ns){
+
+	return ((ns / SAMPLE_HALF) & 1) << SAMPLE_PIN;
+}
+
+/* 1 MHz sampling of the square wave, consecutive edges must be SAMPLE_HALF apart */
+void sample_decode(void){
+
+	struct gpio_edge e[64];
+	size_t n, i;
+	int ok;
+
+	dma_sim_input(square);
+	if(!gpio_sample_start(10, 1000000, 1024)){
+		check("sample", 0);
+		return;
+	}
+	dma_sim_run(10, 3 * (1 + 2 * 256));
+	n = gpio_sample_edges(e, 64, 1 << SAMPLE_PIN);
+
+	ok = n > 40;
+	for(i = 1; ok && i < n; i++){
+		ok = e[i].time_ns - e[i - 1].time_ns == SAMPLE_HALF
+		     && e[i].changed == 1 << SAMPLE_PIN
+		     && (e[i].levels ^ e[i - 1].levels) == 1 << SAMPLE_PIN;
+	}
+	check("sample", ok && gpio_sample_overruns() == 0);
+
+	gpio_sample_stop();
+	dma_sim_input(NULL);
+}
+
+/************
+
+    main
+
+*************/
+int main(void){
+
+	dma_sim_enable(1);
+
+	spi_loopback();
+	wave_edges();
+	sample_decode();
+
+	dma_sim_enable(0);
+	return failed ? 1 : 0;
+}
@@ -38,7 +38,7 @@ void mcp2008(void){
         puts("\n*** SPI MCP2008 A/D ***");
 
         /* set data transfer speed */ 
-        spi_set_clock_freq(2500); //100 kHz
+        spi_set_speed_hz(100000); //100 kHz, divider computed from the core clock
 	
 	spi_set_data_mode(0);
 